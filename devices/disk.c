@@ -1,12 +1,15 @@
 #include "devices/disk.h"
 #include <ctype.h>
 #include <debug.h>
+#include <klog.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
    controller.  It attempts to comply to [ATA-3]. */
@@ -28,10 +31,29 @@
 #define reg_ctl(CHANNEL) ((CHANNEL)->reg_base + 0x206)  /* Control (w/o). */
 #define reg_alt_status(CHANNEL) reg_ctl (CHANNEL)       /* Alt Status (r/o). */
 
+/* Bus-master IDE port addresses, relative to the channel's
+   bus-master base (BAR4 of the PCI IDE function, plus 8 for the
+   secondary channel). */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bm_base + 0) /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)  /* Status. */
+#define reg_bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)    /* PRD table. */
+
+/* Bus-master Command Register bits. */
+#define BM_CMD_START 0x01       /* Start/stop the DMA engine. */
+#define BM_CMD_READ 0x08        /* Direction: 1=device to memory. */
+
+/* Bus-master Status Register bits. */
+#define BM_STA_ACTIVE 0x01      /* Transfer in progress. */
+#define BM_STA_ERR 0x02         /* Error (write 1 to clear). */
+#define BM_STA_INTR 0x04        /* Interrupt (write 1 to clear). */
+#define BM_STA_DMA0 0x20        /* Device 0 is DMA capable. */
+#define BM_STA_DMA1 0x40        /* Device 1 is DMA capable. */
+
 /* Alternate Status Register bits. */
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -47,6 +69,25 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Physical Region Descriptor, as read by the bus-master engine.
+   Describes one physically contiguous piece of a transfer that
+   does not cross a 64 kB boundary. */
+struct prd {
+	uint32_t addr;              /* Physical address of the region. */
+	uint16_t size;              /* Byte count; 0 means 64 kB. */
+	uint16_t flags;             /* PRD_EOT on the last entry. */
+};
+#define PRD_EOT 0x8000          /* End of table. */
+#define PRD_CNT 8               /* Entries per channel table. */
+
+/* How long a request may wait behind the elevator before it is
+   served out of order, in timer ticks.  Reads usually have a
+   thread blocked on them, so they get the shorter deadline. */
+#define READ_DEADLINE (TIMER_FREQ / 20)
+#define WRITE_DEADLINE (TIMER_FREQ / 2)
 
 /* An ATA device. */
 struct disk {
@@ -55,6 +96,7 @@ struct disk {
 	int dev_no;                 /* Device 0 or 1 for master or slave. */
 
 	bool is_ata;                /* 1=This device is an ATA disk. */
+	bool dma;                   /* 1=Use bus-master DMA for transfers. */
 	disk_sector_t capacity;     /* Capacity in sectors (if is_ata). */
 
 	long long read_cnt;         /* Number of sectors read. */
@@ -67,12 +109,28 @@ struct channel {
 	char name[8];               /* Name, e.g. "hd0". */
 	uint16_t reg_base;          /* Base I/O port. */
 	uint8_t irq;                /* Interrupt in use. */
+	uint16_t bm_base;           /* Bus-master base port, 0 if none. */
+	struct prd *prdt;           /* PRD table for bus-master DMA. */
 
-	struct lock lock;           /* Must acquire to access the controller. */
 	bool expecting_interrupt;   /* True if an interrupt is expected, false if
 								   any interrupt would be spurious. */
 	struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
+	/* Request queue.  Protected by disabling interrupts, since the
+	   interrupt handler starts each transfer after the first. */
+	struct list queue;          /* Pending requests, in elevator order. */
+	struct list read_fifo;      /* Pending reads, oldest first. */
+	struct list write_fifo;     /* Pending writes, oldest first. */
+	struct list inflight;       /* Requests being transferred. */
+	bool inflight_dma;          /* True if INFLIGHT is a DMA transfer. */
+	uint64_t head;              /* Elevator position after INFLIGHT. */
+
+	/* Transfers run in interrupt context, under whatever page
+	   table is active then, so a buffer that is not in kernel
+	   space is copied through BOUNCE. */
+	struct lock bounce_lock;    /* Protects BOUNCE. */
+	uint8_t *bounce;            /* One sector, in kernel space. */
+
 	struct disk devices[2];     /* The devices on this channel. */
 };
 
@@ -80,17 +138,35 @@ struct channel {
 #define CHANNEL_CNT 2
 static struct channel channels[CHANNEL_CNT];
 
+/* One PRD table per channel.  The engine requires 4-byte
+   alignment and a table that does not cross a 64 kB boundary,
+   which aligning to the table size guarantees. */
+static struct prd prd_tables[CHANNEL_CNT][PRD_CNT]
+	__attribute__ ((aligned (sizeof (struct prd) * PRD_CNT)));
+
+/* One bounce sector per channel. */
+static uint8_t bounce_bufs[CHANNEL_CNT][DISK_SECTOR_SIZE]
+	__attribute__ ((aligned (DISK_SECTOR_SIZE)));
+
+static uint16_t find_bus_master (void);
+
 static void reset_channel (struct channel *);
 static bool check_device_type (struct disk *);
 static void identify_ata_device (struct disk *);
 
-static void select_sector (struct disk *, disk_sector_t);
+static void select_sector (struct disk *, disk_sector_t, size_t cnt);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
+static bool request_less (const struct list_elem *, const struct list_elem *,
+		void *aux);
+static void start_next (struct channel *);
+static void finish_transfer (struct channel *);
 
 static void wait_until_idle (const struct disk *);
 static bool wait_while_busy (const struct disk *);
+static bool spin_while_busy (const struct disk *);
+static void ata_delay (const struct channel *, int ns);
 static void select_device (const struct disk *);
 static void select_device_wait (const struct disk *);
 
@@ -99,8 +175,10 @@ static void interrupt_handler (struct intr_frame *);
 /* Initialize the disk subsystem and detect disks. */
 void
 disk_init (void) {
+	uint16_t bm_base;
 	size_t chan_no;
 
+	bm_base = find_bus_master ();
 	for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++) {
 		struct channel *c = &channels[chan_no];
 		int dev_no;
@@ -119,9 +197,18 @@ disk_init (void) {
 			default:
 				NOT_REACHED ();
 		}
-		lock_init (&c->lock);
+		c->bm_base = bm_base != 0 ? bm_base + chan_no * 8 : 0;
+		c->prdt = prd_tables[chan_no];
 		c->expecting_interrupt = false;
 		sema_init (&c->completion_wait, 0);
+		list_init (&c->queue);
+		list_init (&c->read_fifo);
+		list_init (&c->write_fifo);
+		list_init (&c->inflight);
+		c->inflight_dma = false;
+		c->head = 0;
+		lock_init (&c->bounce_lock);
+		c->bounce = bounce_bufs[chan_no];
 
 		/* Initialize devices. */
 		for (dev_no = 0; dev_no < 2; dev_no++) {
@@ -131,6 +218,7 @@ disk_init (void) {
 			d->dev_no = dev_no;
 
 			d->is_ata = false;
+			d->dma = false;
 			d->capacity = 0;
 
 			d->read_cnt = d->write_cnt = 0;
@@ -204,50 +292,100 @@ disk_size (struct disk *d) {
 }
 
 /* Reads sector SEC_NO from disk D into BUFFER, which must have
-   room for DISK_SECTOR_SIZE bytes.
+   room for DISK_SECTOR_SIZE bytes.  BUFFER may be in user space.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 void
 disk_read (struct disk *d, disk_sector_t sec_no, void *buffer) {
-	struct channel *c;
+	struct channel *c = d->channel;
+	struct disk_request r;
 
-	ASSERT (d != NULL);
-	ASSERT (buffer != NULL);
+	if (is_kernel_vaddr (buffer)) {
+		disk_request_init (&r, d, sec_no, buffer, false);
+		disk_submit (&r);
+		disk_wait (&r);
+		return;
+	}
 
-	c = d->channel;
-	lock_acquire (&c->lock);
-	select_sector (d, sec_no);
-	issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-	sema_down (&c->completion_wait);
-	if (!wait_while_busy (d))
-		PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-	input_sector (c, buffer);
-	d->read_cnt++;
-	lock_release (&c->lock);
+	lock_acquire (&c->bounce_lock);
+	disk_request_init (&r, d, sec_no, c->bounce, false);
+	disk_submit (&r);
+	disk_wait (&r);
+	memcpy (buffer, c->bounce, DISK_SECTOR_SIZE);
+	lock_release (&c->bounce_lock);
 }
 
 /* Write sector SEC_NO to disk D from BUFFER, which must contain
-   DISK_SECTOR_SIZE bytes.  Returns after the disk has
-   acknowledged receiving the data.
+   DISK_SECTOR_SIZE bytes.  BUFFER may be in user space.  Returns
+   after the disk has acknowledged receiving the data.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 void
 disk_write (struct disk *d, disk_sector_t sec_no, const void *buffer) {
-	struct channel *c;
+	struct channel *c = d->channel;
+	struct disk_request r;
 
+	if (is_kernel_vaddr (buffer)) {
+		disk_request_init (&r, d, sec_no, (void *) buffer, true);
+		disk_submit (&r);
+		disk_wait (&r);
+		return;
+	}
+
+	lock_acquire (&c->bounce_lock);
+	memcpy (c->bounce, buffer, DISK_SECTOR_SIZE);
+	disk_request_init (&r, d, sec_no, c->bounce, true);
+	disk_submit (&r);
+	disk_wait (&r);
+	lock_release (&c->bounce_lock);
+}
+
+/* Initializes R as a request to read sector SEC_NO of disk D
+   into BUFFER or, if WRITE, to write BUFFER to it.  BUFFER must
+   have room for DISK_SECTOR_SIZE bytes and be in kernel space,
+   since the transfer may run in another process's interrupt.  R completes by waking
+   disk_wait(); set R->done afterward to be called back instead. */
+void
+disk_request_init (struct disk_request *r, struct disk *d,
+		disk_sector_t sec_no, void *buffer, bool write) {
+	ASSERT (r != NULL);
 	ASSERT (d != NULL);
-	ASSERT (buffer != NULL);
-
-	c = d->channel;
-	lock_acquire (&c->lock);
-	select_sector (d, sec_no);
-	issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-	if (!wait_while_busy (d))
-		PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-	output_sector (c, buffer);
-	sema_down (&c->completion_wait);
-	d->write_cnt++;
-	lock_release (&c->lock);
+	ASSERT (is_kernel_vaddr (buffer));
+
+	r->disk = d;
+	r->sec_no = sec_no;
+	r->buffer = buffer;
+	r->write = write;
+	r->done = NULL;
+	r->aux = NULL;
+	sema_init (&r->done_sema, 0);
+}
+
+/* Queues request R and returns without waiting for it.  May be
+   called from interrupt context. */
+void
+disk_submit (struct disk_request *r) {
+	struct channel *c = r->disk->channel;
+	enum intr_level old_level;
+
+	ASSERT (r->sec_no < r->disk->capacity);
+
+	r->deadline = timer_ticks () + (r->write ? WRITE_DEADLINE : READ_DEADLINE);
+
+	old_level = intr_disable ();
+	list_insert_ordered (&c->queue, &r->elem, request_less, NULL);
+	list_push_back (r->write ? &c->write_fifo : &c->read_fifo, &r->fifo_elem);
+	start_next (c);
+	intr_set_level (old_level);
+}
+
+/* Waits for request R, which must not have a completion
+   callback, to complete. */
+void
+disk_wait (struct disk_request *r) {
+	ASSERT (r->done == NULL);
+
+	sema_down (&r->done_sema);
 }
 
 /* Disk detection and identification. */
@@ -352,6 +490,10 @@ identify_ata_device (struct disk *d) {
 	/* Send the IDENTIFY DEVICE command, wait for an interrupt
 	   indicating the device's response is ready, and read the data
 	   into our buffer. */
+	/* Interrupts must be enabled or our semaphore will never be
+	   up'd by the completion handler. */
+	ASSERT (intr_get_level () == INTR_ON);
+
 	select_device_wait (d);
 	issue_pio_command (c, CMD_IDENTIFY_DEVICE);
 	sema_down (&c->completion_wait);
@@ -364,6 +506,16 @@ identify_ata_device (struct disk *d) {
 	/* Calculate capacity. */
 	d->capacity = id[60] | ((uint32_t) id[61] << 16);
 
+	/* Use DMA if the device supports it (word 49, bit 8) and the
+	   channel has a bus-master engine.  The capable bits in the
+	   bus-master status register are advisory; set ours so that
+	   the state is visible to anyone inspecting the controller. */
+	if (c->bm_base != 0 && (id[49] & 0x0100) != 0) {
+		d->dma = true;
+		outb (reg_bm_status (c), inb (reg_bm_status (c))
+				| (d->dev_no == 0 ? BM_STA_DMA0 : BM_STA_DMA1));
+	}
+
 	/* Print identification message. */
 	printf ("%s: detected %'"PRDSNu" sector (", d->name, d->capacity);
 	if (d->capacity > 1024 / DISK_SECTOR_SIZE * 1024 * 1024)
@@ -379,7 +531,66 @@ identify_ata_device (struct disk *d) {
 	print_ata_string ((char *) &id[27], 40);
 	printf ("\", serial \"");
 	print_ata_string ((char *) &id[10], 20);
-	printf ("\"\n");
+	printf ("\"%s\n", d->dma ? ", DMA" : "");
+}
+
+/* PCI configuration space ports. */
+#define PCI_CONFIG_ADDR 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+
+/* Reads the 32-bit PCI configuration register at byte offset REG
+   of function FUNC of device DEV on bus 0. */
+static uint32_t
+pci_read_config (int dev, int func, int reg) {
+	outl (PCI_CONFIG_ADDR,
+			0x80000000 | (dev << 11) | (func << 8) | (reg & 0xfc));
+	return inl (PCI_CONFIG_DATA);
+}
+
+/* Writes VALUE to the 32-bit PCI configuration register at byte
+   offset REG of function FUNC of device DEV on bus 0. */
+static void
+pci_write_config (int dev, int func, int reg, uint32_t value) {
+	outl (PCI_CONFIG_ADDR,
+			0x80000000 | (dev << 11) | (func << 8) | (reg & 0xfc));
+	outl (PCI_CONFIG_DATA, value);
+}
+
+/* Searches bus 0 for an IDE controller capable of bus mastering
+   (such as the PIIX3 that QEMU emulates), enables bus mastering
+   on it, and returns its bus-master I/O base.  Returns 0 if there
+   is no such controller, in which case all transfers use PIO. */
+static uint16_t
+find_bus_master (void) {
+	int dev, func;
+
+	for (dev = 0; dev < 32; dev++)
+		for (func = 0; func < 8; func++) {
+			uint32_t id = pci_read_config (dev, func, 0x00);
+			uint32_t class, bar4, cmd;
+
+			if ((id & 0xffff) == 0xffff) {
+				if (func == 0)
+					break;
+				continue;
+			}
+
+			/* Class 01h (mass storage), subclass 01h (IDE),
+			   programming interface bit 7 (bus master). */
+			class = pci_read_config (dev, func, 0x08);
+			if ((class >> 16) != 0x0101 || !(class & 0x8000))
+				continue;
+
+			bar4 = pci_read_config (dev, func, 0x20);
+			if (!(bar4 & 1) || (bar4 & 0xfffc) == 0)
+				continue;
+
+			/* Enable I/O space and bus mastering. */
+			cmd = pci_read_config (dev, func, 0x04);
+			pci_write_config (dev, func, 0x04, cmd | 0x05);
+			return bar4 & 0xfffc;
+		}
+	return 0;
 }
 
 /* Prints STRING, which consists of SIZE bytes in a funky format:
@@ -402,17 +613,18 @@ print_ata_string (char *string, size_t size) {
 }
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and the count CNT of sectors to transfer to the
+   disk's sector selection registers.  (We use LBA mode.) */
 static void
-select_sector (struct disk *d, disk_sector_t sec_no) {
+select_sector (struct disk *d, disk_sector_t sec_no, size_t cnt) {
 	struct channel *c = d->channel;
 
-	ASSERT (sec_no < d->capacity);
-	ASSERT (sec_no < (1UL << 28));
+	ASSERT (cnt > 0 && cnt <= 256);
+	ASSERT (sec_no + cnt <= d->capacity);
+	ASSERT (sec_no + cnt <= (1UL << 28));
 
 	select_device_wait (d);
-	outb (reg_nsect (c), 1);
+	outb (reg_nsect (c), cnt);
 	outb (reg_lbal (c), sec_no);
 	outb (reg_lbam (c), sec_no >> 8);
 	outb (reg_lbah (c), (sec_no >> 16));
@@ -424,10 +636,6 @@ select_sector (struct disk *d, disk_sector_t sec_no) {
    completion interrupt. */
 static void
 issue_pio_command (struct channel *c, uint8_t command) {
-	/* Interrupts must be enabled or our semaphore will never be
-	   up'd by the completion handler. */
-	ASSERT (intr_get_level () == INTR_ON);
-
 	c->expecting_interrupt = true;
 	outb (reg_command (c), command);
 }
@@ -446,6 +654,263 @@ output_sector (struct channel *c, const void *sector) {
 	outsw (reg_data (c), sector, DISK_SECTOR_SIZE / 2);
 }
 
+/* Request scheduling. */
+
+/* Returns R's position in the elevator's sweep, which covers
+   device 0's sectors and then device 1's. */
+static uint64_t
+request_key (const struct disk_request *r) {
+	return ((uint64_t) r->disk->dev_no << 32) | r->sec_no;
+}
+
+/* Orders requests by position in the elevator's sweep. */
+static bool
+request_less (const struct list_elem *a_, const struct list_elem *b_,
+		void *aux UNUSED) {
+	const struct disk_request *a = list_entry (a_, struct disk_request, elem);
+	const struct disk_request *b = list_entry (b_, struct disk_request, elem);
+
+	return request_key (a) < request_key (b);
+}
+
+/* Returns the request channel C should serve next, or a null
+   pointer if its queue is empty.  The oldest read or write is
+   served first if its deadline has passed; otherwise requests
+   are served in C-LOOK order, that is, the nearest one at or
+   beyond the end of the previous transfer, wrapping around to
+   the lowest. */
+static struct disk_request *
+pick_request (struct channel *c) {
+	struct list *fifos[2] = { &c->read_fifo, &c->write_fifo };
+	int64_t now = timer_ticks ();
+	struct list_elem *e;
+	int i;
+
+	if (list_empty (&c->queue))
+		return NULL;
+
+	for (i = 0; i < 2; i++)
+		if (!list_empty (fifos[i])) {
+			struct disk_request *r = list_entry (list_front (fifos[i]),
+					struct disk_request, fifo_elem);
+			if (r->deadline <= now)
+				return r;
+		}
+
+	for (e = list_begin (&c->queue); e != list_end (&c->queue);
+			e = list_next (e)) {
+		struct disk_request *r = list_entry (e, struct disk_request, elem);
+		if (request_key (r) >= c->head)
+			return r;
+	}
+	return list_entry (list_front (&c->queue), struct disk_request, elem);
+}
+
+/* Moves R from channel C's queue to its in-flight list. */
+static void
+take_request (struct channel *c, struct disk_request *r) {
+	list_remove (&r->elem);
+	list_remove (&r->fifo_elem);
+	list_push_back (&c->inflight, &r->elem);
+}
+
+/* Appends entries describing the DISK_SECTOR_SIZE bytes at kernel
+   virtual address BUFFER to channel C's PRD table, whose first *N
+   entries are in use, and updates *N.  Regions are split at page
+   boundaries, where physical contiguity is not guaranteed, and at
+   64 kB boundaries, which the engine cannot cross; physically
+   adjacent pieces are merged again, also with the previous entry.
+   Returns false, leaving the table as it was, if BUFFER cannot be
+   described, e.g. because it is not word-aligned, lies above
+   4 GB, or the table is full. */
+static bool
+prdt_add (struct channel *c, size_t *n, void *buffer) {
+	struct prd *p = *n > 0 ? &c->prdt[*n - 1] : NULL;
+	uint16_t last_size = p != NULL ? p->size : 0;
+	size_t size = DISK_SECTOR_SIZE;
+	size_t old_n = *n;
+	uint8_t *va = buffer;
+
+	if (!is_kernel_vaddr (buffer) || ((uintptr_t) buffer & 1))
+		return false;
+
+	while (size > 0) {
+		uint64_t pa = vtop (va);
+		size_t chunk = PGSIZE - pg_ofs (va);
+		size_t boundary = 0x10000 - (pa & 0xffff);
+
+		if (chunk > size)
+			chunk = size;
+		if (chunk > boundary)
+			chunk = boundary;
+		if (pa + chunk > 0x100000000ULL)
+			goto fail;
+
+		if (p != NULL && p->addr + (p->size ? p->size : 0x10000) == pa
+				&& (pa & 0xffff) != 0)
+			p->size += chunk;
+		else {
+			if (*n == PRD_CNT)
+				goto fail;
+			p = &c->prdt[(*n)++];
+			p->addr = pa;
+			p->size = chunk;
+			p->flags = 0;
+		}
+		va += chunk;
+		size -= chunk;
+	}
+	return true;
+
+fail:
+	*n = old_n;
+	if (old_n > 0)
+		c->prdt[old_n - 1].size = last_size;
+	return false;
+}
+
+/* Starts a bus-master DMA transfer of CNT sectors beginning at
+   SEC_NO on disk D, using the PRD table of D's channel. */
+static void
+start_dma (struct disk *d, disk_sector_t sec_no, size_t cnt, bool write) {
+	struct channel *c = d->channel;
+	uint8_t dir = write ? 0 : BM_CMD_READ;
+
+	/* Program the engine: table address, direction, and clear any
+	   stale error and interrupt state. */
+	outb (reg_bm_command (c), dir);
+	outl (reg_bm_prdt (c), vtop (c->prdt));
+	outb (reg_bm_status (c),
+			inb (reg_bm_status (c)) | BM_STA_ERR | BM_STA_INTR);
+
+	/* Issue the command, then start the engine. */
+	select_sector (d, sec_no, cnt);
+	c->expecting_interrupt = true;
+	outb (reg_command (c), write ? CMD_WRITE_DMA : CMD_READ_DMA);
+	outb (reg_bm_command (c), dir | BM_CMD_START);
+}
+
+/* Starts a PIO transfer of request R.  For a write, this also
+   sends the data; for a read, the interrupt handler collects it. */
+static void
+start_pio (struct disk_request *r) {
+	struct disk *d = r->disk;
+	struct channel *c = d->channel;
+
+	select_sector (d, r->sec_no, 1);
+	issue_pio_command (c, r->write ? CMD_WRITE_SECTOR_RETRY
+			: CMD_READ_SECTOR_RETRY);
+	if (r->write) {
+		if (!spin_while_busy (d))
+			PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, r->sec_no);
+		output_sector (c, r->buffer);
+	}
+}
+
+/* Starts the next transfer on channel C if C is idle and has
+   queued requests.  A DMA transfer also takes the requests that
+   continue the chosen one on the same disk in the same direction,
+   as many as fit in the PRD table, up to the 256 sectors that one
+   command can transfer.  Must be called with
+   interrupts off; the interrupt handler calls it to chain each
+   transfer to the next. */
+static void
+start_next (struct channel *c) {
+	struct disk_request *r;
+	size_t n = 0, cnt = 1;
+
+	ASSERT (intr_get_level () == INTR_OFF);
+
+	if (!list_empty (&c->inflight))
+		return;
+	r = pick_request (c);
+	if (r == NULL)
+		return;
+
+	c->inflight_dma = r->disk->dma && prdt_add (c, &n, r->buffer);
+	if (c->inflight_dma) {
+		struct list_elem *e = list_next (&r->elem);
+
+		take_request (c, r);
+		while (e != list_end (&c->queue)) {
+			struct disk_request *next = list_entry (e, struct disk_request,
+					elem);
+
+			if (cnt == 256 || next->disk != r->disk || next->write != r->write
+					|| next->sec_no != r->sec_no + cnt
+					|| !prdt_add (c, &n, next->buffer))
+				break;
+			e = list_next (e);
+			take_request (c, next);
+			cnt++;
+		}
+		c->prdt[n - 1].flags = PRD_EOT;
+		start_dma (r->disk, r->sec_no, cnt, r->write);
+	} else {
+		take_request (c, r);
+		start_pio (r);
+	}
+	c->head = request_key (r) + cnt;
+}
+
+/* Completes request R. */
+static void
+complete_request (struct disk_request *r) {
+	if (r->write)
+		r->disk->write_cnt++;
+	else
+		r->disk->read_cnt++;
+
+	if (r->done != NULL)
+		r->done (r);
+	else
+		sema_up (&r->done_sema);
+}
+
+/* Finishes the transfer in flight on channel C, in response to
+   its completion interrupt, and completes its requests.  If a
+   DMA transfer failed, disables DMA for the disk and puts its
+   requests back at the head of the queue, to be retried in PIO
+   mode. */
+static void
+finish_transfer (struct channel *c) {
+	struct disk_request *r = list_entry (list_front (&c->inflight),
+			struct disk_request, elem);
+	struct disk *d = r->disk;
+	uint8_t status = inb (reg_status (c));      /* Acknowledge interrupt. */
+
+	if (c->inflight_dma) {
+		uint8_t bm_status;
+
+		/* Stop the engine and collect the outcome. */
+		outb (reg_bm_command (c), r->write ? 0 : BM_CMD_READ);
+		bm_status = inb (reg_bm_status (c));
+		outb (reg_bm_status (c), bm_status | BM_STA_ERR | BM_STA_INTR);
+
+		if ((bm_status & (BM_STA_ERR | BM_STA_ACTIVE)) || (status & STA_ERR)) {
+			klog ("%s: DMA %s failed, sector=%"PRDSNu"; using PIO",
+					d->name, r->write ? "write" : "read", r->sec_no);
+			d->dma = false;
+			while (!list_empty (&c->inflight)) {
+				r = list_entry (list_pop_back (&c->inflight),
+						struct disk_request, elem);
+				list_insert_ordered (&c->queue, &r->elem, request_less, NULL);
+				list_push_front (r->write ? &c->write_fifo : &c->read_fifo,
+						&r->fifo_elem);
+			}
+			return;
+		}
+	} else if (!r->write) {
+		if (!spin_while_busy (d))
+			PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, r->sec_no);
+		input_sector (c, r->buffer);
+	}
+
+	while (!list_empty (&c->inflight))
+		complete_request (list_entry (list_pop_front (&c->inflight),
+					struct disk_request, elem));
+}
+
 /* Low-level ATA primitives. */
 
 /* Wait up to 10 seconds for the controller to become idle, that
@@ -460,7 +925,7 @@ wait_until_idle (const struct disk *d) {
 	for (i = 0; i < 1000; i++) {
 		if ((inb (reg_status (d->channel)) & (STA_BSY | STA_DRQ)) == 0)
 			return;
-		timer_usleep (10);
+		ata_delay (d->channel, 10000);
 	}
 
 	printf ("%s: idle timeout\n", d->name);
@@ -490,6 +955,39 @@ wait_while_busy (const struct disk *d) {
 	return false;
 }
 
+/* Waits for disk D to clear BSY, as wait_while_busy(), but
+   without sleeping, so that it may be used with interrupts off.
+   BSY is normally already clear when this is called, so this
+   gives up after about a second. */
+static bool
+spin_while_busy (const struct disk *d) {
+	struct channel *c = d->channel;
+	int i;
+
+	for (i = 0; i < 10000000; i++) {
+		uint8_t status = inb (reg_alt_status (c));
+		if (!(status & STA_BSY))
+			return (status & STA_DRQ) != 0;
+	}
+	return false;
+}
+
+/* Waits at least NS nanoseconds for channel C to settle.  With
+   interrupts off, when the timer cannot be used, reads the
+   Alternate Status Register instead, which takes an ATA
+   controller at least 100 ns per read. */
+static void
+ata_delay (const struct channel *c, int ns) {
+	if (intr_get_level () == INTR_ON)
+		timer_nsleep (ns);
+	else {
+		int i;
+
+		for (i = 0; i < (ns + 99) / 100; i++)
+			inb (reg_alt_status (c));
+	}
+}
+
 /* Program D's channel so that D is now the selected disk. */
 static void
 select_device (const struct disk *d) {
@@ -499,7 +997,7 @@ select_device (const struct disk *d) {
 		dev |= DEV_DEV;
 	outb (reg_device (c), dev);
 	inb (reg_alt_status (c));
-	timer_nsleep (400);
+	ata_delay (c, 400);
 }
 
 /* Select disk D in its channel, as select_device(), but wait for
@@ -518,11 +1016,14 @@ interrupt_handler (struct intr_frame *f) {
 
 	for (c = channels; c < channels + CHANNEL_CNT; c++)
 		if (f->vec_no == c->irq) {
-			if (c->expecting_interrupt) {
+			if (!list_empty (&c->inflight)) {
+				finish_transfer (c);
+				start_next (c);
+			} else if (c->expecting_interrupt) {
 				inb (reg_status (c));               /* Acknowledge interrupt. */
 				sema_up (&c->completion_wait);      /* Wake up waiter. */
 			} else
-				printf ("%s: unexpected interrupt\n", c->name);
+				klog ("%s: unexpected interrupt", c->name);
 			return;
 		}
 
@@ -1,15 +1,32 @@
 #include "devices/input.h"
 #include <debug.h>
+#include <string.h>
 #include "devices/intq.h"
 #include "devices/serial.h"
 
-/* Stores keys from the keyboard and serial port. */
+/* Stores keys from the keyboard and serial port.  Large enough to
+   absorb a burst of pasted or piped input while no one reads. */
+#define INPUT_BUFSIZE 4096
 static struct intq buffer;
+static uint8_t input_buf[INPUT_BUFSIZE];
+
+/* Bytes input_read() moves out of the buffer per interrupt-off
+   section. */
+#define READ_CHUNK 256
+
+/* If true, input_read() returns whole lines. */
+static bool line_mode;
 
 /* Initializes the input buffer. */
 void
 input_init (void) {
-	intq_init (&buffer);
+	intq_init_buf (&buffer, input_buf, sizeof input_buf);
+}
+
+/* Sets whether input_read() works a line at a time. */
+void
+input_set_line_mode (bool on) {
+	line_mode = on;
 }
 
 /* Adds a key to the input buffer.
@@ -23,6 +40,17 @@ input_putc (uint8_t key) {
 	serial_notify ();
 }
 
+/* Adds the N keys in KEYS to the input buffer.
+   Interrupts must be off and the buffer must have room for them. */
+void
+input_putbuf (const uint8_t *keys, size_t n) {
+	ASSERT (intr_get_level () == INTR_OFF);
+	ASSERT (n <= intq_room (&buffer));
+
+	intq_putbuf (&buffer, keys, n);
+	serial_notify ();
+}
+
 /* Retrieves a key from the input buffer.
    If the buffer is empty, waits for a key to be pressed. */
 uint8_t
@@ -38,6 +66,46 @@ input_getc (void) {
 	return key;
 }
 
+/* Reads up to SIZE keys into BUFFER and returns the number read.
+   Waits until at least one key is available, then takes every key
+   already buffered, up to SIZE.  In line mode, instead waits for
+   and stops after a new-line, unless SIZE keys come first.
+
+   Keys are moved out of the buffer in chunks, so BUFFER may be
+   user memory that page faults. */
+size_t
+input_read (void *buffer_, size_t size) {
+	uint8_t *dst = buffer_;
+	uint8_t chunk[READ_CHUNK];
+	int delim = line_mode ? '\n' : -1;
+	size_t total = 0;
+
+	while (total < size) {
+		size_t want = size - total < READ_CHUNK ? size - total : READ_CHUNK;
+		enum intr_level old_level;
+		size_t n = 0;
+
+		old_level = intr_disable ();
+		if (intq_empty (&buffer)) {
+			if (total > 0 && !line_mode) {
+				intr_set_level (old_level);
+				break;
+			}
+			chunk[n++] = intq_getc (&buffer);
+		}
+		if (n == 0 || chunk[0] != delim)
+			n += intq_getbuf (&buffer, chunk + n, want - n, delim);
+		serial_notify ();
+		intr_set_level (old_level);
+
+		memcpy (dst + total, chunk, n);
+		total += n;
+		if (chunk[n - 1] == delim)
+			break;
+	}
+	return total;
+}
+
 /* Returns true if the input buffer is full,
    false otherwise.
    Interrupts must be off. */
@@ -46,3 +114,11 @@ input_full (void) {
 	ASSERT (intr_get_level () == INTR_OFF);
 	return intq_full (&buffer);
 }
+
+/* Returns the number of keys the input buffer has room for.
+   Interrupts must be off. */
+size_t
+input_room (void) {
+	ASSERT (intr_get_level () == INTR_OFF);
+	return intq_room (&buffer);
+}
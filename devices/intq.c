@@ -1,16 +1,28 @@
 #include "devices/intq.h"
 #include <debug.h>
+#include <string.h>
 #include "threads/thread.h"
 
-static int next (int pos);
+static int next (const struct intq *q, int pos);
 static void wait (struct intq *q, struct thread **waiter);
 static void signal (struct intq *q, struct thread **waiter);
 
-/* Initializes interrupt queue Q. */
+/* Initializes interrupt queue Q with its default buffer. */
 void
 intq_init (struct intq *q) {
+	intq_init_buf (q, q->default_buf, sizeof q->default_buf);
+}
+
+/* Initializes interrupt queue Q to use the SIZE bytes in BUF,
+   which must outlive Q.  Q holds up to SIZE - 1 bytes. */
+void
+intq_init_buf (struct intq *q, uint8_t *buf, size_t size) {
+	ASSERT (size >= 2);
+
 	lock_init (&q->lock);
 	q->not_full = q->not_empty = NULL;
+	q->buf = buf;
+	q->size = size;
 	q->head = q->tail = 0;
 }
 
@@ -25,7 +37,15 @@ intq_empty (const struct intq *q) {
 bool
 intq_full (const struct intq *q) {
 	ASSERT (intr_get_level () == INTR_OFF);
-	return next (q->head) == q->tail;
+	return next (q, q->head) == q->tail;
+}
+
+/* Returns the number of bytes that may be added to Q before it
+   is full. */
+size_t
+intq_room (const struct intq *q) {
+	ASSERT (intr_get_level () == INTR_OFF);
+	return (q->tail - q->head - 1 + q->size) % q->size;
 }
 
 /* Removes a byte from Q and returns it.
@@ -45,7 +65,7 @@ intq_getc (struct intq *q) {
 	}
 
 	byte = q->buf[q->tail];
-	q->tail = next (q->tail);
+	q->tail = next (q, q->tail);
 	signal (q, &q->not_full);
 	return byte;
 }
@@ -65,14 +85,72 @@ intq_putc (struct intq *q, uint8_t byte) {
 	}
 
 	q->buf[q->head] = byte;
-	q->head = next (q->head);
+	q->head = next (q, q->head);
 	signal (q, &q->not_empty);
 }
 
-/* Returns the position after POS within an intq. */
+/* Adds as many of the N bytes in BUF to the end of Q as fit,
+   without sleeping, and returns the number added.  Copies at
+   most two runs, one up to the end of the buffer and one from its
+   start, instead of going byte by byte. */
+size_t
+intq_putbuf (struct intq *q, const uint8_t *buf, size_t n) {
+	size_t added = 0;
+
+	ASSERT (intr_get_level () == INTR_OFF);
+	while (added < n && !intq_full (q)) {
+		/* Room up to the end of the buffer, or up to the byte
+		   before TAIL if that comes first. */
+		size_t room = (q->tail > q->head ? q->tail - 1
+				: q->size - (q->tail == 0)) - q->head;
+		size_t chunk = n - added < room ? n - added : room;
+
+		memcpy (q->buf + q->head, buf + added, chunk);
+		q->head = (q->head + chunk) % q->size;
+		added += chunk;
+	}
+	if (added > 0)
+		signal (q, &q->not_empty);
+	return added;
+}
+
+/* Removes up to N bytes from the front of Q into BUF, without
+   sleeping, and returns the number removed.  If DELIM is not -1,
+   stops just after the first byte equal to DELIM.  Like
+   intq_putbuf(), copies at most two runs. */
+size_t
+intq_getbuf (struct intq *q, uint8_t *buf, size_t n, int delim) {
+	size_t got = 0;
+	bool found = false;
+
+	ASSERT (intr_get_level () == INTR_OFF);
+	while (got < n && !found && !intq_empty (q)) {
+		/* Data up to HEAD, or up to the end of the buffer if the
+		   data wraps around. */
+		size_t avail = (q->head > q->tail ? q->head : q->size) - q->tail;
+		size_t chunk = n - got < avail ? n - got : avail;
+		const uint8_t *src = q->buf + q->tail;
+
+		if (delim != -1) {
+			const uint8_t *end = memchr (src, delim, chunk);
+			if (end != NULL) {
+				chunk = end - src + 1;
+				found = true;
+			}
+		}
+		memcpy (buf + got, src, chunk);
+		q->tail = (q->tail + chunk) % q->size;
+		got += chunk;
+	}
+	if (got > 0)
+		signal (q, &q->not_full);
+	return got;
+}
+
+/* Returns the position after POS within Q. */
 static int
-next (int pos) {
-	return (pos + 1) % INTQ_BUFSIZE;
+next (const struct intq *q, int pos) {
+	return (pos + 1) % q->size;
 }
 
 /* WAITER must be the address of Q's not_empty or not_full
@@ -37,6 +37,16 @@
 #define IER_RECV 0x01           /* Interrupt when data received. */
 #define IER_XMIT 0x02           /* Interrupt when transmit finishes. */
 
+/* FIFO Control Register bits. */
+#define FCR_ENABLE 0x01         /* Enable FIFOs. */
+#define FCR_CLEAR 0x06          /* Clear receive and transmit FIFOs. */
+
+/* Bytes the transmit FIFO accepts once THR Empty is set. */
+#define TX_FIFO_SIZE 16
+
+/* Received bytes passed to the input layer at once. */
+#define RX_BATCH 16
+
 /* Line Control Register bits. */
 #define LCR_N81 0x03            /* No parity, 8 data bits, 1 stop bit. */
 #define LCR_DLAB 0x80           /* Divisor Latch Access Bit (DLAB). */
@@ -51,8 +61,11 @@
 /* Transmission mode. */
 static enum { UNINIT, POLL, QUEUE } mode;
 
-/* Data to be transmitted. */
+/* Data to be transmitted.  Larger than an ordinary intq, so
+   that whole console writes fit at once. */
+#define TXQ_SIZE 4096
 static struct intq txq;
+static uint8_t txq_buf[TXQ_SIZE];
 
 static void set_serial (int bps);
 static void putc_poll (uint8_t);
@@ -67,10 +80,10 @@ static void
 init_poll (void) {
 	ASSERT (mode == UNINIT);
 	outb (IER_REG, 0);                    /* Turn off all interrupts. */
-	outb (FCR_REG, 0);                    /* Disable FIFO. */
+	outb (FCR_REG, FCR_ENABLE | FCR_CLEAR);  /* Enable and clear FIFOs. */
 	set_serial (115200);                  /* 115.2 kbps, N-8-1. */
 	outb (MCR_REG, MCR_OUT2);             /* Required to enable interrupts. */
-	intq_init (&txq);
+	intq_init_buf (&txq, txq_buf, sizeof txq_buf);
 	mode = POLL;
 }
 
@@ -122,6 +135,43 @@ serial_putc (uint8_t byte) {
 	intr_set_level (old_level);
 }
 
+/* Sends the N bytes in BUFFER to the serial port.  In queued
+   mode, copies as much as fits into the transmit queue at once
+   and updates the interrupt enable register once per batch,
+   rather than once per byte as serial_putc() does. */
+void
+serial_putbuf (const void *buffer, size_t n) {
+	const uint8_t *p = buffer;
+	enum intr_level old_level = intr_disable ();
+
+	if (mode != QUEUE) {
+		if (mode == UNINIT)
+			init_poll ();
+		while (n-- > 0)
+			putc_poll (*p++);
+	} else
+		while (n > 0) {
+			size_t added = intq_putbuf (&txq, p, n);
+
+			p += added;
+			n -= added;
+			write_ier ();
+			if (n > 0) {
+				/* The queue is full.  As in serial_putc(), poll a
+				   byte out if interrupts are off; otherwise sleep
+				   until there is room for one more. */
+				if (old_level == INTR_OFF)
+					putc_poll (intq_getc (&txq));
+				else {
+					intq_putc (&txq, *p++);
+					n--;
+				}
+			}
+		}
+
+	intr_set_level (old_level);
+}
+
 /* Flushes anything in the serial buffer out the port in polling
    mode. */
 void
@@ -196,19 +246,35 @@ putc_poll (uint8_t byte) {
 /* Serial interrupt handler. */
 static void
 serial_interrupt (struct intr_frame *f UNUSED) {
+	size_t room;
+
 	/* Inquire about interrupt in UART.  Without this, we can
 	   occasionally miss an interrupt running under QEMU. */
 	inb (IIR_REG);
 
-	/* As long as we have room to receive a byte, and the hardware
-	   has a byte for us, receive a byte.  */
-	while (!input_full () && (inb (LSR_REG) & LSR_DR) != 0)
-		input_putc (inb (RBR_REG));
+	/* As long as we have room to receive bytes, and the hardware
+	   has bytes for us, receive them, passing them to the input
+	   layer in batches. */
+	room = input_room ();
+	while (room > 0 && (inb (LSR_REG) & LSR_DR) != 0) {
+		uint8_t rx[RX_BATCH];
+		size_t n = 0;
+
+		do
+			rx[n++] = inb (RBR_REG);
+		while (n < RX_BATCH && n < room && (inb (LSR_REG) & LSR_DR) != 0);
+		input_putbuf (rx, n);
+		room -= n;
+	}
+
+	/* If the hardware is ready to accept bytes for transmission,
+	   fill its transmit FIFO from the queue. */
+	if ((inb (LSR_REG) & LSR_THRE) != 0) {
+		int i;
 
-	/* As long as we have a byte to transmit, and the hardware is
-	   ready to accept a byte for transmission, transmit a byte. */
-	while (!intq_empty (&txq) && (inb (LSR_REG) & LSR_THRE) != 0)
-		outb (THR_REG, intq_getc (&txq));
+		for (i = 0; i < TX_FIFO_SIZE && !intq_empty (&txq); i++)
+			outb (THR_REG, intq_getc (&txq));
+	}
 
 	/* Update interrupt enable register based on queue status. */
 	write_ier ();
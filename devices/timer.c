@@ -24,10 +24,31 @@ static int64_t ticks;
    Initialized by timer_calibrate(). */
 static unsigned loops_per_tick;
 
+/* Nanoseconds per timer tick. */
+#define NS_PER_TICK (1000000000 / TIMER_FREQ)
+
+/* Timer ticks over which timer_calibrate() measures the TSC. */
+#define TSC_CALIBRATE_TICKS 5
+
+/* Time stamp counter scaling, set by timer_calibrate().  The
+   time at TSC value T is TSC_BASE_NS + (T - TSC_BASE) * TSC_MULT
+   / 2**32 ns.  TSC_MULT is 0 until calibration, in which case
+   timer_now_ns() only has tick resolution. */
+static uint64_t tsc_base;
+static int64_t tsc_base_ns;
+static uint64_t tsc_mult;
+static uint64_t tsc_hz;
+
+/* timer_now_ns() at the most recent timer interrupt, so that
+   timer_sleep_until_ns() can tell when future ticks will come. */
+static int64_t last_tick_ns;
+
 static intr_handler_func timer_interrupt;
 static bool too_many_loops (unsigned loops);
 static void busy_wait (int64_t loops);
 static void real_time_sleep (int64_t num, int32_t denom);
+static void calibrate_tsc (void);
+static void sleep_until_tick (int64_t wakeup);
 
 /* Add */
 static struct list sleep_list;
@@ -78,6 +99,57 @@ timer_calibrate (void) {
 			loops_per_tick |= test_bit;
 
 	printf ("%'"PRIu64" loops/s.\n", (uint64_t) loops_per_tick * TIMER_FREQ);
+
+	calibrate_tsc ();
+}
+
+/* Reads the time stamp counter. */
+static inline uint64_t
+rdtsc (void) {
+	uint32_t lo, hi;
+	asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t) hi << 32) | lo;
+}
+
+/* Measures the TSC frequency against the PIT, counting cycles
+   between two timer interrupts TSC_CALIBRATE_TICKS apart, and
+   sets up timer_now_ns() to use the TSC. */
+static void
+calibrate_tsc (void) {
+	int64_t start = ticks;
+	uint64_t t0, t1;
+
+	while (ticks == start)
+		barrier ();
+	t0 = rdtsc ();
+	start = ticks;
+	while (ticks - start < TSC_CALIBRATE_TICKS)
+		barrier ();
+	t1 = rdtsc ();
+
+	tsc_hz = (t1 - t0) * TIMER_FREQ / TSC_CALIBRATE_TICKS;
+	if (tsc_hz == 0)
+		return;
+	tsc_base = t1;
+	tsc_base_ns = (start + TSC_CALIBRATE_TICKS) * NS_PER_TICK;
+	tsc_mult = (1000000000ULL << 32) / tsc_hz;
+}
+
+/* Returns the number of nanoseconds since the OS booted.  The
+   clock is monotonic.  Once timer_calibrate() has run it reads
+   the TSC, so it has sub-tick resolution and costs no more than
+   a few instructions; before that it counts whole ticks.  Safe
+   to call from any context. */
+int64_t
+timer_now_ns (void) {
+	uint64_t delta;
+
+	if (tsc_mult == 0)
+		return timer_ticks () * NS_PER_TICK;
+
+	delta = rdtsc () - tsc_base;
+	return tsc_base_ns
+		+ (int64_t) (((unsigned __int128) delta * tsc_mult) >> 32);
 }
 
 /* Returns the number of timer ticks since the OS booted. */
@@ -100,18 +172,78 @@ timer_elapsed (int64_t then) {
 /* Suspends execution for approximately TICKS timer ticks. */
 void
 timer_sleep (int64_t ticks) {
+	sleep_until_tick (timer_ticks () + ticks);
+}
+
+/* Suspends execution until the timer tick count reaches WAKEUP.
+   Returns at once if it already has. */
+static void
+sleep_until_tick (int64_t wakeup) {
 	struct sleeping_thread st;
 	
 	st.t = thread_current();
-	st.wakeup_ticks = timer_ticks() + ticks;
+	st.wakeup_ticks = wakeup;
 
 	enum intr_level old_level = intr_disable();
+	if (wakeup <= ticks) {
+		intr_set_level (old_level);
+		return;
+	}
 	list_insert_ordered(&sleep_list, &st.elem, wakeup_tick_less, NULL);
 
 	thread_block();
 	intr_set_level(old_level);
 }
 
+/* Suspends execution until timer_now_ns() reaches DEADLINE, and
+   at most SLACK nanoseconds past it, apart from time spent waiting
+   for the CPU after waking up.
+
+   Sleeps in timer_sleep() for the whole ticks that fit before
+   DEADLINE, then busy-waits only for the remaining fraction of a
+   tick.  If a tick falls within [DEADLINE, DEADLINE + SLACK], it
+   instead sleeps until that tick and does not spin at all, so a
+   SLACK of NS_PER_TICK or more never spins.  Returns immediately
+   if DEADLINE has passed. */
+void
+timer_sleep_until_ns (int64_t deadline, int64_t slack) {
+	enum intr_level old_level;
+	int64_t tick, tick_ns, n;
+
+	ASSERT (intr_get_level () == INTR_ON);
+	ASSERT (slack >= 0);
+
+	/* Read the most recent tick and when it came together. */
+	old_level = intr_disable ();
+	tick = ticks;
+	tick_ns = last_tick_ns;
+	intr_set_level (old_level);
+
+	if (deadline <= timer_now_ns ())
+		return;
+
+	/* Number of ticks after TICK that come by DEADLINE, plus one
+	   more if it comes within the slack. */
+	n = (deadline - tick_ns) / NS_PER_TICK;
+	if (tick_ns + (n + 1) * NS_PER_TICK <= deadline + slack)
+		n++;
+
+	/* If we were preempted for N ticks since reading TICK,
+	   sleep_until_tick() returns at once and we spin for the rest. */
+	if (n > 0)
+		sleep_until_tick (tick + n);
+
+	while (timer_now_ns () < deadline)
+		barrier ();
+}
+
+/* Suspends execution for NS nanoseconds, waking up at most SLACK
+   nanoseconds late, as described for timer_sleep_until_ns(). */
+void
+timer_sleep_ns (int64_t ns, int64_t slack) {
+	timer_sleep_until_ns (timer_now_ns () + ns, slack);
+}
+
 /* Suspends execution for approximately MS milliseconds. */
 void
 timer_msleep (int64_t ms) {
@@ -134,12 +266,15 @@ timer_nsleep (int64_t ns) {
 void
 timer_print_stats (void) {
 	printf ("Timer: %"PRId64" ticks\n", timer_ticks ());
+	if (tsc_mult != 0)
+		printf ("Timer: TSC at %'"PRIu64" Hz\n", tsc_hz);
 }
 
 /* Timer interrupt handler. */
 static void
 timer_interrupt (struct intr_frame *args UNUSED) {
 	ticks++;
+	last_tick_ns = timer_now_ns ();
 	if(thread_mlfqs){
 		mlfqs_incr(); // 현재 쓰레드의 recent_cpu +1
 		if (ticks % 4 == 0) {
@@ -202,10 +337,19 @@ real_time_sleep (int64_t num, int32_t denom) {
 		   timer_sleep() because it will yield the CPU to other 
 		   processes. */
 		timer_sleep (ticks);
+	} else if (tsc_mult != 0) {
+		/* Otherwise, spin on the TSC clock for accurate sub-tick
+		   timing. */
+		int64_t end;
+
+		ASSERT (denom % 1000 == 0);
+		end = timer_now_ns () + num * (1000000000 / denom);
+		while (timer_now_ns () < end)
+			barrier ();
 	} else {
-		/* Otherwise, use a busy-wait loop for more accurate
-		   sub-tick timing.  We scale the numerator and denominator
-		   down by 1000 to avoid the possibility of overflow. */
+		/* Before the TSC is calibrated, use a busy-wait loop.  We
+		   scale the numerator and denominator down by 1000 to
+		   avoid the possibility of overflow. */
 		ASSERT (denom % 1000 == 0);
 		busy_wait (loops_per_tick * num / 1000 * TIMER_FREQ / (denom / 1000));
 	}
@@ -25,9 +25,24 @@ static size_t cx, cy;
    The attribute at (x,y) is fb[y][x][1]. */
 static uint8_t (*fb)[COL_CNT][2];
 
+/* Shadow copy of the screen, which output is written to before
+   being copied to the framebuffer in flush().  Rows are kept in a
+   ring, so that scrolling is a matter of advancing TOP: screen row
+   Y is shadow[(top + Y) % ROW_CNT]. */
+static uint8_t shadow[ROW_CNT][COL_CNT][2];
+static size_t top;
+
+/* Bit Y is set if screen row Y differs from the framebuffer. */
+static uint32_t dirty;
+
+/* Cursor position last given to the hardware, as an offset. */
+static uint16_t hw_cursor;
+
 static void clear_row (size_t y);
 static void cls (void);
 static void newline (void);
+static void putc_shadow (int c);
+static void flush (void);
 static void move_cursor (void);
 static void find_cursor (size_t *x, size_t *y);
 
@@ -38,11 +53,20 @@ init (void) {
 	static bool inited;
 	if (!inited) {
 		fb = ptov (0xb8000);
+		memcpy (shadow, fb, sizeof shadow);
 		find_cursor (&cx, &cy);
+		hw_cursor = cx + COL_CNT * cy;
 		inited = true;
 	}
 }
 
+/* Returns the shadow buffer's character at screen position
+   (X,Y).  Its attribute follows it. */
+static uint8_t *
+cell (size_t x, size_t y) {
+	return shadow[(top + y) % ROW_CNT][x];
+}
+
 /* Writes C to the VGA text display, interpreting control
    characters in the conventional ways.  */
 void
@@ -52,7 +76,31 @@ vga_putc (int c) {
 	enum intr_level old_level = intr_disable ();
 
 	init ();
+	putc_shadow (c);
+	flush ();
+
+	intr_set_level (old_level);
+}
+
+/* Writes the N characters in BUFFER to the VGA text display, as
+   vga_putc() would one at a time, but updates the screen and the
+   cursor only once at the end. */
+void
+vga_putbuf (const char *buffer, size_t n) {
+	enum intr_level old_level = intr_disable ();
+
+	init ();
+	while (n-- > 0)
+		putc_shadow (*buffer++);
+	flush ();
 
+	intr_set_level (old_level);
+}
+
+/* Writes C to the shadow buffer, interpreting control characters
+   in the conventional ways. */
+static void
+putc_shadow (int c) {
 	switch (c) {
 		case '\n':
 			newline ();
@@ -78,19 +126,27 @@ vga_putc (int c) {
 			break;
 
 		default:
-			fb[cy][cx][0] = c;
-			fb[cy][cx][1] = GRAY_ON_BLACK;
+			cell (cx, cy)[0] = c;
+			cell (cx, cy)[1] = GRAY_ON_BLACK;
+			dirty |= 1u << cy;
 			if (++cx >= COL_CNT)
 				newline ();
 			break;
 	}
+}
 
-	/* Update cursor position. */
-	move_cursor ();
+/* Copies the rows of the shadow buffer that changed to the
+   framebuffer and moves the hardware cursor, if it moved. */
+static void
+flush (void) {
+	size_t y;
 
-	intr_set_level (old_level);
+	for (y = 0; dirty != 0; y++, dirty >>= 1)
+		if (dirty & 1)
+			memcpy (fb[y], cell (0, y), sizeof fb[y]);
+	move_cursor ();
 }
-
+
 /* Clears the screen and moves the cursor to the upper left. */
 static void
 cls (void) {
@@ -100,24 +156,25 @@ cls (void) {
 		clear_row (y);
 
 	cx = cy = 0;
-	move_cursor ();
 }
 
-/* Clears row Y to spaces. */
+/* Clears screen row Y to spaces. */
 static void
 clear_row (size_t y) {
 	size_t x;
 
 	for (x = 0; x < COL_CNT; x++)
 	{
-		fb[y][x][0] = ' ';
-		fb[y][x][1] = GRAY_ON_BLACK;
+		cell (x, y)[0] = ' ';
+		cell (x, y)[1] = GRAY_ON_BLACK;
 	}
+	dirty |= 1u << y;
 }
 
 /* Advances the cursor to the first column in the next line on
    the screen.  If the cursor is already on the last line on the
-   screen, scrolls the screen upward one line. */
+   screen, scrolls the screen upward one line by rotating the
+   shadow buffer's rows, which leaves every row to be redrawn. */
 static void
 newline (void) {
 	cx = 0;
@@ -125,16 +182,21 @@ newline (void) {
 	if (cy >= ROW_CNT)
 	{
 		cy = ROW_CNT - 1;
-		memmove (&fb[0], &fb[1], sizeof fb[0] * (ROW_CNT - 1));
+		top = (top + 1) % ROW_CNT;
 		clear_row (ROW_CNT - 1);
+		dirty = (1u << ROW_CNT) - 1;
 	}
 }
 
-/* Moves the hardware cursor to (cx,cy). */
+/* Moves the hardware cursor to (cx,cy), unless it is there
+   already. */
 static void
 move_cursor (void) {
 	/* See [FREEVGA] under "Manipulating the Text-mode Cursor". */
 	uint16_t cp = cx + COL_CNT * cy;
+	if (cp == hw_cursor)
+		return;
+	hw_cursor = cp;
 	outw (0x3d4, 0x0e | (cp & 0xff00));
 	outw (0x3d4, 0x0f | (cp << 8));
 }
@@ -0,0 +1,276 @@
+#include "filesys/block.h"
+#include <debug.h>
+#include <random.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/malloc.h"
+
+/* Layout descriptor, kept in physical sector LAYOUT_SECTOR of
+ * every member disk.  Records which disks make up the block
+ * device and in what order, so that the device can be assembled
+ * at mount time from the descriptor on its first member. */
+struct layout {
+	uint32_t magic;                     /* LAYOUT_MAGIC. */
+	uint32_t set_id;                    /* Identifies the stripe set. */
+	uint32_t member_cnt;                /* Number of member disks. */
+	uint32_t member_idx;                /* This member's position. */
+	uint32_t stripe_sectors;            /* Sectors per stripe unit. */
+	disk_sector_t member_sectors;       /* Data sectors on each member. */
+	uint8_t members[BLOCK_MEMBER_MAX][2];   /* Channel, device numbers. */
+	uint8_t unused[DISK_SECTOR_SIZE - 24 - BLOCK_MEMBER_MAX * 2];
+};
+
+/* Identifies a layout descriptor. */
+#define LAYOUT_MAGIC 0x4b4c4244
+
+/* Physical sector of the layout descriptor on each member.  Data
+ * starts right after it. */
+#define LAYOUT_SECTOR 0
+#define DATA_START (LAYOUT_SECTOR + 1)
+
+/* Members used when none are given: the file system disk alone. */
+#define DEFAULT_MEMBERS "0:1"
+
+/* A block device. */
+struct block {
+	struct disk *members[BLOCK_MEMBER_MAX];   /* Member disks, in order. */
+	size_t member_cnt;                        /* Number of members. */
+	disk_sector_t member_sectors;             /* Data sectors per member. */
+	disk_sector_t size;                       /* Size in sectors. */
+};
+
+static void parse_members (const char *, struct layout *);
+static struct disk *get_member (const struct layout *, size_t idx);
+static void format_members (struct block *, struct layout *);
+static void check_members (struct block *, const struct layout *);
+
+/* Assembles the file system's block device.
+ *
+ * If FORMAT is true, the device is laid out afresh over MEMBERS,
+ * a comma-separated list of CHAN:DEV disk numbers such as
+ * "0:1,1:0", and the layout is written to each member.
+ * Otherwise the layout is read back from the first disk in
+ * MEMBERS, and the rest of the list is ignored.  A null MEMBERS
+ * stands for hd0:1 alone.  Panics if the disks do not form a
+ * valid device. */
+struct block *
+block_open (const char *members, bool format) {
+	struct block *b = calloc (1, sizeof *b);
+	struct layout *layout = calloc (1, sizeof *layout);
+
+	if (b == NULL || layout == NULL)
+		PANIC ("block device allocation failed");
+
+	parse_members (members != NULL ? members : DEFAULT_MEMBERS, layout);
+	if (format)
+		format_members (b, layout);
+	else {
+		struct disk *first = get_member (layout, 0);
+		disk_read (first, LAYOUT_SECTOR, layout);
+		if (layout->magic != LAYOUT_MAGIC)
+			PANIC ("no file system layout on hd%d:%d (use -f to format)",
+					layout->members[0][0], layout->members[0][1]);
+		check_members (b, layout);
+	}
+	free (layout);
+
+	b->size = b->member_sectors * b->member_cnt;
+	if (b->member_cnt > 1)
+		printf ("filesys: %'"PRDSNu" sectors striped over %zu disks\n",
+				b->size, b->member_cnt);
+	return b;
+}
+
+/* Returns the size of B in sectors. */
+disk_sector_t
+block_size (struct block *b) {
+	return b->size;
+}
+
+/* Returns the member disk that holds SECTOR of B and stores the
+ * sector's number on that disk in *PHYS.  Consecutive runs of
+ * BLOCK_STRIPE_SECTORS sectors go to the members in turn. */
+static struct disk *
+map_sector (const struct block *b, disk_sector_t sector, disk_sector_t *phys) {
+	disk_sector_t unit = sector / BLOCK_STRIPE_SECTORS;
+
+	ASSERT (sector < b->size);
+
+	*phys = DATA_START + unit / b->member_cnt * BLOCK_STRIPE_SECTORS
+		+ sector % BLOCK_STRIPE_SECTORS;
+	return b->members[unit % b->member_cnt];
+}
+
+/* Reads SECTOR of B into BUFFER, which must have room for
+ * DISK_SECTOR_SIZE bytes. */
+void
+block_read (struct block *b, disk_sector_t sector, void *buffer) {
+	disk_sector_t phys;
+	struct disk *d = map_sector (b, sector, &phys);
+
+	disk_read (d, phys, buffer);
+}
+
+/* Writes BUFFER, which must contain DISK_SECTOR_SIZE bytes, to
+ * SECTOR of B. */
+void
+block_write (struct block *b, disk_sector_t sector, const void *buffer) {
+	disk_sector_t phys;
+	struct disk *d = map_sector (b, sector, &phys);
+
+	disk_write (d, phys, buffer);
+}
+
+/* Transfers the CNT sectors of B starting at SECTOR to or from
+ * BUFS[0] through BUFS[CNT - 1], one sector each.  All of the
+ * requests are queued before any is waited for, so that members
+ * on different channels work in parallel and the driver can merge
+ * the sectors that land on each member. */
+static void
+transfer (struct block *b, disk_sector_t sector, size_t cnt, void *bufs[],
+		bool write) {
+	struct disk_request *reqs = NULL;
+	size_t i;
+
+	if (cnt > 1)
+		reqs = malloc (cnt * sizeof *reqs);
+	if (reqs == NULL) {
+		for (i = 0; i < cnt; i++)
+			if (write)
+				block_write (b, sector + i, bufs[i]);
+			else
+				block_read (b, sector + i, bufs[i]);
+		return;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		disk_sector_t phys;
+		struct disk *d = map_sector (b, sector + i, &phys);
+
+		disk_request_init (&reqs[i], d, phys, bufs[i], write);
+		disk_submit (&reqs[i]);
+	}
+	for (i = 0; i < cnt; i++)
+		disk_wait (&reqs[i]);
+	free (reqs);
+}
+
+/* Reads the CNT sectors of B starting at SECTOR into BUFS[0]
+ * through BUFS[CNT - 1]. */
+void
+block_readv (struct block *b, disk_sector_t sector, size_t cnt, void *bufs[]) {
+	transfer (b, sector, cnt, bufs, false);
+}
+
+/* Writes BUFS[0] through BUFS[CNT - 1] to the CNT sectors of B
+ * starting at SECTOR. */
+void
+block_writev (struct block *b, disk_sector_t sector, size_t cnt,
+		const void *bufs[]) {
+	transfer (b, sector, cnt, (void **) bufs, true);
+}
+
+/* Layout. */
+
+/* Parses MEMBERS, a comma-separated list of CHAN:DEV pairs, into
+ * LAYOUT's member list and count.  Panics on a malformed list. */
+static void
+parse_members (const char *members, struct layout *layout) {
+	const char *p = members;
+
+	layout->member_cnt = 0;
+	while (*p != '\0') {
+		if (layout->member_cnt == BLOCK_MEMBER_MAX
+				|| p[0] < '0' || p[0] > '1' || p[1] != ':'
+				|| p[2] < '0' || p[2] > '1'
+				|| (p[3] != ',' && p[3] != '\0'))
+			PANIC ("bad file system disk list `%s'", members);
+		layout->members[layout->member_cnt][0] = p[0] - '0';
+		layout->members[layout->member_cnt][1] = p[2] - '0';
+		layout->member_cnt++;
+		p += p[3] == ',' ? 4 : 3;
+	}
+	if (layout->member_cnt == 0)
+		PANIC ("empty file system disk list");
+}
+
+/* Returns member IDX of LAYOUT, panicking if it is not an ATA disk
+ * or is the boot disk or, with VM, the swap disk. */
+static struct disk *
+get_member (const struct layout *layout, size_t idx) {
+	int chan_no = layout->members[idx][0];
+	int dev_no = layout->members[idx][1];
+	struct disk *d = disk_get (chan_no, dev_no);
+	bool reserved = chan_no == 0 && dev_no == 0;
+
+#ifdef VM
+	reserved = reserved || (chan_no == 1 && dev_no == 1);
+#endif
+	if (d == NULL || reserved)
+		PANIC ("hd%d:%d cannot hold the file system", chan_no, dev_no);
+	return d;
+}
+
+/* Lays out B over the members listed in LAYOUT and writes a
+ * descriptor to each.  Every member contributes as many whole
+ * stripe units as the smallest one holds. */
+static void
+format_members (struct block *b, struct layout *layout) {
+	size_t i, j;
+
+	b->member_cnt = layout->member_cnt;
+	b->member_sectors = (disk_sector_t) -1;
+	for (i = 0; i < b->member_cnt; i++) {
+		disk_sector_t cap;
+
+		b->members[i] = get_member (layout, i);
+		for (j = 0; j < i; j++)
+			if (b->members[j] == b->members[i])
+				PANIC ("file system disk list names a disk twice");
+		cap = disk_size (b->members[i]) - DATA_START;
+		if (cap < b->member_sectors)
+			b->member_sectors = cap;
+	}
+	b->member_sectors -= b->member_sectors % BLOCK_STRIPE_SECTORS;
+
+	layout->magic = LAYOUT_MAGIC;
+	layout->set_id = random_ulong ();
+	layout->stripe_sectors = BLOCK_STRIPE_SECTORS;
+	layout->member_sectors = b->member_sectors;
+	for (i = 0; i < b->member_cnt; i++) {
+		layout->member_idx = i;
+		disk_write (b->members[i], LAYOUT_SECTOR, layout);
+	}
+}
+
+/* Opens the members listed in LAYOUT, as read from the first
+ * member, into B, and checks that each carries the descriptor of
+ * the same stripe set at the expected position. */
+static void
+check_members (struct block *b, const struct layout *layout) {
+	struct layout *other;
+	size_t i;
+
+	if (layout->member_cnt == 0 || layout->member_cnt > BLOCK_MEMBER_MAX
+			|| layout->stripe_sectors != BLOCK_STRIPE_SECTORS)
+		PANIC ("unsupported file system layout");
+
+	other = malloc (sizeof *other);
+	if (other == NULL)
+		PANIC ("block device allocation failed");
+
+	b->member_cnt = layout->member_cnt;
+	b->member_sectors = layout->member_sectors;
+	for (i = 0; i < b->member_cnt; i++) {
+		b->members[i] = get_member (layout, i);
+		if (disk_size (b->members[i]) < DATA_START + b->member_sectors)
+			PANIC ("hd%d:%d is too small for the file system layout",
+					layout->members[i][0], layout->members[i][1]);
+		disk_read (b->members[i], LAYOUT_SECTOR, other);
+		if (other->magic != LAYOUT_MAGIC || other->set_id != layout->set_id
+				|| other->member_idx != i)
+			PANIC ("hd%d:%d is not member %zu of the file system",
+					layout->members[i][0], layout->members[i][1], i);
+	}
+	free (other);
+}
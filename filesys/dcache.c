@@ -0,0 +1,160 @@
+#include "filesys/dcache.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* Maximum number of cached names.  Beyond this the least
+ * recently used entry is recycled. */
+#define DCACHE_SIZE 512
+
+/* A cached path component: NAME in the directory whose inode is
+ * in sector PARENT resolves to the inode in sector CHILD, or to
+ * nothing if CHILD is DCACHE_NEGATIVE. */
+struct dentry {
+	struct hash_elem hash_elem;         /* Element in dentries. */
+	struct list_elem lru_elem;          /* Element in lru. */
+	disk_sector_t parent;               /* Sector of parent directory. */
+	disk_sector_t child;                /* Sector of named inode. */
+	char name[NAME_MAX + 1];            /* Null terminated file name. */
+};
+
+static struct hash dentries;            /* All entries, by parent and name. */
+static struct list lru;                 /* All entries, most recent first. */
+static struct lock dcache_lock;         /* Protects dentries and lru. */
+
+static uint64_t
+dentry_hash (const struct hash_elem *e, void *aux UNUSED) {
+	const struct dentry *d = hash_entry (e, struct dentry, hash_elem);
+	return hash_string (d->name) ^ hash_int (d->parent);
+}
+
+static bool
+dentry_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	const struct dentry *d_a = hash_entry (a, struct dentry, hash_elem);
+	const struct dentry *d_b = hash_entry (b, struct dentry, hash_elem);
+	if (d_a->parent != d_b->parent)
+		return d_a->parent < d_b->parent;
+	return strcmp (d_a->name, d_b->name) < 0;
+}
+
+/* Initializes the directory entry cache. */
+void
+dcache_init (void) {
+	if (!hash_init (&dentries, dentry_hash, dentry_less, NULL))
+		PANIC ("dentry cache creation failed");
+	list_init (&lru);
+	lock_init (&dcache_lock);
+}
+
+/* Returns the entry for NAME in PARENT, or a null pointer if it
+ * is not cached.  The caller must hold dcache_lock. */
+static struct dentry *
+find (disk_sector_t parent, const char *name) {
+	struct dentry key;
+	struct hash_elem *e;
+
+	if (strlen (name) > NAME_MAX)
+		return NULL;
+	key.parent = parent;
+	strlcpy (key.name, name, sizeof key.name);
+	e = hash_find (&dentries, &key.hash_elem);
+	return e != NULL ? hash_entry (e, struct dentry, hash_elem) : NULL;
+}
+
+/* Drops D from the cache and frees it.  The caller must hold
+ * dcache_lock. */
+static void
+drop (struct dentry *d) {
+	hash_delete (&dentries, &d->hash_elem);
+	list_remove (&d->lru_elem);
+	free (d);
+}
+
+/* Looks up NAME in the directory at sector PARENT.  If the cache
+ * knows the answer, returns true and stores the named inode's
+ * sector, or DCACHE_NEGATIVE if there is no such name, into
+ * *CHILD.  Returns false on a miss. */
+bool
+dcache_lookup (disk_sector_t parent, const char *name,
+		disk_sector_t *child) {
+	struct dentry *d;
+
+	lock_acquire (&dcache_lock);
+	d = find (parent, name);
+	if (d != NULL) {
+		list_remove (&d->lru_elem);
+		list_push_front (&lru, &d->lru_elem);
+		*child = d->child;
+	}
+	lock_release (&dcache_lock);
+
+	return d != NULL;
+}
+
+/* Records that NAME in the directory at sector PARENT resolves
+ * to the inode at sector CHILD, or to nothing if CHILD is
+ * DCACHE_NEGATIVE.  Caching is best effort, so running out of
+ * memory is not an error. */
+void
+dcache_insert (disk_sector_t parent, const char *name,
+		disk_sector_t child) {
+	struct dentry *d;
+
+	if (strlen (name) > NAME_MAX)
+		return;
+
+	lock_acquire (&dcache_lock);
+	d = find (parent, name);
+	if (d == NULL) {
+		if (hash_size (&dentries) >= DCACHE_SIZE) {
+			d = list_entry (list_back (&lru), struct dentry, lru_elem);
+			drop (d);
+		}
+		d = malloc (sizeof *d);
+		if (d == NULL)
+			goto done;
+		d->parent = parent;
+		strlcpy (d->name, name, sizeof d->name);
+		hash_insert (&dentries, &d->hash_elem);
+	} else
+		list_remove (&d->lru_elem);
+	d->child = child;
+	list_push_front (&lru, &d->lru_elem);
+
+done:
+	lock_release (&dcache_lock);
+}
+
+/* Forgets anything cached about NAME in the directory at sector
+ * PARENT. */
+void
+dcache_invalidate (disk_sector_t parent, const char *name) {
+	struct dentry *d;
+
+	lock_acquire (&dcache_lock);
+	d = find (parent, name);
+	if (d != NULL)
+		drop (d);
+	lock_release (&dcache_lock);
+}
+
+/* Forgets every name cached for the directory at sector PARENT,
+ * which is about to go away and whose sector may be reused. */
+void
+dcache_invalidate_dir (disk_sector_t parent) {
+	struct list_elem *e, *next;
+
+	lock_acquire (&dcache_lock);
+	for (e = list_begin (&lru); e != list_end (&lru); e = next) {
+		struct dentry *d = list_entry (e, struct dentry, lru_elem);
+		next = list_next (e);
+		if (d->parent == parent)
+			drop (d);
+	}
+	lock_release (&dcache_lock);
+}
@@ -2,13 +2,18 @@
 #include <stdio.h>
 #include <string.h>
 #include <list.h>
+#include <hash.h>
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
+#include "threads/slab.h"
+#include "threads/vaddr.h"
 
 /* A directory. */
 struct dir {
 	struct inode *inode;                /* Backing store. */
+	struct dir_index *index;            /* Shared name index. */
 	off_t pos;                          /* Current position. */
 };
 
@@ -19,6 +24,178 @@ struct dir_entry {
 	bool in_use;                        /* In use or free? */
 };
 
+/* In-memory index over the entries of one directory inode.
+ * Every `struct dir' open on the same inode shares one index,
+ * so that lookup() and dir_add() do not have to scan the
+ * directory.  The index is filled from disk on first use and
+ * afterwards kept in step by dir_add() and dir_remove(). */
+struct dir_index {
+	struct list_elem elem;              /* Element in open_indexes. */
+	struct inode *inode;                /* Directory inode. */
+	int open_cnt;                       /* Number of `struct dir's. */
+	bool loaded;                        /* Entries read from disk yet? */
+	struct hash names;                  /* In-use slots, keyed by name. */
+	struct list free_slots;             /* Slots that are not in use. */
+	off_t end;                          /* Offset just past the last slot. */
+};
+
+/* One directory entry slot, as tracked by a `struct dir_index'. */
+struct dir_slot {
+	union {
+		struct hash_elem hash_elem;     /* Element in names if in use. */
+		struct list_elem list_elem;     /* Element in free_slots if not. */
+	};
+	off_t ofs;                          /* Byte offset of entry in directory. */
+	disk_sector_t inode_sector;         /* Sector number of header. */
+	char name[NAME_MAX + 1];            /* Null terminated file name. */
+};
+
+/* List of indexes of open directories. */
+static struct list open_indexes;
+
+/* Cache of open directories. */
+static struct kmem_cache *dir_cache;
+
+static uint64_t
+dir_slot_hash (const struct hash_elem *e, void *aux UNUSED) {
+	const struct dir_slot *slot = hash_entry (e, struct dir_slot, hash_elem);
+	return hash_string (slot->name);
+}
+
+static bool
+dir_slot_less (const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED) {
+	const struct dir_slot *slot_a = hash_entry (a, struct dir_slot, hash_elem);
+	const struct dir_slot *slot_b = hash_entry (b, struct dir_slot, hash_elem);
+	return strcmp (slot_a->name, slot_b->name) < 0;
+}
+
+static void
+dir_slot_free (struct hash_elem *e, void *aux UNUSED) {
+	free (hash_entry (e, struct dir_slot, hash_elem));
+}
+
+/* Returns the index for directory INODE, creating an empty one
+ * if no directory on INODE is open yet.  Returns a null pointer
+ * if memory allocation fails. */
+static struct dir_index *
+index_open (struct inode *inode) {
+	struct dir_index *index;
+	struct list_elem *e;
+
+	for (e = list_begin (&open_indexes); e != list_end (&open_indexes);
+			e = list_next (e)) {
+		index = list_entry (e, struct dir_index, elem);
+		if (index->inode == inode) {
+			index->open_cnt++;
+			return index;
+		}
+	}
+
+	index = malloc (sizeof *index);
+	if (index == NULL)
+		return NULL;
+	if (!hash_init (&index->names, dir_slot_hash, dir_slot_less, NULL)) {
+		free (index);
+		return NULL;
+	}
+	index->inode = inode;
+	index->open_cnt = 1;
+	index->loaded = false;
+	list_init (&index->free_slots);
+	index->end = 0;
+	list_push_front (&open_indexes, &index->elem);
+	return index;
+}
+
+/* Drops a reference to INDEX, freeing it once the last directory
+ * on its inode is closed. */
+static void
+index_close (struct dir_index *index) {
+	if (index == NULL || --index->open_cnt > 0)
+		return;
+
+	list_remove (&index->elem);
+	hash_destroy (&index->names, dir_slot_free);
+	while (!list_empty (&index->free_slots))
+		free (list_entry (list_pop_front (&index->free_slots),
+					struct dir_slot, list_elem));
+	free (index);
+}
+
+/* Reads every entry of INDEX's directory into it, a page at a
+ * time.  Returns true if successful, false if memory ran out, in
+ * which case INDEX is left empty and unloaded. */
+static bool
+index_load (struct dir_index *index) {
+	const size_t per_page = PGSIZE / sizeof (struct dir_entry);
+	struct dir_entry *entries;
+	off_t ofs = 0;
+
+	if (index->loaded)
+		return true;
+
+	entries = malloc (per_page * sizeof *entries);
+	if (entries == NULL)
+		return false;
+
+	for (;;) {
+		off_t bytes = inode_read_at (index->inode, entries,
+				per_page * sizeof *entries, ofs);
+		size_t cnt = bytes / sizeof *entries;
+		size_t i;
+
+		for (i = 0; i < cnt; i++, ofs += sizeof *entries) {
+			struct dir_slot *slot = malloc (sizeof *slot);
+			if (slot == NULL)
+				goto fail;
+			slot->ofs = ofs;
+			if (entries[i].in_use) {
+				slot->inode_sector = entries[i].inode_sector;
+				strlcpy (slot->name, entries[i].name, sizeof slot->name);
+				hash_insert (&index->names, &slot->hash_elem);
+			} else
+				list_push_back (&index->free_slots, &slot->list_elem);
+		}
+		if (cnt < per_page)
+			break;
+	}
+	free (entries);
+
+	index->end = ofs;
+	index->loaded = true;
+	return true;
+
+fail:
+	free (entries);
+	hash_clear (&index->names, dir_slot_free);
+	while (!list_empty (&index->free_slots))
+		free (list_entry (list_pop_front (&index->free_slots),
+					struct dir_slot, list_elem));
+	return false;
+}
+
+/* Returns the in-use slot for NAME in INDEX, or a null pointer if
+ * there is none.  A NAME longer than NAME_MAX matches nothing. */
+static struct dir_slot *
+index_find (struct dir_index *index, const char *name) {
+	struct dir_slot key;
+	struct hash_elem *e;
+
+	if (strlen (name) > NAME_MAX)
+		return NULL;
+	strlcpy (key.name, name, sizeof key.name);
+	e = hash_find (&index->names, &key.hash_elem);
+	return e != NULL ? hash_entry (e, struct dir_slot, hash_elem) : NULL;
+}
+
+/* Initializes the directory module. */
+void
+dir_init (void) {
+	list_init (&open_indexes);
+	dir_cache = kmem_cache_create ("dir", sizeof (struct dir), NULL);
+}
+
 /* Creates a directory with space for ENTRY_CNT entries in the
  * given SECTOR.  Returns true if successful, false on failure. */
 bool
@@ -30,14 +207,18 @@ dir_create (disk_sector_t sector, size_t entry_cnt) {
  * it takes ownership.  Returns a null pointer on failure. */
 struct dir *
 dir_open (struct inode *inode) {
-	struct dir *dir = calloc (1, sizeof *dir);
-	if (inode != NULL && dir != NULL) {
+	struct dir *dir = kmem_cache_zalloc (dir_cache);
+	struct dir_index *index = NULL;
+	if (inode != NULL && dir != NULL
+			&& (index = index_open (inode)) != NULL) {
+		inode_set_metadata (inode);
 		dir->inode = inode;
+		dir->index = index;
 		dir->pos = 0;
 		return dir;
 	} else {
 		inode_close (inode);
-		free (dir);
+		kmem_cache_free (dir_cache, dir);
 		return NULL;
 	}
 }
@@ -60,8 +241,9 @@ dir_reopen (struct dir *dir) {
 void
 dir_close (struct dir *dir) {
 	if (dir != NULL) {
+		index_close (dir->index);
 		inode_close (dir->inode);
-		free (dir);
+		kmem_cache_free (dir_cache, dir);
 	}
 }
 
@@ -75,7 +257,9 @@ dir_get_inode (struct dir *dir) {
  * If successful, returns true, sets *EP to the directory entry
  * if EP is non-null, and sets *OFSP to the byte offset of the
  * directory entry if OFSP is non-null.
- * otherwise, returns false and ignores EP and OFSP. */
+ * otherwise, returns false and ignores EP and OFSP.
+ * Falls back to scanning the directory if its index cannot be
+ * loaded. */
 static bool
 lookup (const struct dir *dir, const char *name,
 		struct dir_entry *ep, off_t *ofsp) {
@@ -85,6 +269,20 @@ lookup (const struct dir *dir, const char *name,
 	ASSERT (dir != NULL);
 	ASSERT (name != NULL);
 
+	if (index_load (dir->index)) {
+		struct dir_slot *slot = index_find (dir->index, name);
+		if (slot == NULL)
+			return false;
+		if (ep != NULL) {
+			ep->inode_sector = slot->inode_sector;
+			strlcpy (ep->name, slot->name, sizeof ep->name);
+			ep->in_use = true;
+		}
+		if (ofsp != NULL)
+			*ofsp = slot->ofs;
+		return true;
+	}
+
 	for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
 			ofs += sizeof e)
 		if (e.in_use && !strcmp (name, e.name)) {
@@ -104,13 +302,23 @@ lookup (const struct dir *dir, const char *name,
 bool
 dir_lookup (const struct dir *dir, const char *name,
 		struct inode **inode) {
+	disk_sector_t parent, child;
 	struct dir_entry e;
 
 	ASSERT (dir != NULL);
 	ASSERT (name != NULL);
 
-	if (lookup (dir, name, &e, NULL))
-		*inode = inode_open (e.inode_sector);
+	/* Consult the dentry cache first, so that a hit does not
+	 * touch the directory's blocks at all. */
+	parent = inode_get_inumber (dir->inode);
+	if (!dcache_lookup (parent, name, &child)) {
+		child = (lookup (dir, name, &e, NULL) ? e.inode_sector
+				: DCACHE_NEGATIVE);
+		dcache_insert (parent, name, child);
+	}
+
+	if (child != DCACHE_NEGATIVE)
+		*inode = inode_open (child);
 	else
 		*inode = NULL;
 
@@ -140,6 +348,42 @@ dir_add (struct dir *dir, const char *name, disk_sector_t inode_sector) {
 	if (lookup (dir, name, NULL, NULL))
 		goto done;
 
+	/* Take a free slot from the index, or append one at the
+	 * current end-of-file if there are no free slots. */
+	if (index_load (dir->index)) {
+		struct dir_index *index = dir->index;
+		struct dir_slot *slot;
+
+		if (!list_empty (&index->free_slots))
+			slot = list_entry (list_pop_front (&index->free_slots),
+					struct dir_slot, list_elem);
+		else {
+			slot = malloc (sizeof *slot);
+			if (slot == NULL)
+				goto done;
+			slot->ofs = index->end;
+		}
+
+		/* Write slot. */
+		e.in_use = true;
+		strlcpy (e.name, name, sizeof e.name);
+		e.inode_sector = inode_sector;
+		success = inode_write_at (dir->inode, &e, sizeof e, slot->ofs)
+			== sizeof e;
+
+		if (success) {
+			if (slot->ofs == index->end)
+				index->end += sizeof e;
+			slot->inode_sector = inode_sector;
+			strlcpy (slot->name, name, sizeof slot->name);
+			hash_insert (&index->names, &slot->hash_elem);
+		} else if (slot->ofs < index->end)
+			list_push_front (&index->free_slots, &slot->list_elem);
+		else
+			free (slot);
+		goto done;
+	}
+
 	/* Set OFS to offset of free slot.
 	 * If there are no free slots, then it will be set to the
 	 * current end-of-file.
@@ -159,6 +403,10 @@ dir_add (struct dir *dir, const char *name, disk_sector_t inode_sector) {
 	success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
 
 done:
+	if (success)
+		dcache_insert (inode_get_inumber (dir->inode), name, inode_sector);
+	else
+		dcache_invalidate (inode_get_inumber (dir->inode), name);
 	return success;
 }
 
@@ -189,7 +437,17 @@ dir_remove (struct dir *dir, const char *name) {
 	if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e)
 		goto done;
 
-	/* Remove inode. */
+	/* Move its slot to the free list. */
+	if (dir->index->loaded) {
+		struct dir_slot *slot = index_find (dir->index, name);
+		ASSERT (slot != NULL);
+		hash_delete (&dir->index->names, &slot->hash_elem);
+		list_push_front (&dir->index->free_slots, &slot->list_elem);
+	}
+
+	/* Remove inode, and anything cached about it or its name. */
+	dcache_insert (inode_get_inumber (dir->inode), name, DCACHE_NEGATIVE);
+	dcache_invalidate_dir (e.inode_sector);
 	inode_remove (inode);
 	success = true;
 
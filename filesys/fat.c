@@ -1,5 +1,6 @@
 #include "filesys/fat.h"
 #include "devices/disk.h"
+#include "filesys/block.h"
 #include "filesys/filesys.h"
 #include "threads/malloc.h"
 #include "threads/synch.h"
@@ -41,7 +42,7 @@ fat_init (void) {
 	unsigned int *bounce = malloc (DISK_SECTOR_SIZE);
 	if (bounce == NULL)
 		PANIC ("FAT init failed");
-	disk_read (filesys_disk, FAT_BOOT_SECTOR, bounce);
+	block_read (fs_device, FAT_BOOT_SECTOR, bounce);
 	memcpy (&fat_fs->bs, bounce, sizeof (fat_fs->bs));
 	free (bounce);
 
@@ -65,14 +66,14 @@ fat_open (void) {
 	for (unsigned i = 0; i < fat_fs->bs.fat_sectors; i++) {
 		bytes_left = fat_size_in_bytes - bytes_read;
 		if (bytes_left >= DISK_SECTOR_SIZE) {
-			disk_read (filesys_disk, fat_fs->bs.fat_start + i,
+			block_read (fs_device, fat_fs->bs.fat_start + i,
 			           buffer + bytes_read);
 			bytes_read += DISK_SECTOR_SIZE;
 		} else {
 			uint8_t *bounce = malloc (DISK_SECTOR_SIZE);
 			if (bounce == NULL)
 				PANIC ("FAT load failed");
-			disk_read (filesys_disk, fat_fs->bs.fat_start + i, bounce);
+			block_read (fs_device, fat_fs->bs.fat_start + i, bounce);
 			memcpy (buffer + bytes_read, bounce, bytes_left);
 			bytes_read += bytes_left;
 			free (bounce);
@@ -87,7 +88,7 @@ fat_close (void) {
 	if (bounce == NULL)
 		PANIC ("FAT close failed");
 	memcpy (bounce, &fat_fs->bs, sizeof (fat_fs->bs));
-	disk_write (filesys_disk, FAT_BOOT_SECTOR, bounce);
+	block_write (fs_device, FAT_BOOT_SECTOR, bounce);
 	free (bounce);
 
 	// Write FAT directly to the disk
@@ -98,7 +99,7 @@ fat_close (void) {
 	for (unsigned i = 0; i < fat_fs->bs.fat_sectors; i++) {
 		bytes_left = fat_size_in_bytes - bytes_wrote;
 		if (bytes_left >= DISK_SECTOR_SIZE) {
-			disk_write (filesys_disk, fat_fs->bs.fat_start + i,
+			block_write (fs_device, fat_fs->bs.fat_start + i,
 			            buffer + bytes_wrote);
 			bytes_wrote += DISK_SECTOR_SIZE;
 		} else {
@@ -106,7 +107,7 @@ fat_close (void) {
 			if (bounce == NULL)
 				PANIC ("FAT close failed");
 			memcpy (bounce, buffer + bytes_wrote, bytes_left);
-			disk_write (filesys_disk, fat_fs->bs.fat_start + i, bounce);
+			block_write (fs_device, fat_fs->bs.fat_start + i, bounce);
 			bytes_wrote += bytes_left;
 			free (bounce);
 		}
@@ -131,19 +132,19 @@ fat_create (void) {
 	uint8_t *buf = calloc (1, DISK_SECTOR_SIZE);
 	if (buf == NULL)
 		PANIC ("FAT create failed due to OOM");
-	disk_write (filesys_disk, cluster_to_sector (ROOT_DIR_CLUSTER), buf);
+	block_write (fs_device, cluster_to_sector (ROOT_DIR_CLUSTER), buf);
 	free (buf);
 }
 
 void
 fat_boot_create (void) {
 	unsigned int fat_sectors =
-	    (disk_size (filesys_disk) - 1)
+	    (block_size (fs_device) - 1)
 	    / (DISK_SECTOR_SIZE / sizeof (cluster_t) * SECTORS_PER_CLUSTER + 1) + 1;
 	fat_fs->bs = (struct fat_boot){
 	    .magic = FAT_MAGIC,
 	    .sectors_per_cluster = SECTORS_PER_CLUSTER,
-	    .total_sectors = disk_size (filesys_disk),
+	    .total_sectors = block_size (fs_device),
 	    .fat_start = 1,
 	    .fat_sectors = fat_sectors,
 	    .root_dir_cluster = ROOT_DIR_CLUSTER,
@@ -6,22 +6,39 @@
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
 #include "filesys/directory.h"
+#include "filesys/dcache.h"
+#include "filesys/journal.h"
+#include "filesys/block.h"
 #include "devices/disk.h"
 
-/* The disk that contains the file system. */
-struct disk *filesys_disk;
+/* The block device that contains the file system. */
+struct block *fs_device;
+
+/* Disks to lay the file system out over when formatting, as
+ * given to filesys_set_disks(), or a null pointer for hd0:1. */
+static const char *fs_disks;
 
 static void do_format (void);
 
+/* Sets the disks that filesys_init() lays the file system out
+ * over when formatting, as a comma-separated list of CHAN:DEV
+ * pairs; the first of them is also where it finds the layout
+ * otherwise.  DISKS must stay valid until filesys_init(). */
+void
+filesys_set_disks (const char *disks) {
+	fs_disks = disks;
+}
+
 /* Initializes the file system module.
  * If FORMAT is true, reformats the file system. */
 void
 filesys_init (bool format) {
-	filesys_disk = disk_get (0, 1);
-	if (filesys_disk == NULL)
-		PANIC ("hd0:1 (hdb) not present, file system initialization failed");
+	fs_device = block_open (fs_disks, format);
 
 	inode_init ();
+	file_init ();
+	dir_init ();
+	dcache_init ();
 
 #ifdef EFILESYS
 	fat_init ();
@@ -33,6 +50,7 @@ filesys_init (bool format) {
 #else
 	/* Original FS */
 	free_map_init ();
+	journal_init (format);
 
 	if (format)
 		do_format ();
@@ -49,6 +67,8 @@ filesys_done (void) {
 #ifdef EFILESYS
 	fat_close ();
 #else
+	inode_flush_all ();
+	journal_flush ();
 	free_map_close ();
 #endif
 }
@@ -60,14 +80,19 @@ filesys_done (void) {
 bool
 filesys_create (const char *name, off_t initial_size) {
 	disk_sector_t inode_sector = 0;
-	struct dir *dir = dir_open_root ();
-	bool success = (dir != NULL
+	struct dir *dir;
+	bool success;
+
+	journal_begin ();
+	dir = dir_open_root ();
+	success = (dir != NULL
 			&& free_map_allocate (1, &inode_sector)
-			&& inode_create (inode_sector, initial_size)
+			&& inode_create_delayed (inode_sector, initial_size)
 			&& dir_add (dir, name, inode_sector));
 	if (!success && inode_sector != 0)
 		free_map_release (inode_sector, 1);
 	dir_close (dir);
+	journal_end ();
 
 	return success;
 }
@@ -95,9 +120,14 @@ filesys_open (const char *name) {
  * or if an internal memory allocation fails. */
 bool
 filesys_remove (const char *name) {
-	struct dir *dir = dir_open_root ();
-	bool success = dir != NULL && dir_remove (dir, name);
+	struct dir *dir;
+	bool success;
+
+	journal_begin ();
+	dir = dir_open_root ();
+	success = dir != NULL && dir_remove (dir, name);
 	dir_close (dir);
+	journal_end ();
 
 	return success;
 }
@@ -116,6 +146,7 @@ do_format (void) {
 	if (!dir_create (ROOT_DIR_SECTOR, 16))
 		PANIC ("root directory creation failed");
 	free_map_close ();
+	journal_flush ();
 #endif
 
 	printf ("done.\n");
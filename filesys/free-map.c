@@ -1,39 +1,50 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include "filesys/block.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per disk sector. */
+static struct bitmap *taken;         /* FREE_MAP plus sectors reserved for
+                                        delayed allocations. */
 
 /* Initializes the free map. */
 void
 free_map_init (void) {
-	free_map = bitmap_create (disk_size (filesys_disk));
-	if (free_map == NULL)
+	free_map = bitmap_create (block_size (fs_device));
+	taken = bitmap_create (block_size (fs_device));
+	if (free_map == NULL || taken == NULL)
 		PANIC ("bitmap creation failed--disk is too large");
 	bitmap_mark (free_map, FREE_MAP_SECTOR);
 	bitmap_mark (free_map, ROOT_DIR_SECTOR);
+	bitmap_set_multiple (free_map, JOURNAL_SECTOR, JOURNAL_SECTORS, true);
+	bitmap_mark (taken, FREE_MAP_SECTOR);
+	bitmap_mark (taken, ROOT_DIR_SECTOR);
+	bitmap_set_multiple (taken, JOURNAL_SECTOR, JOURNAL_SECTORS, true);
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
  * the first into *SECTORP.
  * Returns true if successful, false if all sectors were
+ * available.  Sectors reserved with free_map_reserve() are not
  * available. */
 bool
 free_map_allocate (size_t cnt, disk_sector_t *sectorp) {
-	disk_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-	if (sector != BITMAP_ERROR
-			&& free_map_file != NULL
-			&& !bitmap_write (free_map, free_map_file)) {
+	disk_sector_t sector = bitmap_scan_and_flip (taken, 0, cnt, false);
+	if (sector == BITMAP_ERROR)
+		return false;
+	bitmap_set_multiple (free_map, sector, cnt, true);
+	if (free_map_file != NULL && !bitmap_write (free_map, free_map_file)) {
 		bitmap_set_multiple (free_map, sector, cnt, false);
-		sector = BITMAP_ERROR;
+		bitmap_set_multiple (taken, sector, cnt, false);
+		return false;
 	}
-	if (sector != BITMAP_ERROR)
-		*sectorp = sector;
-	return sector != BITMAP_ERROR;
+	*sectorp = sector;
+	return true;
 }
 
 /* Makes CNT sectors starting at SECTOR available for use. */
@@ -41,17 +52,69 @@ void
 free_map_release (disk_sector_t sector, size_t cnt) {
 	ASSERT (bitmap_all (free_map, sector, cnt));
 	bitmap_set_multiple (free_map, sector, cnt, false);
+	bitmap_set_multiple (taken, sector, cnt, false);
+	bitmap_write (free_map, free_map_file);
+}
+
+/* Sets aside CNT consecutive free sectors for data whose
+ * allocation is delayed, so that allocating them later with
+ * free_map_commit() cannot fail, and stores the first into
+ * *SECTORP.  Reserved sectors are not recorded on disk.
+ * Returns true if successful, false if no run is free. */
+bool
+free_map_reserve (size_t cnt, disk_sector_t *sectorp) {
+	disk_sector_t sector = bitmap_scan_and_flip (taken, 0, cnt, false);
+	if (sector == BITMAP_ERROR)
+		return false;
+	*sectorp = sector;
+	return true;
+}
+
+/* Sets aside the EXTRA sectors just after the CNT sectors starting
+ * at SECTOR, which are allocated or reserved, so that the run
+ * grows in place.
+ * Returns true if successful, false if any of them is in use. */
+bool
+free_map_reserve_extend (disk_sector_t sector, size_t cnt, size_t extra) {
+	size_t end = sector + cnt;
+
+	if (end + extra > bitmap_size (taken) || bitmap_any (taken, end, extra))
+		return false;
+	bitmap_set_multiple (taken, end, extra, true);
+	return true;
+}
+
+/* Gives back CNT sectors starting at SECTOR set aside by
+ * free_map_reserve() or free_map_reserve_extend(). */
+void
+free_map_unreserve (disk_sector_t sector, size_t cnt) {
+	ASSERT (bitmap_all (taken, sector, cnt));
+	ASSERT (bitmap_none (free_map, sector, cnt));
+	bitmap_set_multiple (taken, sector, cnt, false);
+}
+
+/* Allocates the CNT reserved sectors starting at SECTOR. */
+void
+free_map_commit (disk_sector_t sector, size_t cnt) {
+	ASSERT (bitmap_all (taken, sector, cnt));
+	ASSERT (bitmap_none (free_map, sector, cnt));
+	bitmap_set_multiple (free_map, sector, cnt, true);
 	bitmap_write (free_map, free_map_file);
 }
 
 /* Opens the free map file and reads it from disk. */
 void
 free_map_open (void) {
+	size_t i;
+
 	free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
 	if (free_map_file == NULL)
 		PANIC ("can't open free map");
+	inode_set_metadata (file_get_inode (free_map_file));
 	if (!bitmap_read (free_map, free_map_file))
 		PANIC ("can't read free map");
+	for (i = 0; i < bitmap_size (free_map); i++)
+		bitmap_set (taken, i, bitmap_test (free_map, i));
 }
 
 /* Writes the free map to disk and closes the free map file. */
@@ -72,6 +135,7 @@ free_map_create (void) {
 	free_map_file = file_open (inode_open (FREE_MAP_SECTOR));
 	if (free_map_file == NULL)
 		PANIC ("can't open free map");
+	inode_set_metadata (file_get_inode (free_map_file));
 	if (!bitmap_write (free_map, free_map_file))
 		PANIC ("can't write free map");
 }
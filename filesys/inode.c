@@ -5,18 +5,25 @@
 #include <string.h>
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
+#include "threads/slab.h"
+#include "threads/vaddr.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Most sectors an inode buffers before allocating them. */
+#define INODE_DELAY_MAX 64
+
 /* On-disk inode.
  * Must be exactly DISK_SECTOR_SIZE bytes long. */
 struct inode_disk {
 	disk_sector_t start;                /* First data sector. */
 	off_t length;                       /* File size in bytes. */
 	unsigned magic;                     /* Magic number. */
-	uint32_t unused[125];               /* Not used. */
+	uint32_t sectors;                   /* Data sectors allocated at START. */
+	uint32_t unused[124];               /* Not used. */
 };
 
 /* Returns the number of sectors to allocate for an inode SIZE
@@ -33,17 +40,33 @@ struct inode {
 	int open_cnt;                       /* Number of openers. */
 	bool removed;                       /* True if deleted, false otherwise. */
 	int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
+	bool metadata;                      /* Journal writes to contents? */
+	bool dirty;                         /* DATA changed since written? */
 	struct inode_disk data;             /* Inode content. */
+
+	/* Delayed allocation.  Sectors past the DATA.SECTORS that have
+	 * been allocated are zeros, unless written, in which case they
+	 * are buffered here until inode_flush() allocates them; a null
+	 * slot is a sector of zeros.  The free map holds a run of
+	 * RES_CNT sectors at RES_START for them: either the DELAYED_CNT
+	 * sectors just after the allocated run, or, if those were not
+	 * free, a run big enough for the whole file to move to. */
+	uint8_t **delayed;                  /* Buffered sectors. */
+	size_t delayed_cnt;                 /* Slots in use, all reserved. */
+	size_t delayed_cap;                 /* Slots allocated. */
+	disk_sector_t res_start;            /* First reserved sector. */
+	size_t res_cnt;                     /* Number of reserved sectors. */
 };
 
 /* Returns the disk sector that contains byte offset POS within
  * INODE.
  * Returns -1 if INODE does not contain data for a byte at offset
- * POS. */
+ * POS, or if that data has not been allocated yet. */
 static disk_sector_t
 byte_to_sector (const struct inode *inode, off_t pos) {
 	ASSERT (inode != NULL);
-	if (pos < inode->data.length)
+	if (pos < inode->data.length
+			&& (size_t) pos / DISK_SECTOR_SIZE < inode->data.sectors)
 		return inode->data.start + pos / DISK_SECTOR_SIZE;
 	else
 		return -1;
@@ -53,10 +76,17 @@ byte_to_sector (const struct inode *inode, off_t pos) {
  * returns the same `struct inode'. */
 static struct list open_inodes;
 
+/* Cache of in-memory inodes. */
+static struct kmem_cache *inode_cache;
+
+static void inode_flush (struct inode *);
+static void drop_delayed (struct inode *);
+
 /* Initializes the inode module. */
 void
 inode_init (void) {
 	list_init (&open_inodes);
+	inode_cache = kmem_cache_create ("inode", sizeof (struct inode), NULL);
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -80,14 +110,15 @@ inode_create (disk_sector_t sector, off_t length) {
 		size_t sectors = bytes_to_sectors (length);
 		disk_inode->length = length;
 		disk_inode->magic = INODE_MAGIC;
+		disk_inode->sectors = sectors;
 		if (free_map_allocate (sectors, &disk_inode->start)) {
-			disk_write (filesys_disk, sector, disk_inode);
+			journal_write (sector, disk_inode);
 			if (sectors > 0) {
 				static char zeros[DISK_SECTOR_SIZE];
 				size_t i;
 
 				for (i = 0; i < sectors; i++) 
-					disk_write (filesys_disk, disk_inode->start + i, zeros); 
+					journal_write_data (disk_inode->start + i, zeros); 
 			}
 			success = true; 
 		} 
@@ -96,6 +127,29 @@ inode_create (disk_sector_t sector, off_t length) {
 	return success;
 }
 
+/* Initializes an inode with LENGTH bytes of zeros and writes it
+ * to sector SECTOR on the file system disk, like inode_create(),
+ * but without allocating any data sectors.  They are allocated
+ * when data is first written back, so that they can be sized to
+ * what is actually written.
+ * Returns true if successful.
+ * Returns false if memory allocation fails. */
+bool
+inode_create_delayed (disk_sector_t sector, off_t length) {
+	struct inode_disk *disk_inode;
+
+	ASSERT (length >= 0);
+
+	disk_inode = calloc (1, sizeof *disk_inode);
+	if (disk_inode == NULL)
+		return false;
+	disk_inode->length = length;
+	disk_inode->magic = INODE_MAGIC;
+	journal_write (sector, disk_inode);
+	free (disk_inode);
+	return true;
+}
+
 /* Reads an inode from SECTOR
  * and returns a `struct inode' that contains it.
  * Returns a null pointer if memory allocation fails. */
@@ -115,7 +169,7 @@ inode_open (disk_sector_t sector) {
 	}
 
 	/* Allocate memory. */
-	inode = malloc (sizeof *inode);
+	inode = kmem_cache_alloc (inode_cache);
 	if (inode == NULL)
 		return NULL;
 
@@ -125,7 +179,12 @@ inode_open (disk_sector_t sector) {
 	inode->open_cnt = 1;
 	inode->deny_write_cnt = 0;
 	inode->removed = false;
-	disk_read (filesys_disk, inode->sector, &inode->data);
+	inode->metadata = false;
+	inode->dirty = false;
+	inode->delayed = NULL;
+	inode->delayed_cnt = inode->delayed_cap = 0;
+	inode->res_cnt = 0;
+	journal_read (inode->sector, &inode->data);
 	return inode;
 }
 
@@ -157,14 +216,19 @@ inode_close (struct inode *inode) {
 		/* Remove from inode list and release lock. */
 		list_remove (&inode->elem);
 
-		/* Deallocate blocks if removed. */
+		/* Deallocate blocks if removed, otherwise write back
+		 * anything still buffered. */
 		if (inode->removed) {
+			journal_begin ();
 			free_map_release (inode->sector, 1);
-			free_map_release (inode->data.start,
-					bytes_to_sectors (inode->data.length)); 
-		}
-
-		free (inode); 
+			if (inode->data.sectors > 0)
+				free_map_release (inode->data.start, inode->data.sectors);
+			journal_end ();
+		} else
+			inode_flush (inode);
+		drop_delayed (inode);
+
+		kmem_cache_free (inode_cache, inode);
 	}
 }
 
@@ -176,6 +240,219 @@ inode_remove (struct inode *inode) {
 	inode->removed = true;
 }
 
+/* Reads the sector of INODE that contains byte offset POS into
+ * BUFFER, from disk if it has been allocated, otherwise from the
+ * delayed buffers. */
+static void
+read_sector (struct inode *inode, off_t pos, void *buffer) {
+	disk_sector_t sector_idx = byte_to_sector (inode, pos);
+	size_t slot;
+
+	if (sector_idx != (disk_sector_t) -1) {
+		journal_read (sector_idx, buffer);
+		return;
+	}
+
+	slot = pos / DISK_SECTOR_SIZE - inode->data.sectors;
+	if (slot < inode->delayed_cnt && inode->delayed[slot] != NULL)
+		memcpy (buffer, inode->delayed[slot], DISK_SECTOR_SIZE);
+	else
+		memset (buffer, 0, DISK_SECTOR_SIZE);
+}
+
+/* Most sectors inode_read_at() reads with one journal_readv(). */
+#define READ_BATCH 32
+
+/* Reads the whole, allocated sectors of INODE starting at
+ * sector-aligned byte offset POS into BUFFER, which has room for
+ * SIZE bytes, as many as fit up to READ_BATCH.  They are
+ * contiguous on disk, so they are read as a batch that the block
+ * device can spread over its members.  BUFFER must be in kernel
+ * space, since the disk driver may fill it in another process's
+ * interrupt.  Returns the number of sectors read, or 0 if fewer
+ * than two qualify. */
+static size_t
+read_run (struct inode *inode, off_t pos, uint8_t *buffer, off_t size) {
+	void *bufs[READ_BATCH];
+	size_t first = pos / DISK_SECTOR_SIZE;
+	size_t whole = inode_length (inode) / DISK_SECTOR_SIZE;
+	size_t cnt = size / DISK_SECTOR_SIZE;
+	size_t i;
+
+	if (first >= whole || first >= inode->data.sectors)
+		return 0;
+	if (cnt > whole - first)
+		cnt = whole - first;
+	if (cnt > inode->data.sectors - first)
+		cnt = inode->data.sectors - first;
+	if (cnt > READ_BATCH)
+		cnt = READ_BATCH;
+	if (cnt < 2)
+		return 0;
+
+	for (i = 0; i < cnt; i++)
+		bufs[i] = buffer + i * DISK_SECTOR_SIZE;
+	journal_readv (inode->data.start + first, cnt, bufs);
+	return cnt;
+}
+
+/* Reserves sectors in the free map for INODE to hold CNT delayed
+ * sectors, growing its reservation in place if possible and
+ * otherwise replacing it with a run that the whole file can move
+ * to.  Returns true if successful, false if no run is free. */
+static bool
+reserve_delayed (struct inode *inode, size_t cnt) {
+	size_t old_cnt = inode->data.sectors;
+	disk_sector_t start;
+
+	/* Grow in place: just after the allocated run, or just after
+	 * the reserved run, whichever the reservation is. */
+	if (inode->res_cnt > 0) {
+		size_t extra = cnt - inode->delayed_cnt;
+
+		if (free_map_reserve_extend (inode->res_start, inode->res_cnt, extra)) {
+			inode->res_cnt += extra;
+			return true;
+		}
+	} else if (old_cnt > 0
+			&& free_map_reserve_extend (inode->data.start, old_cnt, cnt)) {
+		inode->res_start = inode->data.start + old_cnt;
+		inode->res_cnt = cnt;
+		return true;
+	}
+
+	/* Move to a new run. */
+	if (!free_map_reserve (old_cnt + cnt, &start))
+		return false;
+	if (inode->res_cnt > 0)
+		free_map_unreserve (inode->res_start, inode->res_cnt);
+	inode->res_start = start;
+	inode->res_cnt = old_cnt + cnt;
+	return true;
+}
+
+/* Buffers BUFFER as the contents of delayed SLOT of INODE,
+ * reserving a free map sector for it and for any unused slots
+ * before it.  Returns true if successful, false if the disk or
+ * memory is full. */
+static bool
+write_delayed (struct inode *inode, size_t slot, const void *buffer) {
+	ASSERT (!inode->metadata);
+
+	if (slot >= inode->delayed_cap) {
+		size_t cap = inode->delayed_cap > 0 ? inode->delayed_cap * 2 : 8;
+		uint8_t **delayed;
+		size_t i;
+
+		while (cap <= slot)
+			cap *= 2;
+		delayed = realloc (inode->delayed, cap * sizeof *delayed);
+		if (delayed == NULL)
+			return false;
+		for (i = inode->delayed_cap; i < cap; i++)
+			delayed[i] = NULL;
+		inode->delayed = delayed;
+		inode->delayed_cap = cap;
+	}
+	if (slot >= inode->delayed_cnt) {
+		if (!reserve_delayed (inode, slot + 1))
+			return false;
+		inode->delayed_cnt = slot + 1;
+	}
+	if (inode->delayed[slot] == NULL) {
+		inode->delayed[slot] = malloc (DISK_SECTOR_SIZE);
+		if (inode->delayed[slot] == NULL)
+			return false;
+	}
+	memcpy (inode->delayed[slot], buffer, DISK_SECTOR_SIZE);
+	return true;
+}
+
+/* Frees INODE's delayed buffers and gives back their reservation,
+ * discarding anything not yet written back. */
+static void
+drop_delayed (struct inode *inode) {
+	size_t i;
+
+	if (inode->res_cnt > 0)
+		free_map_unreserve (inode->res_start, inode->res_cnt);
+	inode->res_cnt = 0;
+	for (i = 0; i < inode->delayed_cnt; i++)
+		free (inode->delayed[i]);
+	free (inode->delayed);
+	inode->delayed = NULL;
+	inode->delayed_cnt = inode->delayed_cap = 0;
+}
+
+/* Allocates disk sectors for INODE's delayed buffers and writes
+ * them back, along with the inode itself if its length changed.
+ * The sectors were reserved as the buffers were written, either
+ * just after the existing run or as a new run for the whole file,
+ * in which case the file moves there so that it stays
+ * contiguous.  Either way, this cannot fail. */
+static void
+inode_flush (struct inode *inode) {
+	static uint8_t zeros[DISK_SECTOR_SIZE];
+	static uint8_t bounce[DISK_SECTOR_SIZE];
+	size_t old_cnt = inode->data.sectors;
+	size_t new_cnt = old_cnt + inode->delayed_cnt;
+	disk_sector_t old_start = inode->data.start;
+	disk_sector_t start = old_start;
+	bool move = inode->res_cnt != inode->delayed_cnt;
+	size_t i;
+
+	if (inode->delayed_cnt == 0) {
+		if (inode->dirty)
+			journal_write (inode->sector, &inode->data);
+		inode->dirty = false;
+		return;
+	}
+
+	journal_begin ();
+	if (move) {
+		ASSERT (inode->res_cnt == new_cnt);
+		start = inode->res_start;
+		for (i = 0; i < old_cnt; i++) {
+			journal_read (old_start + i, bounce);
+			journal_write_data (start + i, bounce);
+		}
+	} else if (old_cnt == 0)
+		start = inode->res_start;
+	free_map_commit (inode->res_start, inode->res_cnt);
+	inode->res_cnt = 0;
+
+	/* The delayed buffers double as the vector for the write. */
+	for (i = 0; i < inode->delayed_cnt; i++)
+		if (inode->delayed[i] == NULL)
+			inode->delayed[i] = zeros;
+	journal_write_datav (start + old_cnt, inode->delayed_cnt,
+			(const void **) inode->delayed);
+	for (i = 0; i < inode->delayed_cnt; i++) {
+		if (inode->delayed[i] != zeros)
+			free (inode->delayed[i]);
+		inode->delayed[i] = NULL;
+	}
+	inode->delayed_cnt = 0;
+
+	inode->data.start = start;
+	inode->data.sectors = new_cnt;
+	journal_write (inode->sector, &inode->data);
+	inode->dirty = false;
+	if (move && old_cnt > 0)
+		free_map_release (old_start, old_cnt);
+	journal_end ();
+}
+
+/* Writes back the delayed data of every open inode. */
+void
+inode_flush_all (void) {
+	struct list_elem *e;
+
+	for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
+			e = list_next (e))
+		inode_flush (list_entry (e, struct inode, elem));
+}
+
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
  * Returns the number of bytes actually read, which may be less
  * than SIZE if an error occurs or end of file is reached. */
@@ -184,10 +461,11 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) {
 	uint8_t *buffer = buffer_;
 	off_t bytes_read = 0;
 	uint8_t *bounce = NULL;
+	uint8_t *run_buf = NULL;
+	size_t run;
 
 	while (size > 0) {
-		/* Disk sector to read, starting byte offset within sector. */
-		disk_sector_t sector_idx = byte_to_sector (inode, offset);
+		/* Starting byte offset within sector to read. */
 		int sector_ofs = offset % DISK_SECTOR_SIZE;
 
 		/* Bytes left in inode, bytes left in sector, lesser of the two. */
@@ -197,12 +475,32 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) {
 
 		/* Number of bytes to actually copy out of this sector. */
 		int chunk_size = size < min_left ? size : min_left;
+
+		/* Where to read a run of sectors.  Batched reads must land
+		 * in kernel memory, so a user buffer gets them through
+		 * RUN_BUF. */
+		uint8_t *run_dst = buffer + bytes_read;
+
 		if (chunk_size <= 0)
 			break;
+		if (!is_kernel_vaddr (buffer)) {
+			if (run_buf == NULL && sector_ofs == 0
+					&& size >= 2 * DISK_SECTOR_SIZE)
+				run_buf = malloc (READ_BATCH * DISK_SECTOR_SIZE);
+			run_dst = run_buf;
+		}
 
-		if (sector_ofs == 0 && chunk_size == DISK_SECTOR_SIZE) {
+		if (sector_ofs == 0 && chunk_size == DISK_SECTOR_SIZE
+				&& run_dst != NULL
+				&& (run = read_run (inode, offset, run_dst, size)) > 0) {
+			/* Read a run of full sectors, directly into caller's
+			 * buffer if it is in kernel space. */
+			chunk_size = run * DISK_SECTOR_SIZE;
+			if (run_dst == run_buf)
+				memcpy (buffer + bytes_read, run_buf, chunk_size);
+		} else if (sector_ofs == 0 && chunk_size == DISK_SECTOR_SIZE) {
 			/* Read full sector directly into caller's buffer. */
-			disk_read (filesys_disk, sector_idx, buffer + bytes_read); 
+			read_sector (inode, offset, buffer + bytes_read);
 		} else {
 			/* Read sector into bounce buffer, then partially copy
 			 * into caller's buffer. */
@@ -211,7 +509,7 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) {
 				if (bounce == NULL)
 					break;
 			}
-			disk_read (filesys_disk, sector_idx, bounce);
+			read_sector (inode, offset, bounce);
 			memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
 		}
 
@@ -221,32 +519,52 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset) {
 		bytes_read += chunk_size;
 	}
 	free (bounce);
+	free (run_buf);
 
 	return bytes_read;
 }
 
+/* Writes BUFFER to the sector of INODE that contains byte offset
+ * POS.  Metadata goes through the journal, file data straight to
+ * disk, or into the delayed buffers if its sector has not been
+ * allocated yet.  Returns true if successful, false otherwise. */
+static bool
+write_sector (struct inode *inode, off_t pos, const void *buffer) {
+	disk_sector_t sector_idx = byte_to_sector (inode, pos);
+
+	if (sector_idx == (disk_sector_t) -1)
+		return write_delayed (inode,
+				pos / DISK_SECTOR_SIZE - inode->data.sectors, buffer);
+	if (inode->metadata)
+		journal_write (sector_idx, buffer);
+	else
+		journal_write_data (sector_idx, buffer);
+	return true;
+}
+
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
  * Returns the number of bytes actually written, which may be
  * less than SIZE if end of file is reached or an error occurs.
- * (Normally a write at end of file would extend the inode, but
- * growth is not yet implemented.) */
+ * A write past the end of a file extends it; the new data is
+ * buffered and allocated later by inode_flush().  Metadata inodes
+ * do not grow. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 		off_t offset) {
 	const uint8_t *buffer = buffer_;
 	off_t bytes_written = 0;
+	off_t end = inode->metadata ? inode_length (inode) : offset + size;
 	uint8_t *bounce = NULL;
 
 	if (inode->deny_write_cnt)
 		return 0;
 
 	while (size > 0) {
-		/* Sector to write, starting byte offset within sector. */
-		disk_sector_t sector_idx = byte_to_sector (inode, offset);
+		/* Starting byte offset within sector to write. */
 		int sector_ofs = offset % DISK_SECTOR_SIZE;
 
 		/* Bytes left in inode, bytes left in sector, lesser of the two. */
-		off_t inode_left = inode_length (inode) - offset;
+		off_t inode_left = end - offset;
 		int sector_left = DISK_SECTOR_SIZE - sector_ofs;
 		int min_left = inode_left < sector_left ? inode_left : sector_left;
 
@@ -257,7 +575,8 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 
 		if (sector_ofs == 0 && chunk_size == DISK_SECTOR_SIZE) {
 			/* Write full sector directly to disk. */
-			disk_write (filesys_disk, sector_idx, buffer + bytes_written); 
+			if (!write_sector (inode, offset, buffer + bytes_written))
+				break;
 		} else {
 			/* We need a bounce buffer. */
 			if (bounce == NULL) {
@@ -270,17 +589,26 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 			   we're writing, then we need to read in the sector
 			   first.  Otherwise we start with a sector of all zeros. */
 			if (sector_ofs > 0 || chunk_size < sector_left) 
-				disk_read (filesys_disk, sector_idx, bounce);
+				read_sector (inode, offset, bounce);
 			else
 				memset (bounce, 0, DISK_SECTOR_SIZE);
 			memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-			disk_write (filesys_disk, sector_idx, bounce); 
+			if (!write_sector (inode, offset, bounce))
+				break;
 		}
 
 		/* Advance. */
 		size -= chunk_size;
 		offset += chunk_size;
 		bytes_written += chunk_size;
+		if (offset > inode->data.length) {
+			inode->data.length = offset;
+			inode->dirty = true;
+		}
+
+		/* Bound what is buffered, even within one large write. */
+		if (inode->delayed_cnt >= INODE_DELAY_MAX)
+			inode_flush (inode);
 	}
 	free (bounce);
 
@@ -306,6 +634,14 @@ inode_allow_write (struct inode *inode) {
 	inode->deny_write_cnt--;
 }
 
+/* Marks INODE as holding file system metadata, such as a
+ * directory or the free map, so that writes to its contents are
+ * journaled along with the rest of the transaction. */
+void
+inode_set_metadata (struct inode *inode) {
+	inode->metadata = true;
+}
+
 /* Returns the length, in bytes, of INODE's data. */
 off_t
 inode_length (const struct inode *inode) {
@@ -0,0 +1,392 @@
+/* journal.c: Write-ahead journal for file system metadata.
+ *
+ * Free map, inode and directory writes made inside a transaction
+ * are not sent to disk right away.  They are kept in memory, and
+ * a later write to the same sector replaces the kept copy.  Every
+ * so often, and whenever the journal fills up, all kept sectors
+ * are committed together: their images are written one after
+ * another into the journal area, then a header listing their
+ * home sectors is written as the commit record, and only then
+ * are they written to their home sectors.  If the system stops
+ * part way, journal_init() finds the header at the next boot and
+ * replays the committed images, so each transaction is applied
+ * either completely or not at all. */
+
+#include "filesys/journal.h"
+#include <debug.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/block.h"
+#include "filesys/filesys.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "devices/timer.h"
+
+/* Identifies a journal header. */
+#define JOURNAL_MAGIC 0x4a524e4c
+
+/* Sectors that one transaction may write, at most.  A new
+ * transaction does not start unless this many are free. */
+#define JOURNAL_RESERVE 16
+
+/* Ticks between commits by the journal daemon. */
+#define JOURNAL_INTERVAL TIMER_FREQ
+
+/* On-disk journal header, the commit record.
+ * Must be exactly DISK_SECTOR_SIZE bytes long. */
+struct journal_header {
+	unsigned magic;                     /* Magic number. */
+	unsigned seq;                       /* Commit sequence number. */
+	unsigned cnt;                       /* Committed images, 0 if none. */
+	disk_sector_t homes[JOURNAL_BLOCKS];    /* Home sector of each image. */
+	uint8_t unused[DISK_SECTOR_SIZE - 3 * sizeof (unsigned)
+		- JOURNAL_BLOCKS * sizeof (disk_sector_t)];
+};
+
+/* A metadata sector waiting to be committed. */
+struct journal_block {
+	disk_sector_t home;                 /* Where the sector belongs. */
+	uint8_t data[DISK_SECTOR_SIZE];     /* Its latest contents. */
+};
+
+static bool enabled;                    /* Set up by journal_init()? */
+static struct journal_header header;    /* Header as last written. */
+static struct journal_block *blocks;    /* Sectors waiting to commit. */
+static size_t block_cnt;                /* Number of BLOCKS in use. */
+static struct journal_block *committing;    /* Sectors being committed. */
+static size_t committing_cnt;           /* Number of COMMITTING in use. */
+
+/* Held by a thread for the length of its transaction. */
+static struct lock txn_lock;
+static int txn_depth;                   /* Nesting depth of transaction. */
+
+/* Protects BLOCKS, BLOCK_CNT, COMMITTING and COMMITTING_CNT.  It
+ * is not held across the disk writes of a commit, which are
+ * serialized by txn_lock instead. */
+static struct lock log_lock;
+static struct condition commit_done;    /* Signaled when COMMITTING empties. */
+
+static void commit (void);
+static void replay (void);
+static void journal_daemon (void *aux);
+
+/* Initializes the journal.  If FORMAT is true, writes an empty
+ * journal, otherwise replays whatever the last boot committed but
+ * did not finish writing back. */
+void
+journal_init (bool format) {
+	ASSERT (sizeof header == DISK_SECTOR_SIZE);
+
+	blocks = malloc (JOURNAL_BLOCKS * sizeof *blocks);
+	committing = malloc (JOURNAL_BLOCKS * sizeof *committing);
+	if (blocks == NULL || committing == NULL)
+		PANIC ("journal initialization failed");
+	block_cnt = committing_cnt = 0;
+	lock_init (&txn_lock);
+	lock_init (&log_lock);
+	cond_init (&commit_done);
+	txn_depth = 0;
+
+	if (format) {
+		memset (&header, 0, sizeof header);
+		header.magic = JOURNAL_MAGIC;
+		block_write (fs_device, JOURNAL_SECTOR, &header);
+	} else
+		replay ();
+
+	enabled = true;
+	thread_create ("journald", PRI_DEFAULT, journal_daemon, NULL);
+}
+
+/* Starts a transaction.  Writes made with journal_write() until
+ * the matching journal_end() are committed together.  Transactions
+ * may nest; only the outermost one counts. */
+void
+journal_begin (void) {
+	if (!enabled)
+		return;
+
+	if (lock_held_by_current_thread (&txn_lock)) {
+		txn_depth++;
+		return;
+	}
+
+	lock_acquire (&txn_lock);
+	txn_depth = 1;
+	if (block_cnt + JOURNAL_RESERVE > JOURNAL_BLOCKS)
+		commit ();
+}
+
+/* Ends the transaction started by journal_begin().  Its writes
+ * are committed by the next journal_flush(), along with those of
+ * any other transactions that end before then. */
+void
+journal_end (void) {
+	if (!enabled)
+		return;
+
+	ASSERT (lock_held_by_current_thread (&txn_lock));
+	if (--txn_depth == 0)
+		lock_release (&txn_lock);
+}
+
+/* Commits every finished transaction and writes its sectors back
+ * to their home locations. */
+void
+journal_flush (void) {
+	if (!enabled)
+		return;
+
+	journal_begin ();
+	commit ();
+	journal_end ();
+}
+
+/* Returns the copy of SECTOR among the CNT blocks in TABLE, or a
+ * null pointer if there is none.  The caller must hold log_lock. */
+static struct journal_block *
+find_in (struct journal_block *table, size_t cnt, disk_sector_t sector) {
+	size_t i;
+
+	for (i = 0; i < cnt; i++)
+		if (table[i].home == sector)
+			return &table[i];
+	return NULL;
+}
+
+/* Returns the waiting copy of SECTOR, or a null pointer if there
+ * is none.  The caller must hold log_lock. */
+static struct journal_block *
+find_block (disk_sector_t sector) {
+	return find_in (blocks, block_cnt, sector);
+}
+
+/* Returns the latest copy of SECTOR not yet written back, whether
+ * waiting or being committed, or a null pointer if there is none.
+ * The caller must hold log_lock. */
+static struct journal_block *
+find_unwritten (disk_sector_t sector) {
+	struct journal_block *b = find_block (sector);
+
+	return b != NULL ? b : find_in (committing, committing_cnt, sector);
+}
+
+/* Copies into BUFS the copies of any of the CNT sectors starting
+ * at SECTOR among the N blocks in TABLE.  The caller must hold
+ * log_lock. */
+static void
+overlay (struct journal_block *table, size_t n,
+		disk_sector_t sector, size_t cnt, void *bufs[]) {
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (table[i].home >= sector && table[i].home - sector < cnt)
+			memcpy (bufs[table[i].home - sector], table[i].data,
+					DISK_SECTOR_SIZE);
+}
+
+/* Reads SECTOR from the file system disk into BUFFER, seeing any
+ * write to it that has not been committed yet. */
+void
+journal_read (disk_sector_t sector, void *buffer) {
+	struct journal_block *b;
+
+	if (enabled) {
+		lock_acquire (&log_lock);
+		b = find_unwritten (sector);
+		if (b != NULL)
+			memcpy (buffer, b->data, DISK_SECTOR_SIZE);
+		lock_release (&log_lock);
+		if (b != NULL)
+			return;
+	}
+	block_read (fs_device, sector, buffer);
+}
+
+/* Reads the CNT sectors starting at SECTOR into BUFS[0] through
+ * BUFS[CNT - 1], as journal_read() would one at a time, but with
+ * the disk reads issued together.  BUFS must be in kernel space. */
+void
+journal_readv (disk_sector_t sector, size_t cnt, void *bufs[]) {
+	if (!enabled) {
+		block_readv (fs_device, sector, cnt, bufs);
+		return;
+	}
+
+	/* Hold log_lock across the read and the overlay, so that a
+	 * commit cannot write a sector back and forget it in between.
+	 * Older copies go first so that newer ones win. */
+	lock_acquire (&log_lock);
+	block_readv (fs_device, sector, cnt, bufs);
+	overlay (committing, committing_cnt, sector, cnt, bufs);
+	overlay (blocks, block_cnt, sector, cnt, bufs);
+	lock_release (&log_lock);
+}
+
+/* Writes metadata BUFFER to SECTOR as part of the current
+ * transaction, or of a transaction of its own if there is none. */
+void
+journal_write (disk_sector_t sector, const void *buffer) {
+	struct journal_block *b;
+
+	if (!enabled) {
+		block_write (fs_device, sector, buffer);
+		return;
+	}
+
+	journal_begin ();
+	lock_acquire (&log_lock);
+	b = find_block (sector);
+	if (b == NULL) {
+		/* The reserve should prevent this.  If a transaction
+		 * outgrows it anyway, commit what it has written so far
+		 * rather than fail. */
+		if (block_cnt == JOURNAL_BLOCKS) {
+			lock_release (&log_lock);
+			commit ();
+			lock_acquire (&log_lock);
+		}
+		b = &blocks[block_cnt++];
+		b->home = sector;
+	}
+	memcpy (b->data, buffer, DISK_SECTOR_SIZE);
+	lock_release (&log_lock);
+	journal_end ();
+}
+
+/* Writes file data BUFFER to SECTOR.  Data is not journaled, but
+ * if SECTOR has a metadata write waiting, say because it was just
+ * freed and reallocated, the waiting copy is replaced so that the
+ * commit does not overwrite the data later. */
+void
+journal_write_data (disk_sector_t sector, const void *buffer) {
+	struct journal_block *b = NULL;
+
+	if (enabled) {
+		lock_acquire (&log_lock);
+		/* A commit in progress would write its copy over ours. */
+		while (find_in (committing, committing_cnt, sector) != NULL)
+			cond_wait (&commit_done, &log_lock);
+		b = find_block (sector);
+		if (b != NULL)
+			memcpy (b->data, buffer, DISK_SECTOR_SIZE);
+		lock_release (&log_lock);
+	}
+	if (b == NULL)
+		block_write (fs_device, sector, buffer);
+}
+
+/* Writes file data BUFS[0] through BUFS[CNT - 1] to the CNT
+ * sectors starting at SECTOR, as journal_write_data() would one
+ * at a time, but with the disk writes issued together. */
+void
+journal_write_datav (disk_sector_t sector, size_t cnt, const void *bufs[]) {
+	bool pending = false;
+	size_t i;
+
+	if (enabled) {
+		lock_acquire (&log_lock);
+		for (i = 0; i < block_cnt && !pending; i++)
+			pending = blocks[i].home >= sector && blocks[i].home - sector < cnt;
+		for (i = 0; i < committing_cnt && !pending; i++)
+			pending = (committing[i].home >= sector
+					&& committing[i].home - sector < cnt);
+		lock_release (&log_lock);
+	}
+
+	if (!pending)
+		block_writev (fs_device, sector, cnt, bufs);
+	else
+		for (i = 0; i < cnt; i++)
+			journal_write_data (sector + i, bufs[i]);
+}
+
+/* Writes all waiting sectors to the journal area in one sequential
+ * run, writes the header that commits them, writes them back to
+ * their homes, and finally clears the header.  The caller must
+ * hold txn_lock, which keeps other commits and all metadata
+ * writes out until it returns.
+ *
+ * The waiting sectors are moved aside under log_lock and written
+ * without it, so that reads need not wait for the commit.  They
+ * stay visible to readers until they have reached their homes. */
+static void
+commit (void) {
+	static const void *images[JOURNAL_BLOCKS];
+	struct journal_block *tmp;
+	size_t i, cnt;
+
+	ASSERT (lock_held_by_current_thread (&txn_lock));
+
+	lock_acquire (&log_lock);
+	ASSERT (committing_cnt == 0);
+	tmp = committing;
+	committing = blocks;
+	blocks = tmp;
+	cnt = committing_cnt = block_cnt;
+	block_cnt = 0;
+	lock_release (&log_lock);
+	if (cnt == 0)
+		return;
+
+	for (i = 0; i < cnt; i++) {
+		images[i] = committing[i].data;
+		header.homes[i] = committing[i].home;
+	}
+	block_writev (fs_device, JOURNAL_SECTOR + 1, cnt, images);
+	header.seq++;
+	header.cnt = cnt;
+	block_write (fs_device, JOURNAL_SECTOR, &header);
+
+	for (i = 0; i < cnt; i++)
+		block_write (fs_device, committing[i].home, committing[i].data);
+	header.cnt = 0;
+	block_write (fs_device, JOURNAL_SECTOR, &header);
+
+	lock_acquire (&log_lock);
+	committing_cnt = 0;
+	cond_broadcast (&commit_done, &log_lock);
+	lock_release (&log_lock);
+}
+
+/* Writes back the images committed by the last boot, if it did not
+ * get to finish doing so itself. */
+static void
+replay (void) {
+	uint8_t *buffer;
+	unsigned i;
+
+	block_read (fs_device, JOURNAL_SECTOR, &header);
+	if (header.magic != JOURNAL_MAGIC)
+		PANIC ("file system journal is corrupt; reformat with -f");
+	if (header.cnt == 0)
+		return;
+	if (header.cnt > JOURNAL_BLOCKS)
+		PANIC ("file system journal is corrupt; reformat with -f");
+
+	printf ("Replaying %u journaled sectors...", header.cnt);
+	buffer = malloc (DISK_SECTOR_SIZE);
+	if (buffer == NULL)
+		PANIC ("journal replay failed");
+	for (i = 0; i < header.cnt; i++) {
+		block_read (fs_device, JOURNAL_SECTOR + 1 + i, buffer);
+		block_write (fs_device, header.homes[i], buffer);
+	}
+	free (buffer);
+
+	header.cnt = 0;
+	block_write (fs_device, JOURNAL_SECTOR, &header);
+	printf ("done.\n");
+}
+
+/* Group commit: commits whatever transactions have finished every
+ * JOURNAL_INTERVAL ticks, so that many small metadata updates
+ * reach the disk as a few large writes. */
+static void
+journal_daemon (void *aux UNUSED) {
+	for (;;) {
+		timer_sleep (JOURNAL_INTERVAL);
+		journal_flush ();
+	}
+}
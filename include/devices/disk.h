@@ -2,7 +2,10 @@
 #define DEVICES_DISK_H
 
 #include <inttypes.h>
+#include <list.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include "threads/synch.h"
 
 /* Size of a disk sector in bytes. */
 #define DISK_SECTOR_SIZE 512
@@ -23,5 +26,31 @@ disk_sector_t disk_size (struct disk *);
 void disk_read (struct disk *, disk_sector_t, void *);
 void disk_write (struct disk *, disk_sector_t, const void *);
 
+/* An asynchronous request to transfer one sector.
+ *
+ * The caller owns the request and must keep it, and its buffer,
+ * alive until it completes.  The buffer must be in kernel space.  On completion the driver calls DONE
+ * from interrupt context if it is non-null; otherwise it wakes
+ * up anyone blocked in disk_wait(). */
+struct disk_request {
+	struct disk *disk;          /* Disk to access. */
+	disk_sector_t sec_no;       /* Sector to transfer. */
+	void *buffer;               /* DISK_SECTOR_SIZE bytes, kernel VA. */
+	bool write;                 /* True to write BUFFER, false to read. */
+	void (*done) (struct disk_request *);   /* Completion callback. */
+	void *aux;                  /* For use by DONE. */
+
+	/* Owned by the driver. */
+	int64_t deadline;           /* Tick by which to start, if possible. */
+	struct list_elem elem;      /* Sorted queue or in-flight list. */
+	struct list_elem fifo_elem; /* Submission-order list. */
+	struct semaphore done_sema; /* Up'd at completion if DONE is null. */
+};
+
+void disk_request_init (struct disk_request *, struct disk *, disk_sector_t,
+		void *buffer, bool write);
+void disk_submit (struct disk_request *);
+void disk_wait (struct disk_request *);
+
 void 	register_disk_inspect_intr ();
 #endif /* devices/disk.h */
@@ -12,11 +12,14 @@ void timer_calibrate (void);
 
 int64_t timer_ticks (void);
 int64_t timer_elapsed (int64_t);
+int64_t timer_now_ns (void);
 
 void timer_sleep (int64_t ticks);
 void timer_msleep (int64_t milliseconds);
 void timer_usleep (int64_t microseconds);
 void timer_nsleep (int64_t nanoseconds);
+void timer_sleep_ns (int64_t nanoseconds, int64_t slack);
+void timer_sleep_until_ns (int64_t deadline, int64_t slack);
 
 void timer_print_stats (void);
 
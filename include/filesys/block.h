@@ -0,0 +1,28 @@
+#ifndef FILESYS_BLOCK_H
+#define FILESYS_BLOCK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "devices/disk.h"
+
+/* Most member disks a block device may stripe across. */
+#define BLOCK_MEMBER_MAX 4
+
+/* Sectors in one stripe unit: the run of consecutive block
+ * sectors that lives on the same member disk. */
+#define BLOCK_STRIPE_SECTORS 8
+
+/* A block device: the file system's storage, seen as one linear
+ * array of DISK_SECTOR_SIZE-byte sectors striped (RAID-0) across
+ * one or more disks. */
+struct block;
+
+struct block *block_open (const char *members, bool format);
+disk_sector_t block_size (struct block *);
+void block_read (struct block *, disk_sector_t, void *);
+void block_write (struct block *, disk_sector_t, const void *);
+void block_readv (struct block *, disk_sector_t, size_t cnt, void *bufs[]);
+void block_writev (struct block *, disk_sector_t, size_t cnt,
+		const void *bufs[]);
+
+#endif /* filesys/block.h */
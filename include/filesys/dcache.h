@@ -0,0 +1,18 @@
+#ifndef FILESYS_DCACHE_H
+#define FILESYS_DCACHE_H
+
+#include <stdbool.h>
+#include "devices/disk.h"
+
+/* Child sector recorded for a name known not to exist. */
+#define DCACHE_NEGATIVE ((disk_sector_t) -1)
+
+void dcache_init (void);
+bool dcache_lookup (disk_sector_t parent, const char *name,
+		disk_sector_t *child);
+void dcache_insert (disk_sector_t parent, const char *name,
+		disk_sector_t child);
+void dcache_invalidate (disk_sector_t parent, const char *name);
+void dcache_invalidate_dir (disk_sector_t parent);
+
+#endif /* filesys/dcache.h */
@@ -7,10 +7,12 @@
 /* Sectors of system file inodes. */
 #define FREE_MAP_SECTOR 0       /* Free map file inode sector. */
 #define ROOT_DIR_SECTOR 1       /* Root directory file inode sector. */
+#define JOURNAL_SECTOR 2        /* First sector of metadata journal. */
 
-/* Disk used for file system. */
-extern struct disk *filesys_disk;
+/* Block device that holds the file system. */
+extern struct block *fs_device;
 
+void filesys_set_disks (const char *);
 void filesys_init (bool format);
 void filesys_done (void);
 bool filesys_create (const char *name, off_t initial_size);
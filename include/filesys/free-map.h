@@ -13,5 +13,9 @@ void free_map_close (void);
 
 bool free_map_allocate (size_t, disk_sector_t *);
 void free_map_release (disk_sector_t, size_t);
+bool free_map_reserve (size_t, disk_sector_t *);
+bool free_map_reserve_extend (disk_sector_t, size_t cnt, size_t extra);
+void free_map_unreserve (disk_sector_t, size_t);
+void free_map_commit (disk_sector_t, size_t);
 
 #endif /* filesys/free-map.h */
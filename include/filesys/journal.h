@@ -0,0 +1,26 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "devices/disk.h"
+
+/* Number of metadata sectors the journal can hold at once. */
+#define JOURNAL_BLOCKS 64
+
+/* Sectors taken by the journal on disk: a header followed by
+ * JOURNAL_BLOCKS sector images. */
+#define JOURNAL_SECTORS (1 + JOURNAL_BLOCKS)
+
+void journal_init (bool format);
+void journal_begin (void);
+void journal_end (void);
+void journal_flush (void);
+
+void journal_read (disk_sector_t, void *);
+void journal_readv (disk_sector_t, size_t cnt, void *bufs[]);
+void journal_write (disk_sector_t, const void *);
+void journal_write_data (disk_sector_t, const void *);
+void journal_write_datav (disk_sector_t, size_t cnt, const void *bufs[]);
+
+#endif /* filesys/journal.h */
@@ -50,6 +50,29 @@ static __inline uint64_t rcr3(void) {
 	return val;
 }
 
+/* Reads and writes CR4, which enables processor extensions such
+   as PCIDs.  See [IA32-v3a] 2.5 "Control Registers". */
+__attribute__((always_inline))
+static __inline uint64_t rcr4(void) {
+	uint64_t val;
+	__asm __volatile("movq %%cr4,%0" : "=r" (val));
+	return val;
+}
+
+__attribute__((always_inline))
+static __inline void lcr4(uint64_t val) {
+	__asm __volatile("movq %0, %%cr4" : : "r" (val) : "memory");
+}
+
+/* Executes CPUID for LEAF, storing the results in *EAX...*EDX. */
+__attribute__((always_inline))
+static __inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx,
+		uint32_t *ecx, uint32_t *edx) {
+	__asm __volatile("cpuid"
+			: "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+			: "a" (leaf), "c" (0));
+}
+
 __attribute__((always_inline))
 static __inline uint64_t rrax(void) {
 	uint64_t val;
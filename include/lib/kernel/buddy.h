@@ -0,0 +1,39 @@
+#ifndef __LIB_KERNEL_BUDDY_H
+#define __LIB_KERNEL_BUDDY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Binary buddy allocator over a range of CNT items, such as the
+   pages of a memory pool.
+
+   Free items are kept in blocks of 2**ORDER items, one free list
+   per order, and every block is aligned to its own size, counting
+   from an arbitrary origin.  Allocating a run takes the smallest
+   block that holds it, splitting larger blocks as needed, and
+   freeing merges a block with its "buddy", the other half of the
+   block twice its size, as long as that buddy is free too.  Both
+   take O(BUDDY_ORDERS) steps, not counting runs larger than the
+   largest block, which take a slower scan.
+
+   The allocator's bookkeeping lives outside the items, so it can
+   manage ranges that are not memory.  It does no locking. */
+
+/* Number of block orders: blocks hold 1 to 2**(BUDDY_ORDERS - 1)
+   items. */
+#define BUDDY_ORDERS 11
+
+#define BUDDY_ERROR SIZE_MAX
+
+struct buddy *buddy_create_in_buf (size_t cnt, size_t origin,
+		void *, size_t byte_cnt);
+size_t buddy_buf_size (size_t cnt);
+
+size_t buddy_alloc (struct buddy *, size_t cnt);
+void buddy_take (struct buddy *, size_t start, size_t cnt);
+void buddy_free (struct buddy *, size_t start, size_t cnt);
+
+size_t buddy_free_cnt (const struct buddy *);
+size_t buddy_largest (const struct buddy *);
+
+#endif /* lib/kernel/buddy.h */
@@ -0,0 +1,48 @@
+#ifndef __LIB_KERNEL_KLOG_H
+#define __LIB_KERNEL_KLOG_H
+
+#include <stdint.h>
+
+/* In-memory kernel log.
+
+   klog() records a timestamp, a printf()-style FORMAT, and up to
+   KLOG_ARGS integer or pointer arguments in a ring buffer, without
+   taking any lock, formatting anything, or touching a device, so
+   it may be called from interrupt handlers and from the
+   scheduler.
+   Formatting happens later, when the klogd thread drains the ring
+   or when a panic dumps it.  Hence FORMAT and any string passed
+   for %s must stay valid indefinitely, e.g. be string literals.
+
+   Arguments are stored as 64-bit values, which suits every
+   conversion except floating point.  klog() converts each one to
+   uint64_t itself, so callers may pass ints, pointers, and the
+   like as they are. */
+
+/* Most arguments one record holds. */
+#define KLOG_ARGS 4
+
+#define klog(...) \
+	KLOG_PICK_ (__VA_ARGS__, KLOG4_, KLOG3_, KLOG2_, KLOG1_, KLOG0_, _) \
+		(__VA_ARGS__)
+
+/* Selects the KLOG<N>_ macro for the number of arguments after the
+   format in a klog() call. */
+#define KLOG_PICK_(FORMAT, A, B, C, D, M, ...) M
+#define KLOG0_(F) klog_record (0, F)
+#define KLOG1_(F, A) klog_record (1, F, (uint64_t) (A))
+#define KLOG2_(F, A, B) \
+	klog_record (2, F, (uint64_t) (A), (uint64_t) (B))
+#define KLOG3_(F, A, B, C) \
+	klog_record (3, F, (uint64_t) (A), (uint64_t) (B), (uint64_t) (C))
+#define KLOG4_(F, A, B, C, D) \
+	klog_record (4, F, (uint64_t) (A), (uint64_t) (B), (uint64_t) (C), \
+			(uint64_t) (D))
+
+void klog_record (int argc, const char *format, ...);
+void klog_init (void);
+void klog_drain (void);
+void klog_dump (void);
+void klog_print_stats (void);
+
+#endif /* lib/kernel/klog.h */
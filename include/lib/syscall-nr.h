@@ -36,6 +36,10 @@ enum {
 
 	SYS_MOUNT,
 	SYS_UMOUNT,
+
+	/* Extensions. */
+	SYS_CLOCK_NS,               /* Read the monotonic clock. */
+	SYS_MEMSTAT,                /* Print memory use by allocation site. */
 };
 
 #endif /* lib/syscall-nr.h */
@@ -38,6 +38,12 @@ void close (int fd);
 
 int dup2(int oldfd, int newfd);
 
+/* Nanoseconds since boot, from a monotonic clock. */
+long long clock_ns (void);
+
+/* Prints the kernel's memory use by allocation site. */
+void memstat (void);
+
 /* Project 3 and optionally project 4. */
 void *mmap (void *addr, size_t length, int writable, int fd, off_t offset);
 void munmap (void *addr);
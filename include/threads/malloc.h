@@ -2,12 +2,20 @@
 #define THREADS_MALLOC_H
 
 #include <debug.h>
+#include <stdbool.h>
 #include <stddef.h>
 
+/* Number of block sizes malloc() manages itself, from 16 bytes to
+   1 kB. */
+#define MALLOC_CLASS_CNT 7
+
 void malloc_init (void);
 void *malloc (size_t) __attribute__ ((malloc));
 void *calloc (size_t, size_t) __attribute__ ((malloc));
 void *realloc (void *, size_t);
 void free (void *);
+void malloc_thread_exit (void);
+size_t malloc_reap (void);
+void malloc_set_magazines (bool);
 
 #endif /* threads/malloc.h */
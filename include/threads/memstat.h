@@ -0,0 +1,28 @@
+#ifndef THREADS_MEMSTAT_H
+#define THREADS_MEMSTAT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Memory accounting by allocation site.  See memstat.c for
+   details. */
+
+/* Kinds of memory accounted for. */
+enum memstat_kind {
+	MEMSTAT_MALLOC,             /* Blocks from malloc() and friends. */
+	MEMSTAT_KERNEL,             /* Pages from the kernel pool. */
+	MEMSTAT_USER,               /* Pages from the user pool. */
+	MEMSTAT_KIND_CNT
+};
+
+void memstat_configure (const char *value);
+void memstat_init (void);
+void memstat_alloc (enum memstat_kind, const void *, size_t bytes,
+		const void *caller);
+void memstat_free (const void *);
+void memstat_free_pages (const void *, size_t bytes);
+size_t memstat_live (enum memstat_kind);
+void memstat_thread_exit (void);
+void memstat_print (bool live_only);
+
+#endif /* threads/memstat.h */
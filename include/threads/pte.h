@@ -41,5 +41,12 @@
 #define PTE_U 0x4                        /* 1=user/kernel, 0=kernel only. */
 #define PTE_A 0x20                       /* 1=accessed, 0=not acccessed. */
 #define PTE_D 0x40                       /* 1=dirty, 0=not dirty (PTEs only). */
+#define PTE_PS 0x80                      /* 1=maps a 2 MB page (PDEs only). */
+
+/* A 2 MB "huge" page, mapped by a single page directory entry. */
+#define HUGE_PGSHIFT PDXSHIFT
+#define HUGE_PGSIZE (1UL << HUGE_PGSHIFT)
+#define HUGE_PGMASK (HUGE_PGSIZE - 1)
+#define HUGE_PGCNT (HUGE_PGSIZE / PGSIZE)  /* 4 kB pages per huge page. */
 
 #endif /* threads/pte.h */
@@ -0,0 +1,23 @@
+#ifndef THREADS_SLAB_H
+#define THREADS_SLAB_H
+
+#include <stddef.h>
+
+/* Object caches.  See slab.c for details. */
+
+/* Initializes an object that is new to a cache. */
+typedef void kmem_ctor_func (void *obj);
+
+struct kmem_cache;
+
+void kmem_init (void);
+struct kmem_cache *kmem_cache_create (const char *name, size_t size,
+		kmem_ctor_func *);
+void *kmem_cache_alloc (struct kmem_cache *) __attribute__ ((malloc));
+void *kmem_cache_zalloc (struct kmem_cache *) __attribute__ ((malloc));
+void kmem_cache_free (struct kmem_cache *, void *);
+size_t kmem_cache_shrink (struct kmem_cache *);
+size_t kmem_reap (void);
+void kmem_print_stats (void);
+
+#endif /* threads/slab.h */
@@ -9,6 +9,7 @@
 #include <stdint.h>
 
 #include "threads/interrupt.h"
+#include "threads/malloc.h"
 #ifdef VM
 #include "vm/vm.h"
 #endif
@@ -143,6 +144,9 @@ struct thread {
 	void *stack_pointer;
 #endif
 
+	/* Owned by threads/malloc.c. */
+	struct magazine *mags[MALLOC_CLASS_CNT];   /* Loaded magazines. */
+
 	/* Owned by thread.c. */
 	struct intr_frame tf;               /* Information for switching */
 	struct intr_frame syscall_tf;
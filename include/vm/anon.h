@@ -5,15 +5,20 @@
 #include "threads/vaddr.h"
 
 struct page;
+struct frame;
 enum vm_type;
 
 #define SWAP_SIZE (PGSIZE / DISK_SECTOR_SIZE)
 
 struct anon_page {
     size_t slot;
+    struct zobj *zobj;      /* Compressed copy in zswap, if any. */
+    struct frame *writeback;    /* Frame still being written to SLOT. */
 };
 
 void vm_anon_init (void);
 bool anon_initializer (struct page *page, enum vm_type type, void *kva);
+void anon_wait_frame (struct frame *frame);
+size_t anon_write_slot (const void *kva);
 
 #endif
@@ -0,0 +1,16 @@
+#ifndef VM_KSM_H
+#define VM_KSM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct frame;
+
+/* Merging of identical anonymous pages.  See ksm.c for details. */
+
+void ksm_configure (const char *value);
+void ksm_init (void);
+void ksm_forget (struct frame *);
+void ksm_print_stats (void);
+
+#endif /* vm/ksm.h */
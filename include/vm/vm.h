@@ -53,6 +53,7 @@ struct page {
 	struct hash_elem elem;
 	bool writable;
 	bool ori_writable;
+	struct thread *owner;  /* Process whose SPT holds the page. */
 	/* Per-type data are binded into the union.
 	 * Each function automatically detects the current union */
 	union {
@@ -70,6 +71,10 @@ struct frame {
 	void *kva;
 	struct page *page;
 	struct list_elem elem;
+	struct swap_io *swap_io;   /* Swap-out in flight, if any. */
+	struct ksm_node *ksm;      /* Merged frame shared, if any. */
+	uint32_t ksm_sum;          /* Checksum when last scanned by ksmd. */
+	bool busy;                 /* KVA being copied for a write fault. */
 };
 
 /* The function table for page operations.
@@ -105,6 +110,19 @@ struct page *spt_find_page (struct supplemental_page_table *spt,
 bool spt_insert_page (struct supplemental_page_table *spt, struct page *page);
 void spt_remove_page (struct supplemental_page_table *spt, struct page *page);
 
+/* Frames holding user pages.  Changed only with interrupts off,
+ * through frame_table_insert() and frame_table_remove(), since
+ * ksmd walks it. */
+extern struct list frame_table;
+void frame_table_insert (struct frame *);
+void frame_table_remove (struct frame *);
+
+/* Object caches for the structures allocated on page faults and
+ * for lazy-load aux data. */
+extern struct kmem_cache *page_cache;
+extern struct kmem_cache *frame_cache;
+extern struct kmem_cache *container_cache;
+
 void vm_init (void);
 bool vm_try_handle_fault (struct intr_frame *f, void *addr, bool user,
 		bool write, bool not_present);
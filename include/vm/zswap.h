@@ -0,0 +1,21 @@
+#ifndef VM_ZSWAP_H
+#define VM_ZSWAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct page;
+
+/* Compressed in-memory cache in front of the swap disk.  See
+   zswap.c for details. */
+
+/* Most pool pages; set by the -zswap kernel option. */
+extern size_t zswap_pool_limit;
+
+void zswap_init (void);
+bool zswap_store (struct page *, const void *kva);
+bool zswap_load (struct page *, void *kva);
+void zswap_invalidate (struct page *);
+void zswap_print_stats (void);
+
+#endif /* vm/zswap.h */
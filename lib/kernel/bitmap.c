@@ -26,6 +26,7 @@ typedef unsigned long elem_type;
    simulates an array of bits. */
 struct bitmap {
 	size_t bit_cnt;     /* Number of bits. */
+	size_t hint;        /* No bit below this index is false. */
 	elem_type *bits;    /* Elements that represent bits. */
 };
 
@@ -63,6 +64,59 @@ last_mask (const struct bitmap *b) {
 	return last_bits ? ((elem_type) 1 << last_bits) - 1 : (elem_type) -1;
 }
 
+/* Returns a mask of the bits in an element that lie at or after
+   BIT_IDX and before END_IDX, both taken within the element that
+   contains BIT_IDX.  END_IDX may lie in a later element. */
+static inline elem_type
+range_mask (size_t bit_idx, size_t end_idx) {
+	elem_type mask = (elem_type) -1 << (bit_idx % ELEM_BITS);
+	if (elem_idx (end_idx) == elem_idx (bit_idx))
+		mask &= bit_mask (end_idx) - 1;
+	return mask;
+}
+
+/* Returns the index of the first bit at or after START and
+   before END in B that is set to VALUE, or END if there is none.
+   Works a whole element at a time. */
+static size_t
+next_bit (const struct bitmap *b, size_t start, size_t end, bool value) {
+	while (start < end) {
+		elem_type word = b->bits[elem_idx (start)];
+		if (!value)
+			word = ~word;
+		word &= range_mask (start, end);
+		if (word != 0) {
+			size_t idx = start - start % ELEM_BITS + __builtin_ctzl (word);
+			return idx < end ? idx : end;
+		}
+		start = start - start % ELEM_BITS + ELEM_BITS;
+	}
+	return end;
+}
+
+/* Atomically replaces B's hint by NEW if it is still OLD.
+   Returns true if successful. */
+static inline bool
+hint_swap (struct bitmap *b, size_t old, size_t new) {
+	size_t prev;
+	asm volatile ("lock cmpxchgq %2, %1"
+			: "=a" (prev), "+m" (b->hint)
+			: "r" (new), "0" (old)
+			: "cc", "memory");
+	return prev == old;
+}
+
+/* Lowers B's hint to BIT_IDX, which has just been set to false.
+   The bit must be cleared before the hint is lowered, so that a
+   concurrent bitmap_scan_and_flip() cannot raise the hint past
+   it. */
+static inline void
+hint_lower (struct bitmap *b, size_t bit_idx) {
+	size_t old;
+	while ((old = b->hint) > bit_idx && !hint_swap (b, old, bit_idx))
+		continue;
+}
+
 /* Creation and destruction. */
 
 /* Initializes B to be a bitmap of BIT_CNT bits
@@ -74,6 +128,7 @@ bitmap_create (size_t bit_cnt) {
 	struct bitmap *b = malloc (sizeof *b);
 	if (b != NULL) {
 		b->bit_cnt = bit_cnt;
+		b->hint = 0;
 		b->bits = malloc (byte_cnt (bit_cnt));
 		if (b->bits != NULL || bit_cnt == 0) {
 			bitmap_set_all (b, false);
@@ -94,6 +149,7 @@ bitmap_create_in_buf (size_t bit_cnt, void *block, size_t block_size UNUSED) {
 	ASSERT (block_size >= bitmap_buf_size (bit_cnt));
 
 	b->bit_cnt = bit_cnt;
+	b->hint = 0;
 	b->bits = (elem_type *) (b + 1);
 	bitmap_set_all (b, false);
 	return b;
@@ -160,6 +216,7 @@ bitmap_reset (struct bitmap *b, size_t bit_idx) {
 	   is guaranteed to be atomic on a uniprocessor machine.  See
 	   the description of the AND instruction in [IA32-v2a]. */
 	asm ("lock andq %1, %0" : "=m" (b->bits[idx]) : "r" (~mask) : "cc");
+	hint_lower (b, bit_idx);
 }
 
 /* Atomically toggles the bit numbered IDX in B;
@@ -174,6 +231,7 @@ bitmap_flip (struct bitmap *b, size_t bit_idx) {
 	   is guaranteed to be atomic on a uniprocessor machine.  See
 	   the description of the XOR instruction in [IA32-v2b]. */
 	asm ("lock xorq %1, %0" : "=m" (b->bits[idx]) : "r" (mask) : "cc");
+	hint_lower (b, bit_idx);
 }
 
 /* Returns the value of the bit numbered IDX in B. */
@@ -194,17 +252,33 @@ bitmap_set_all (struct bitmap *b, bool value) {
 	bitmap_set_multiple (b, 0, bitmap_size (b), value);
 }
 
-/* Sets the CNT bits starting at START in B to VALUE. */
+/* Sets the CNT bits starting at START in B to VALUE.
+   Each element is updated atomically, but not the group as a
+   whole. */
 void
 bitmap_set_multiple (struct bitmap *b, size_t start, size_t cnt, bool value) {
-	size_t i;
+	size_t bit_idx, end = start + cnt;
 
 	ASSERT (b != NULL);
 	ASSERT (start <= b->bit_cnt);
 	ASSERT (start + cnt <= b->bit_cnt);
 
-	for (i = 0; i < cnt; i++)
-		bitmap_set (b, start + i, value);
+	for (bit_idx = start; bit_idx < end;
+			bit_idx = bit_idx - bit_idx % ELEM_BITS + ELEM_BITS) {
+		size_t idx = elem_idx (bit_idx);
+		elem_type mask = range_mask (bit_idx, end);
+
+		/* Same as bitmap_mark() and bitmap_reset(), but for a
+		   whole element's worth of bits at once. */
+		if (value)
+			asm ("lock orq %1, %0"
+					: "+m" (b->bits[idx]) : "r" (mask) : "cc");
+		else
+			asm ("lock andq %1, %0"
+					: "+m" (b->bits[idx]) : "r" (~mask) : "cc");
+	}
+	if (!value && cnt > 0)
+		hint_lower (b, start);
 }
 
 /* Returns the number of bits in B between START and START + CNT,
@@ -228,16 +302,11 @@ bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value) {
    exclusive, are set to VALUE, and false otherwise. */
 bool
 bitmap_contains (const struct bitmap *b, size_t start, size_t cnt, bool value) {
-	size_t i;
-
 	ASSERT (b != NULL);
 	ASSERT (start <= b->bit_cnt);
 	ASSERT (start + cnt <= b->bit_cnt);
 
-	for (i = 0; i < cnt; i++)
-		if (bitmap_test (b, start + i) == value)
-			return true;
-	return false;
+	return next_bit (b, start, start + cnt, value) < start + cnt;
 }
 
 /* Returns true if any bits in B between START and START + CNT,
@@ -263,23 +332,44 @@ bitmap_all (const struct bitmap *b, size_t start, size_t cnt) {
 
 /* Finding set or unset bits. */
 
+/* Does the work for bitmap_scan().  Also stores into *FIRST the
+   index of the first bit at or after START that is set to VALUE,
+   or the size of B if there is none.
+
+   Rather than testing every candidate start bit, this jumps from
+   one run of VALUE bits to the next, finding each end of a run
+   an element at a time.  When looking for false bits, it also
+   skips ahead to B's hint, below which every bit is true. */
+static size_t
+scan (const struct bitmap *b, size_t start, size_t cnt, bool value,
+		size_t *first) {
+	size_t i;
+
+	ASSERT (b != NULL);
+	ASSERT (start <= b->bit_cnt);
+
+	*first = i = next_bit (b, !value && start < b->hint ? b->hint : start,
+			b->bit_cnt, value);
+	if (cnt == 0)
+		return start;
+
+	while (cnt <= b->bit_cnt - i) {
+		size_t run_end = next_bit (b, i, i + cnt, !value);
+		if (run_end == i + cnt)
+			return i;
+		i = next_bit (b, run_end, b->bit_cnt, value);
+	}
+	return BITMAP_ERROR;
+}
+
 /* Finds and returns the starting index of the first group of CNT
    consecutive bits in B at or after START that are all set to
    VALUE.
    If there is no such group, returns BITMAP_ERROR. */
 size_t
 bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value) {
-	ASSERT (b != NULL);
-	ASSERT (start <= b->bit_cnt);
-
-	if (cnt <= b->bit_cnt) {
-		size_t last = b->bit_cnt - cnt;
-		size_t i;
-		for (i = start; i <= last; i++)
-			if (!bitmap_contains (b, i, cnt, !value))
-				return i;
-	}
-	return BITMAP_ERROR;
+	size_t first;
+	return scan (b, start, cnt, value, &first);
 }
 
 /* Finds the first group of CNT consecutive bits in B at or after
@@ -291,9 +381,25 @@ bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value) {
    setting them. */
 size_t
 bitmap_scan_and_flip (struct bitmap *b, size_t start, size_t cnt, bool value) {
-	size_t idx = bitmap_scan (b, start, cnt, value);
+	size_t hint = b->hint;
+	size_t first;
+	size_t idx = scan (b, start, cnt, value, &first);
+
 	if (idx != BITMAP_ERROR)
 		bitmap_set_multiple (b, idx, cnt, !value);
+
+	/* Every bit below FIRST is now true, and so is every bit of
+	   the group if it starts there, so the hint can move up.  A
+	   bit freed behind the scan may have been missed, so look
+	   again once the new hint is in place. */
+	if (!value && start <= hint) {
+		size_t new = idx == first ? idx + cnt : first;
+		if (new > hint && hint_swap (b, hint, new)) {
+			size_t freed = next_bit (b, hint, new, false);
+			if (freed < new)
+				hint_lower (b, freed);
+		}
+	}
 	return idx;
 }
 
@@ -315,6 +421,7 @@ bitmap_read (struct bitmap *b, struct file *file) {
 		off_t size = byte_cnt (b->bit_cnt);
 		success = file_read_at (file, b->bits, size, 0) == size;
 		b->bits[elem_cnt (b->bit_cnt) - 1] &= last_mask (b);
+		b->hint = 0;
 	}
 	return success;
 }
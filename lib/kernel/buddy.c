@@ -0,0 +1,279 @@
+#include "buddy.h"
+#include <debug.h>
+#include <round.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Ends a free list. */
+#define NIL UINT32_MAX
+
+/* A buddy allocator.
+
+   Each free block is identified by its first item.  ORDERS[I] is
+   one more than the order of the free block that starts at item
+   I, or 0 if no free block starts there, which is what lets
+   buddy_free() tell whether a buddy is free in constant time.
+   NEXT[I] and PREV[I] link that block into its order's free
+   list. */
+struct buddy {
+	size_t cnt;                     /* Number of items. */
+	size_t origin;                  /* Item 0's position, for alignment. */
+	size_t free_cnt;                /* Number of free items. */
+	uint32_t heads[BUDDY_ORDERS];   /* First free block of each order. */
+	uint32_t *next;                 /* Next free block of the same order. */
+	uint32_t *prev;                 /* Previous free block, same order. */
+	uint8_t *orders;                /* Order + 1 of free block at item. */
+};
+
+static size_t scan_run (struct buddy *, size_t cnt);
+
+/* Returns the number of items in a block of ORDER. */
+static inline size_t
+block_size (int order) {
+	return (size_t) 1 << order;
+}
+
+/* Returns the bytes needed for an allocator over CNT items. */
+size_t
+buddy_buf_size (size_t cnt) {
+	return ROUND_UP (sizeof (struct buddy), sizeof (uint32_t))
+		+ cnt * (2 * sizeof (uint32_t) + sizeof (uint8_t));
+}
+
+/* Creates and returns an allocator over CNT items in the
+   BYTE_CNT bytes at BLOCK, which must be at least
+   buddy_buf_size(CNT) bytes.  Blocks are aligned as if item 0
+   were at position ORIGIN, e.g. a page number, so that blocks of
+   pages can line up with physical addresses.  All items start
+   out allocated; use buddy_free() to make them available. */
+struct buddy *
+buddy_create_in_buf (size_t cnt, size_t origin, void *block,
+		size_t byte_cnt) {
+	struct buddy *b = block;
+	int order;
+
+	ASSERT (byte_cnt >= buddy_buf_size (cnt));
+	ASSERT (cnt < NIL);
+
+	b->cnt = cnt;
+	b->origin = origin;
+	b->free_cnt = 0;
+	for (order = 0; order < BUDDY_ORDERS; order++)
+		b->heads[order] = NIL;
+	b->next = (uint32_t *) ((uint8_t *) block
+			+ ROUND_UP (sizeof *b, sizeof (uint32_t)));
+	b->prev = b->next + cnt;
+	b->orders = (uint8_t *) (b->prev + cnt);
+	memset (b->orders, 0, cnt);
+	return b;
+}
+
+/* Adds the block of ORDER at IDX to B's free lists. */
+static void
+push_block (struct buddy *b, size_t idx, int order) {
+	uint32_t head = b->heads[order];
+
+	b->orders[idx] = order + 1;
+	b->next[idx] = head;
+	b->prev[idx] = NIL;
+	if (head != NIL)
+		b->prev[head] = idx;
+	b->heads[order] = idx;
+	b->free_cnt += block_size (order);
+}
+
+/* Removes the free block at IDX from B's free lists and returns
+   its order. */
+static int
+unlink_block (struct buddy *b, size_t idx) {
+	int order = b->orders[idx] - 1;
+	uint32_t next = b->next[idx], prev = b->prev[idx];
+
+	ASSERT (order >= 0);
+	if (prev != NIL)
+		b->next[prev] = next;
+	else
+		b->heads[order] = next;
+	if (next != NIL)
+		b->prev[next] = prev;
+	b->orders[idx] = 0;
+	b->free_cnt -= block_size (order);
+	return order;
+}
+
+/* Returns the item at which the buddy of the block of ORDER at
+   IDX starts, or NIL if the buddy lies partly outside B. */
+static size_t
+buddy_of (const struct buddy *b, size_t idx, int order) {
+	size_t pos = (b->origin + idx) ^ block_size (order);
+
+	if (pos < b->origin || pos - b->origin + block_size (order) > b->cnt)
+		return NIL;
+	return pos - b->origin;
+}
+
+/* Frees the block of ORDER at IDX, merging it with its buddy for
+   as long as the buddy is free. */
+static void
+free_block (struct buddy *b, size_t idx, int order) {
+	while (order < BUDDY_ORDERS - 1) {
+		size_t buddy = buddy_of (b, idx, order);
+
+		if (buddy == NIL || b->orders[buddy] != order + 1)
+			break;
+		unlink_block (b, buddy);
+		if (buddy < idx)
+			idx = buddy;
+		order++;
+	}
+	push_block (b, idx, order);
+}
+
+/* Returns the first item of the free block that contains item
+   IDX, or NIL if IDX is allocated. */
+static size_t
+find_block (const struct buddy *b, size_t idx) {
+	size_t pos = b->origin + idx;
+	int order;
+
+	for (order = 0; order < BUDDY_ORDERS; order++) {
+		size_t head = pos & ~(block_size (order) - 1);
+
+		if (head < b->origin)
+			break;
+		if (b->orders[head - b->origin] == order + 1)
+			return head - b->origin;
+	}
+	return NIL;
+}
+
+/* Allocates a run of CNT consecutive items from B and returns the
+   index of the first one, or BUDDY_ERROR if there is no such run.
+   The run is carved from the smallest block that holds it and the
+   rest of that block is freed again, so that exactly CNT items
+   are allocated. */
+size_t
+buddy_alloc (struct buddy *b, size_t cnt) {
+	int order = 0, j;
+	size_t idx;
+
+	ASSERT (cnt > 0);
+
+	while (block_size (order) < cnt && order < BUDDY_ORDERS)
+		order++;
+	if (order == BUDDY_ORDERS)
+		return scan_run (b, cnt);
+
+	for (j = order; j < BUDDY_ORDERS && b->heads[j] == NIL; j++)
+		continue;
+	if (j == BUDDY_ORDERS) {
+		/* No aligned block is large enough, but CNT items might
+		   still span neighboring smaller blocks. */
+		return cnt > 1 ? scan_run (b, cnt) : BUDDY_ERROR;
+	}
+
+	idx = b->heads[j];
+	unlink_block (b, idx);
+	while (j > order) {
+		j--;
+		push_block (b, idx + block_size (j), j);
+	}
+	if (cnt < block_size (order))
+		buddy_free (b, idx + cnt, block_size (order) - cnt);
+	return idx;
+}
+
+/* Marks the CNT items starting at START, which must all be free,
+   as allocated. */
+void
+buddy_take (struct buddy *b, size_t start, size_t cnt) {
+	ASSERT (start <= b->cnt && cnt <= b->cnt - start);
+
+	while (cnt > 0) {
+		size_t head = find_block (b, start);
+		size_t end, taken;
+		int order;
+
+		ASSERT (head != NIL);
+		order = unlink_block (b, head);
+		end = head + block_size (order);
+		taken = (end < start + cnt ? end : start + cnt) - start;
+
+		/* Give back the parts of the block outside the run. */
+		buddy_free (b, head, start - head);
+		buddy_free (b, start + taken, end - (start + taken));
+
+		start += taken;
+		cnt -= taken;
+	}
+}
+
+/* Frees the CNT items starting at START, which must all be
+   allocated.  They need not have been allocated together: any
+   run of allocated items may be freed. */
+void
+buddy_free (struct buddy *b, size_t start, size_t cnt) {
+	ASSERT (start <= b->cnt && cnt <= b->cnt - start);
+
+	/* Split the run into the largest aligned blocks that fit. */
+	while (cnt > 0) {
+		size_t pos = b->origin + start;
+		int order = 0;
+
+		while (order < BUDDY_ORDERS - 1
+				&& pos % block_size (order + 1) == 0
+				&& block_size (order + 1) <= cnt)
+			order++;
+		ASSERT (b->orders[start] == 0);
+		free_block (b, start, order);
+		start += block_size (order);
+		cnt -= block_size (order);
+	}
+}
+
+/* Returns the number of free items in B. */
+size_t
+buddy_free_cnt (const struct buddy *b) {
+	return b->free_cnt;
+}
+
+/* Returns the number of items in the largest free block in B. */
+size_t
+buddy_largest (const struct buddy *b) {
+	int order;
+
+	for (order = BUDDY_ORDERS - 1; order >= 0; order--)
+		if (b->heads[order] != NIL)
+			return block_size (order);
+	return 0;
+}
+
+/* Finds the first run of CNT free items in B, which may span
+   several blocks, allocates it, and returns its first index, or
+   BUDDY_ERROR if there is none.  Takes time linear in the size of
+   B, so it is only used when no single block will do. */
+static size_t
+scan_run (struct buddy *b, size_t cnt) {
+	size_t idx = 0, run_start = 0, run = 0;
+
+	if (cnt > b->free_cnt)
+		return BUDDY_ERROR;
+	while (idx < b->cnt) {
+		size_t head = find_block (b, idx);
+
+		if (head == NIL) {
+			idx++;
+			run = 0;
+			continue;
+		}
+		if (run == 0)
+			run_start = idx;
+		idx = head + block_size (b->orders[head] - 1);
+		run = idx - run_start;
+		if (run >= cnt) {
+			buddy_take (b, run_start, cnt);
+			return run_start;
+		}
+	}
+	return BUDDY_ERROR;
+}
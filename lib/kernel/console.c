@@ -9,6 +9,17 @@
 
 static void vprintf_helper (char, void *);
 static void putchar_have_lock (uint8_t c);
+static void putbuf_have_lock (const char *, size_t);
+
+/* Output that vprintf() has formatted but not yet written.  It is
+   written out a batch at a time, so that the serial port sees
+   whole runs of characters instead of one at a time. */
+#define VPRINTF_BATCH 64
+struct vprintf_aux {
+	int char_cnt;                   /* Characters formatted so far. */
+	size_t n;                       /* Characters in BUF. */
+	char buf[VPRINTF_BATCH];        /* Pending characters. */
+};
 
 /* The console lock.
    Both the vga and serial layers do their own locking, so it's
@@ -116,13 +127,17 @@ console_locked_by_current_thread (void) {
    Writes its output to both vga display and serial port. */
 int
 vprintf (const char *format, va_list args) {
-	int char_cnt = 0;
+	struct vprintf_aux aux;
+
+	aux.char_cnt = 0;
+	aux.n = 0;
 
 	acquire_console ();
-	__vprintf (format, args, vprintf_helper, &char_cnt);
+	__vprintf (format, args, vprintf_helper, &aux);
+	putbuf_have_lock (aux.buf, aux.n);
 	release_console ();
 
-	return char_cnt;
+	return aux.char_cnt;
 }
 
 /* Writes string S to the console, followed by a new-line
@@ -142,8 +157,7 @@ puts (const char *s) {
 void
 putbuf (const char *buffer, size_t n) {
 	acquire_console ();
-	while (n-- > 0)
-		putchar_have_lock (*buffer++);
+	putbuf_have_lock (buffer, n);
 	release_console ();
 }
 
@@ -159,10 +173,15 @@ putchar (int c) {
 
 /* Helper function for vprintf(). */
 static void
-vprintf_helper (char c, void *char_cnt_) {
-	int *char_cnt = char_cnt_;
-	(*char_cnt)++;
-	putchar_have_lock (c);
+vprintf_helper (char c, void *aux_) {
+	struct vprintf_aux *aux = aux_;
+
+	aux->char_cnt++;
+	aux->buf[aux->n++] = c;
+	if (aux->n == sizeof aux->buf) {
+		putbuf_have_lock (aux->buf, aux->n);
+		aux->n = 0;
+	}
 }
 
 /* Writes C to the vga display and serial port.
@@ -175,3 +194,14 @@ putchar_have_lock (uint8_t c) {
 	serial_putc (c);
 	vga_putc (c);
 }
+
+/* Writes the N characters in BUFFER to the vga display and serial
+   port, handing them to each as one batch.  The caller
+   has already acquired the console lock if appropriate. */
+static void
+putbuf_have_lock (const char *buffer, size_t n) {
+	ASSERT (console_locked_by_current_thread ());
+	write_cnt += n;
+	serial_putbuf (buffer, n);
+	vga_putbuf (buffer, n);
+}
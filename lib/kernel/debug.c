@@ -1,5 +1,6 @@
 #include <debug.h>
 #include <console.h>
+#include <klog.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -30,6 +31,7 @@ debug_panic (const char *file, int line, const char *function,
 		va_end (args);
 
 		debug_backtrace ();
+		klog_dump ();
 	} else if (level == 2)
 		printf ("Kernel PANIC recursion at %s:%d in %s().\n",
 				file, line, function);
@@ -0,0 +1,146 @@
+#include <klog.h>
+#include <debug.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "devices/timer.h"
+#include "threads/thread.h"
+
+/* Number of records in the ring.  Must be a power of 2. */
+#define KLOG_SIZE 1024
+
+/* One log record.
+
+   A writer claims a position in the log with an atomic increment
+   of klog_head, so that writers never wait for one another, even
+   when an interrupt handler logs in the middle of another
+   thread's klog().  The record for position POS lives in slot
+   POS % KLOG_SIZE.  Its SEQ is 0 while a writer fills it in and
+   POS + 1 once it is complete, which lets readers recognize
+   records that are unfinished or have been overwritten. */
+struct klog_rec {
+	uint64_t seq;                   /* Position + 1, or 0 if unfinished. */
+	int64_t time;                   /* timer_now_ns() when recorded. */
+	const char *format;             /* printf() format. */
+	int argc;                       /* Number of ARGS used. */
+	uint64_t args[KLOG_ARGS];       /* Arguments. */
+};
+
+static struct klog_rec ring[KLOG_SIZE];
+static uint64_t klog_head;          /* Next position to claim. */
+static uint64_t klog_tail;          /* Next position to format. */
+static uint64_t lost_cnt;           /* Records overwritten unread. */
+
+static void klogd (void *aux);
+
+/* Appends a record of FORMAT and the ARGC arguments that follow
+   it, each a uint64_t, to the log.  Use through the klog() macro,
+   which supplies ARGC and converts the arguments. */
+void
+klog_record (int argc, const char *format, ...) {
+	uint64_t pos = __atomic_fetch_add (&klog_head, 1, __ATOMIC_RELAXED);
+	struct klog_rec *r = &ring[pos % KLOG_SIZE];
+	va_list args;
+	int i;
+
+	ASSERT (argc >= 0 && argc <= KLOG_ARGS);
+
+	__atomic_store_n (&r->seq, 0, __ATOMIC_RELAXED);
+	__atomic_signal_fence (__ATOMIC_SEQ_CST);
+
+	r->time = timer_now_ns ();
+	r->format = format;
+	r->argc = argc;
+	va_start (args, format);
+	for (i = 0; i < argc; i++)
+		r->args[i] = va_arg (args, uint64_t);
+	va_end (args);
+
+	__atomic_store_n (&r->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* Starts the thread that drains the log to the console. */
+void
+klog_init (void) {
+	thread_create ("klogd", PRI_MIN, klogd, NULL);
+}
+
+/* Copies the record at position POS into *OUT.  Returns false if
+   it is not complete, because its writer has not finished, or
+   because it has been overwritten, possibly during the copy. */
+static bool
+read_record (uint64_t pos, struct klog_rec *out) {
+	const struct klog_rec *r = &ring[pos % KLOG_SIZE];
+
+	if (__atomic_load_n (&r->seq, __ATOMIC_ACQUIRE) != pos + 1)
+		return false;
+	*out = *r;
+	__atomic_signal_fence (__ATOMIC_SEQ_CST);
+	return __atomic_load_n (&r->seq, __ATOMIC_ACQUIRE) == pos + 1;
+}
+
+/* Prints record R. */
+static void
+print_record (const struct klog_rec *r) {
+	uint64_t a[KLOG_ARGS] = { 0 };
+	int i;
+
+	for (i = 0; i < r->argc; i++)
+		a[i] = r->args[i];
+	printf ("[%5lld.%06lld] ", r->time / 1000000000, r->time / 1000 % 1000000);
+	printf (r->format, a[0], a[1], a[2], a[3]);
+	printf ("\n");
+}
+
+/* Formats and prints every complete record not printed yet.
+   Stops at the first unfinished record, to resume there next
+   time.  Counts records that were overwritten before they could
+   be printed.  Only one thread may drain at a time: normally
+   klogd, or the panicking thread with interrupts off. */
+void
+klog_drain (void) {
+	uint64_t head = __atomic_load_n (&klog_head, __ATOMIC_ACQUIRE);
+	struct klog_rec r;
+
+	if (head - klog_tail > KLOG_SIZE) {
+		lost_cnt += head - klog_tail - KLOG_SIZE;
+		klog_tail = head - KLOG_SIZE;
+	}
+	while (klog_tail != head) {
+		if (read_record (klog_tail, &r))
+			print_record (&r);
+		else if (__atomic_load_n (&ring[klog_tail % KLOG_SIZE].seq,
+					__ATOMIC_ACQUIRE) <= klog_tail)
+			break;
+		else {
+			/* Overwritten while we were looking. */
+			lost_cnt++;
+		}
+		klog_tail++;
+	}
+}
+
+/* Prints the log as it stands, for a kernel panic.  Safe to call
+   with interrupts off. */
+void
+klog_dump (void) {
+	if (klog_tail == klog_head)
+		return;
+	printf ("Kernel log:\n");
+	klog_drain ();
+}
+
+/* Prints kernel log statistics. */
+void
+klog_print_stats (void) {
+	printf ("Klog: %llu records, %llu lost\n", klog_head, lost_cnt);
+}
+
+/* Kernel log thread.  Drains the log ten times a second. */
+static void
+klogd (void *aux UNUSED) {
+	for (;;) {
+		klog_drain ();
+		timer_sleep (TIMER_FREQ / 10);
+	}
+}
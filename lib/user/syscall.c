@@ -145,6 +145,16 @@ dup2 (int oldfd, int newfd){
 	return syscall2 (SYS_DUP2, oldfd, newfd);
 }
 
+long long
+clock_ns (void) {
+	return syscall0 (SYS_CLOCK_NS);
+}
+
+void
+memstat (void) {
+	syscall0 (SYS_MEMSTAT);
+}
+
 void *
 mmap (void *addr, size_t length, int writable, int fd, off_t offset) {
 	return (void *) syscall5 (SYS_MMAP, addr, length, writable, fd, offset);
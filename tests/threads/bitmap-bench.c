@@ -0,0 +1,106 @@
+/* Measures how fast bitmap_scan() finds runs of free bits in a
+   bitmap filled to various levels, compared with testing one bit
+   at a time the way the scan used to.  Also checks that both
+   find the same run. */
+
+#include <bitmap.h>
+#include <random.h>
+#include <stdio.h>
+#include "tests/threads/tests.h"
+#include "threads/malloc.h"
+#include "devices/timer.h"
+
+/* Bits in the bitmap under test, about a 64 MB user pool. */
+#define BIT_CNT 16384
+
+/* Ticks to spend measuring each configuration. */
+#define MEASURE_TICKS 20
+
+static size_t slow_scan (const struct bitmap *, size_t cnt);
+static void fill (struct bitmap *, int percent);
+static long long measure (const struct bitmap *, size_t cnt, bool slow);
+
+void
+test_bitmap_bench (void) 
+{
+  static const int fill_levels[] = {0, 50, 90, 99};
+  static const size_t run_lengths[] = {1, 8, 64};
+  struct bitmap *b;
+  size_t i, j;
+
+  b = bitmap_create (BIT_CNT);
+  if (b == NULL)
+    fail ("bitmap_create failed");
+  random_init (0);
+
+  for (i = 0; i < sizeof fill_levels / sizeof *fill_levels; i++)
+    {
+      fill (b, fill_levels[i]);
+      for (j = 0; j < sizeof run_lengths / sizeof *run_lengths; j++)
+        {
+          size_t cnt = run_lengths[j];
+
+          if (bitmap_scan (b, 0, cnt, false) != slow_scan (b, cnt))
+            fail ("%d%% full, run of %zu: scans disagree",
+                  fill_levels[i], cnt);
+          msg ("%d%% full, run of %zu: %lld scans/s (bitwise: %lld scans/s)",
+               fill_levels[i], cnt, measure (b, cnt, false),
+               measure (b, cnt, true));
+        }
+    }
+
+  bitmap_destroy (b);
+  pass ();
+}
+
+/* Finds the first run of CNT false bits in B by testing each bit
+   of each candidate run in turn. */
+static size_t
+slow_scan (const struct bitmap *b, size_t cnt) 
+{
+  size_t i, j;
+
+  for (i = 0; i + cnt <= bitmap_size (b); i++)
+    {
+      for (j = 0; j < cnt; j++)
+        if (bitmap_test (b, i + j))
+          break;
+      if (j == cnt)
+        return i;
+    }
+  return BITMAP_ERROR;
+}
+
+/* Sets PERCENT percent of B's bits to true, chosen at random. */
+static void
+fill (struct bitmap *b, int percent) 
+{
+  size_t i;
+
+  for (i = 0; i < bitmap_size (b); i++)
+    bitmap_set (b, i, (int) (random_ulong () % 100) < percent);
+}
+
+/* Returns the number of scans for a run of CNT false bits in B
+   per second, using the bitwise scan if SLOW is true. */
+static long long
+measure (const struct bitmap *b, size_t cnt, bool slow) 
+{
+  long long scans = 0;
+  int64_t start, elapsed;
+
+  timer_sleep (1);
+  start = timer_ticks ();
+  do
+    {
+      if (slow)
+        slow_scan (b, cnt);
+      else
+        bitmap_scan (b, 0, cnt, false);
+      scans++;
+      elapsed = timer_elapsed (start);
+    }
+  while (elapsed < MEASURE_TICKS);
+
+  return scans * TIMER_FREQ / elapsed;
+}
@@ -0,0 +1,121 @@
+/* Measures malloc() and free() throughput with several kernel
+   threads allocating at once, with per-thread magazines on and
+   off.  Also checks that no block is handed out twice, by filling
+   each block with a pattern and checking it before freeing. */
+
+#include <random.h>
+#include <stdio.h>
+#include <string.h>
+#include "tests/threads/tests.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "devices/timer.h"
+
+/* Ticks to spend measuring each configuration. */
+#define MEASURE_TICKS 50
+
+/* Blocks each thread holds at once. */
+#define BATCH 8
+
+/* Most threads in a configuration. */
+#define THREAD_MAX 16
+
+struct worker
+  {
+    int id;                     /* Fill pattern. */
+    int64_t deadline;           /* Stop at this tick. */
+    long long ops;              /* malloc() and free() calls made. */
+    struct semaphore *done;     /* Upped on completion. */
+  };
+
+static thread_func worker;
+static long long measure (int thread_cnt, bool magazines);
+
+void
+test_malloc_bench (void)
+{
+  static const int thread_cnts[] = {1, 4, THREAD_MAX};
+  size_t i;
+
+  for (i = 0; i < sizeof thread_cnts / sizeof *thread_cnts; i++)
+    {
+      int cnt = thread_cnts[i];
+      long long without = measure (cnt, false);
+      long long with = measure (cnt, true);
+
+      msg ("%d threads: %lld ops/s with magazines, %lld ops/s without",
+           cnt, with, without);
+    }
+  malloc_set_magazines (true);
+  pass ();
+}
+
+/* Runs THREAD_CNT threads that allocate and free blocks for
+   MEASURE_TICKS ticks, with magazines on if MAGAZINES is true, and
+   returns their combined malloc() and free() calls per second. */
+static long long
+measure (int thread_cnt, bool magazines)
+{
+  struct worker workers[THREAD_MAX];
+  struct semaphore done;
+  long long ops = 0;
+  int64_t start;
+  int i;
+
+  malloc_set_magazines (magazines);
+  sema_init (&done, 0);
+  timer_sleep (1);
+  start = timer_ticks ();
+  for (i = 0; i < thread_cnt; i++)
+    {
+      char name[16];
+
+      workers[i].id = i + 1;
+      workers[i].deadline = start + MEASURE_TICKS;
+      workers[i].ops = 0;
+      workers[i].done = &done;
+      snprintf (name, sizeof name, "malloc %d", i);
+      thread_create (name, PRI_DEFAULT, worker, &workers[i]);
+    }
+  /* Wait for every worker before reading any count: the I'th up
+     need not come from worker I. */
+  for (i = 0; i < thread_cnt; i++)
+    sema_down (&done);
+  for (i = 0; i < thread_cnt; i++)
+    ops += workers[i].ops;
+  return ops * TIMER_FREQ / MEASURE_TICKS;
+}
+
+/* Allocates and frees batches of blocks of assorted sizes until
+   the deadline. */
+static void
+worker (void *w_)
+{
+  struct worker *w = w_;
+  void *blocks[BATCH];
+  size_t sizes[BATCH];
+  int i;
+
+  while (timer_ticks () < w->deadline)
+    {
+      for (i = 0; i < BATCH; i++)
+        {
+          sizes[i] = 16 << (random_ulong () % 6);
+          blocks[i] = malloc (sizes[i]);
+          if (blocks[i] == NULL)
+            fail ("malloc failed");
+          memset (blocks[i], w->id, sizes[i]);
+        }
+      for (i = 0; i < BATCH; i++)
+        {
+          unsigned char *p = blocks[i];
+
+          if (p[0] != w->id || p[sizes[i] - 1] != w->id)
+            fail ("block %p handed out twice", blocks[i]);
+          free (blocks[i]);
+        }
+      w->ops += 2 * BATCH;
+    }
+  sema_up (w->done);
+}
@@ -0,0 +1,70 @@
+/* Checks that memory accounting, turned on with -memstat, charges
+   malloc() blocks and pages from the page allocator for as long as
+   they are allocated, and no longer. */
+
+#include <stdio.h>
+#include "tests/threads/tests.h"
+#include "threads/malloc.h"
+#include "threads/memstat.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+
+/* Checks that KIND memory now allocated is EXPECTED bytes. */
+static void
+check_live (enum memstat_kind kind, size_t expected, const char *what)
+{
+  size_t live = memstat_live (kind);
+
+  if (live != expected)
+    fail ("%s: %zu bytes live, expected %zu", what, live, expected);
+}
+
+void
+test_memstat_account (void)
+{
+  size_t malloc_base = memstat_live (MEMSTAT_MALLOC);
+  size_t kernel_base = memstat_live (MEMSTAT_KERNEL);
+  char *block, *bigger;
+  void *pages;
+
+  /* At least the idle thread's page has been accounted for. */
+  if (kernel_base == 0)
+    fail ("no memory accounted for: boot with -memstat");
+
+  block = malloc (1000);
+  check_live (MEMSTAT_MALLOC, malloc_base + 1000, "after malloc");
+  bigger = realloc (block, 3000);
+  check_live (MEMSTAT_MALLOC, malloc_base + 3000, "after realloc");
+  free (bigger);
+  check_live (MEMSTAT_MALLOC, malloc_base, "after free");
+  msg ("malloc() blocks are accounted for");
+
+  /* Other threads may have allocated or freed pages since the
+     test began. */
+  kernel_base = memstat_live (MEMSTAT_KERNEL);
+  pages = palloc_get_multiple (0, 3);
+  if (pages == NULL)
+    fail ("palloc_get_multiple failed");
+  check_live (MEMSTAT_KERNEL, kernel_base + 3 * PGSIZE, "after palloc");
+  palloc_free_multiple (pages, 3);
+  check_live (MEMSTAT_KERNEL, kernel_base, "after palloc_free");
+  msg ("pages are accounted for");
+
+  /* Free a run of pages from the middle out. */
+  kernel_base = memstat_live (MEMSTAT_KERNEL);
+  pages = palloc_get_multiple (0, 3);
+  if (pages == NULL)
+    fail ("palloc_get_multiple failed");
+  palloc_free_page ((char *) pages + PGSIZE);
+  check_live (MEMSTAT_KERNEL, kernel_base + 2 * PGSIZE,
+              "after freeing middle page");
+  palloc_free_page (pages);
+  check_live (MEMSTAT_KERNEL, kernel_base + PGSIZE,
+              "after freeing first page");
+  palloc_free_page ((char *) pages + 2 * PGSIZE);
+  check_live (MEMSTAT_KERNEL, kernel_base, "after freeing last page");
+  msg ("partly freed pages are accounted for");
+
+  memstat_print (false);
+  pass ();
+}
@@ -0,0 +1,190 @@
+/* Runs the same random workload of multi-page allocations and
+   frees against the buddy allocator that backs palloc and against
+   a first-fit bitmap scan, the way palloc used to allocate, and
+   reports the time each takes per allocation and how fragmented
+   each leaves the pool.  Also checks that no two live runs
+   overlap. */
+
+#include <bitmap.h>
+#include <buddy.h>
+#include <random.h>
+#include <stdio.h>
+#include "tests/threads/tests.h"
+#include "threads/malloc.h"
+#include "devices/timer.h"
+
+/* Pages in the simulated pool, about a 64 MB user pool. */
+#define PAGE_CNT 16384
+
+/* Most runs live at once. */
+#define LIVE_MAX 4096
+
+/* Allocations and frees per workload. */
+#define OP_CNT 200000
+
+/* A live allocation. */
+struct run
+  {
+    size_t start;
+    size_t cnt;
+  };
+
+/* The allocator under test: either B or, if B is null, BITMAP. */
+struct alloc
+  {
+    struct buddy *b;
+    struct bitmap *bitmap;
+  };
+
+static void run_workload (const char *name, struct alloc *,
+                          struct bitmap *shadow, struct run *live);
+static size_t alloc_pages (struct alloc *, size_t cnt);
+static void free_pages (struct alloc *, size_t start, size_t cnt);
+static size_t largest_free_run (const struct bitmap *);
+
+void
+test_palloc_bench (void)
+{
+  struct alloc buddy, bitmap;
+  struct bitmap *shadow;
+  struct run *live;
+  void *buf;
+
+  buf = malloc (buddy_buf_size (PAGE_CNT));
+  shadow = bitmap_create (PAGE_CNT);
+  live = malloc (LIVE_MAX * sizeof *live);
+  bitmap.b = NULL;
+  bitmap.bitmap = bitmap_create (PAGE_CNT);
+  if (buf == NULL || shadow == NULL || live == NULL || bitmap.bitmap == NULL)
+    fail ("allocation failed");
+  buddy.b = buddy_create_in_buf (PAGE_CNT, 0, buf, buddy_buf_size (PAGE_CNT));
+  buddy.bitmap = NULL;
+  buddy_free (buddy.b, 0, PAGE_CNT);
+
+  run_workload ("buddy", &buddy, shadow, live);
+  run_workload ("bitmap", &bitmap, shadow, live);
+
+  bitmap_destroy (bitmap.bitmap);
+  bitmap_destroy (shadow);
+  free (live);
+  free (buf);
+  pass ();
+}
+
+/* Returns the number of pages for an allocation: usually one,
+   sometimes a few, now and then a large block. */
+static size_t
+random_cnt (void)
+{
+  unsigned long r = random_ulong () % 100;
+
+  if (r < 70)
+    return 1;
+  else if (r < 95)
+    return 2 + random_ulong () % 15;
+  else
+    return 32 + random_ulong () % 97;
+}
+
+/* Runs the workload against A, keeping SHADOW as a record of
+   which pages are allocated and LIVE as the list of live runs,
+   and reports the results under NAME.  The pool is driven towards
+   being about 80% full, then allocations and frees alternate at
+   random. */
+static void
+run_workload (const char *name, struct alloc *a, struct bitmap *shadow,
+              struct run *live)
+{
+  size_t live_cnt = 0, used = 0, failures = 0, allocs = 0;
+  int64_t alloc_ns = 0;
+  int i;
+
+  random_init (0);
+  bitmap_set_all (shadow, false);
+  for (i = 0; i < OP_CNT; i++)
+    {
+      bool grow = used < PAGE_CNT * 8 / 10 ? random_ulong () % 4 != 0
+                                           : random_ulong () % 4 == 0;
+
+      if (live_cnt == 0 || (grow && live_cnt < LIVE_MAX))
+        {
+          size_t cnt = random_cnt ();
+          int64_t start = timer_now_ns ();
+          size_t idx = alloc_pages (a, cnt);
+
+          alloc_ns += timer_now_ns () - start;
+          allocs++;
+          if (idx == BITMAP_ERROR)
+            {
+              failures++;
+              continue;
+            }
+          if (!bitmap_none (shadow, idx, cnt))
+            fail ("%s: run at page %zu overlaps a live run", name, idx);
+          bitmap_set_multiple (shadow, idx, cnt, true);
+          live[live_cnt].start = idx;
+          live[live_cnt].cnt = cnt;
+          live_cnt++;
+          used += cnt;
+        }
+      else
+        {
+          struct run *r = &live[random_ulong () % live_cnt];
+
+          free_pages (a, r->start, r->cnt);
+          bitmap_set_multiple (shadow, r->start, r->cnt, false);
+          used -= r->cnt;
+          *r = live[--live_cnt];
+        }
+    }
+
+  msg ("%s: %lld ns per allocation, %zu of %zu allocations failed, "
+       "largest free run %zu of %zu free pages",
+       name, alloc_ns / (int64_t) allocs, failures, allocs,
+       largest_free_run (shadow), (size_t) PAGE_CNT - used);
+
+  while (live_cnt > 0)
+    {
+      live_cnt--;
+      free_pages (a, live[live_cnt].start, live[live_cnt].cnt);
+    }
+  if (a->b != NULL
+      && buddy_largest (a->b) != (size_t) 1 << (BUDDY_ORDERS - 1))
+    fail ("%s: freed pages did not coalesce", name);
+}
+
+/* Allocates CNT pages from A and returns the first one, or
+   BITMAP_ERROR on failure. */
+static size_t
+alloc_pages (struct alloc *a, size_t cnt)
+{
+  if (a->b != NULL)
+    return buddy_alloc (a->b, cnt);
+  else
+    return bitmap_scan_and_flip (a->bitmap, 0, cnt, false);
+}
+
+/* Frees the CNT pages starting at START in A. */
+static void
+free_pages (struct alloc *a, size_t start, size_t cnt)
+{
+  if (a->b != NULL)
+    buddy_free (a->b, start, cnt);
+  else
+    bitmap_set_multiple (a->bitmap, start, cnt, false);
+}
+
+/* Returns the length of the longest run of false bits in B. */
+static size_t
+largest_free_run (const struct bitmap *b)
+{
+  size_t i, run = 0, best = 0;
+
+  for (i = 0; i < bitmap_size (b); i++)
+    {
+      run = bitmap_test (b, i) ? 0 : run + 1;
+      if (run > best)
+        best = run;
+    }
+  return best;
+}
@@ -0,0 +1,85 @@
+/* Measures how late timer_sleep_ns() wakes up for a range of
+   durations and slack settings, compared with timer_usleep(), and
+   reports the distribution of the lateness.  Also checks that
+   timer_sleep_ns() never wakes up early. */
+
+#include <stdio.h>
+#include "tests/threads/tests.h"
+#include "devices/timer.h"
+
+/* Sleeps measured per configuration. */
+#define SAMPLES 20
+
+/* Nanoseconds per timer tick. */
+#define TICK_NS (1000000000LL / TIMER_FREQ)
+
+static void measure (const char *name, int64_t ns, int64_t slack);
+static void report (const char *name, int64_t ns, int64_t late[]);
+
+void
+test_sleep_precise (void)
+{
+  static const int64_t durations[] = {100000, 1000000, TICK_NS * 3 / 2,
+                                      TICK_NS * 5};
+  size_t i;
+
+  for (i = 0; i < sizeof durations / sizeof *durations; i++)
+    {
+      int64_t ns = durations[i];
+
+      measure ("timer_usleep", ns, -1);
+      measure ("slack 0", ns, 0);
+      measure ("slack 100us", ns, 100000);
+      measure ("slack 1 tick", ns, TICK_NS);
+    }
+  pass ();
+}
+
+/* Sleeps SAMPLES times for NS nanoseconds, with timer_sleep_ns()
+   and SLACK or, if SLACK is negative, with timer_usleep(), and
+   reports how late each sleep ended. */
+static void
+measure (const char *name, int64_t ns, int64_t slack)
+{
+  int64_t late[SAMPLES];
+  int i;
+
+  /* Start each run just after a tick, as a thread woken by the
+     timer would. */
+  timer_sleep (1);
+  for (i = 0; i < SAMPLES; i++)
+    {
+      int64_t start = timer_now_ns ();
+
+      if (slack < 0)
+        timer_usleep (ns / 1000);
+      else
+        timer_sleep_ns (ns, slack);
+      late[i] = timer_now_ns () - (start + ns);
+      if (slack >= 0 && late[i] < 0)
+        fail ("%s, %lld us: woke %lld ns early",
+              name, ns / 1000, -late[i]);
+    }
+  report (name, ns, late);
+}
+
+/* Sorts LATE and prints its minimum, median, 90th percentile, and
+   maximum, in microseconds. */
+static void
+report (const char *name, int64_t ns, int64_t late[])
+{
+  int i, j;
+
+  for (i = 1; i < SAMPLES; i++)
+    for (j = i; j > 0 && late[j - 1] > late[j]; j--)
+      {
+        int64_t t = late[j];
+        late[j] = late[j - 1];
+        late[j - 1] = t;
+      }
+
+  msg ("%lld us, %s: lateness min %lld us, median %lld us, "
+       "p90 %lld us, max %lld us",
+       ns / 1000, name, late[0] / 1000, late[SAMPLES / 2] / 1000,
+       late[SAMPLES * 9 / 10] / 1000, late[SAMPLES - 1] / 1000);
+}
@@ -38,6 +38,11 @@ static const struct test tests[] =
     {"mlfqs-nice-2", test_mlfqs_nice_2},
     {"mlfqs-nice-10", test_mlfqs_nice_10},
     {"mlfqs-block", test_mlfqs_block},
+    {"bitmap-bench", test_bitmap_bench},
+    {"sleep-precise", test_sleep_precise},
+    {"palloc-bench", test_palloc_bench},
+    {"malloc-bench", test_malloc_bench},
+    {"memstat-account", test_memstat_account},
   };
 
 static const char *test_name;
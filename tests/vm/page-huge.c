@@ -0,0 +1,36 @@
+/* Fills 6 MB of memory, enough for at least two 2 MB-aligned
+   regions that the kernel may map with huge pages, with a value
+   that differs for each page and each word, and verifies it. */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SIZE (6 * 1024 * 1024)
+#define PAGE_SIZE 4096
+
+static uint32_t buf[SIZE / sizeof (uint32_t)];
+
+/* Returns the value expected in word I of BUF. */
+static uint32_t
+value (size_t i)
+{
+  return (uint32_t) (i / (PAGE_SIZE / sizeof *buf)) * 0x9e3779b9u ^ i;
+}
+
+void
+test_main (void)
+{
+  size_t i;
+
+  msg ("write pass");
+  for (i = 0; i < SIZE / sizeof *buf; i++)
+    buf[i] = value (i);
+
+  msg ("read pass");
+  for (i = 0; i < SIZE / sizeof *buf; i++)
+    if (buf[i] != value (i))
+      fail ("word %zu is %#"PRIx32", expected %#"PRIx32,
+            i, buf[i], value (i));
+}
@@ -0,0 +1,77 @@
+/* Forks 4 children that each fill the same pages with the same
+   contents, half zeros and half a table, and read them over and
+   over, so that the kernel may merge the children's copies.  Each
+   child then writes its own byte into every page and checks that
+   it sees its own byte and nobody else's. */
+
+#include <stdint.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define CHILD_CNT 4
+#define PAGE_SIZE 4096
+#define PAGE_CNT 32
+#define ROUNDS 50
+
+static uint8_t buf[PAGE_CNT][PAGE_SIZE] __attribute__ ((aligned (PAGE_SIZE)));
+
+/* Returns the byte expected at offset OFS of page PAGE, before any
+   child writes its own byte to it. */
+static uint8_t
+value (int page, int ofs)
+{
+  return page < PAGE_CNT / 2 ? 0 : (uint8_t) (ofs * 7 + page);
+}
+
+/* Checks that every page holds its expected bytes, except for ID
+   as its first byte if ID is nonzero. */
+static void
+check (int id)
+{
+  int page, ofs;
+
+  for (page = 0; page < PAGE_CNT; page++)
+    for (ofs = 0; ofs < PAGE_SIZE; ofs++)
+      {
+        uint8_t expected = ofs == 0 && id != 0 ? id : value (page, ofs);
+
+        if (buf[page][ofs] != expected)
+          fail ("child %d: page %d offset %d is %d, expected %d",
+                id, page, ofs, buf[page][ofs], expected);
+      }
+}
+
+/* Runs child ID. */
+static void
+child (int id)
+{
+  int page, ofs, i;
+
+  for (page = 0; page < PAGE_CNT; page++)
+    for (ofs = 0; ofs < PAGE_SIZE; ofs++)
+      buf[page][ofs] = value (page, ofs);
+  for (i = 0; i < ROUNDS; i++)
+    check (0);
+
+  for (page = 0; page < PAGE_CNT; page++)
+    buf[page][0] = id;
+  check (id);
+  exit (id);
+}
+
+void
+test_main (void)
+{
+  pid_t children[CHILD_CNT];
+  int i;
+
+  for (i = 0; i < CHILD_CNT; i++)
+    {
+      children[i] = fork ("page-ksm");
+      if (children[i] == 0)
+        child (i + 1);
+    }
+  for (i = 0; i < CHILD_CNT; i++)
+    CHECK (wait (children[i]) == i + 1, "wait for child %d", i);
+}
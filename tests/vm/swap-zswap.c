@@ -0,0 +1,65 @@
+/* Fills 16 MB of memory, more than fits in 10 MB of RAM, with
+   pages that alternate between a short repeated pattern, which
+   compresses well, and pseudo-random data, which does not, and
+   then verifies it.  Run with a small compressed swap pool, so
+   that compressed pages are written back to the swap disk too. */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define SIZE (16 * 1024 * 1024)
+#define PAGE_SIZE 4096
+#define PAGE_WORDS (PAGE_SIZE / sizeof (uint32_t))
+#define PAGE_CNT (SIZE / PAGE_SIZE)
+
+static uint32_t buf[SIZE / sizeof (uint32_t)];
+
+/* Fills or, if CHECK, verifies page PAGE of BUF. */
+static void
+do_page (size_t page, bool check)
+{
+  uint32_t *p = buf + page * PAGE_WORDS;
+  uint32_t x = page * 0x9e3779b9u + 1;
+  size_t i;
+
+  for (i = 0; i < PAGE_WORDS; i++)
+    {
+      uint32_t v;
+
+      if (page % 2 == 0)
+        v = page ^ (i % 8);
+      else
+        {
+          x ^= x << 13;
+          x ^= x >> 17;
+          x ^= x << 5;
+          v = x;
+        }
+
+      if (!check)
+        p[i] = v;
+      else if (p[i] != v)
+        fail ("page %zu word %zu is %#"PRIx32" instead of %#"PRIx32,
+              page, i, p[i], v);
+    }
+}
+
+void
+test_main (void)
+{
+  size_t page;
+
+  msg ("write pass");
+  for (page = 0; page < PAGE_CNT; page++)
+    do_page (page, false);
+
+  msg ("check pass");
+  for (page = 0; page < PAGE_CNT; page++)
+    do_page (page, true);
+
+  msg ("check pass, in reverse");
+  for (page = PAGE_CNT; page-- > 0; )
+    do_page (page, true);
+}
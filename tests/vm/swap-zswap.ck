@@ -0,0 +1,12 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(swap-zswap) begin
+(swap-zswap) write pass
+(swap-zswap) check pass
+(swap-zswap) check pass, in reverse
+(swap-zswap) end
+EOF
+pass;
@@ -1,6 +1,7 @@
 #include "threads/init.h"
 #include <console.h>
 #include <debug.h>
+#include <klog.h>
 #include <limits.h>
 #include <random.h>
 #include <stddef.h>
@@ -17,8 +18,10 @@
 #include "threads/io.h"
 #include "threads/loader.h"
 #include "threads/malloc.h"
+#include "threads/memstat.h"
 #include "threads/mmu.h"
 #include "threads/palloc.h"
+#include "threads/slab.h"
 #include "threads/pte.h"
 #include "threads/thread.h"
 #ifdef USERPROG
@@ -30,7 +33,9 @@
 #endif
 #include "tests/threads/tests.h"
 #ifdef VM
+#include "vm/ksm.h"
 #include "vm/vm.h"
+#include "vm/zswap.h"
 #endif
 #ifdef FILESYS
 #include "devices/disk.h"
@@ -85,6 +90,7 @@ main (void) {
 	/* Initialize memory system. */
 	mem_end = palloc_init ();
 	malloc_init ();
+	memstat_init ();
 	paging_init (mem_end);
 
 #ifdef USERPROG
@@ -105,6 +111,7 @@ main (void) {
 	thread_start ();
 	serial_init_queue ();
 	timer_calibrate ();
+	klog_init ();
 
 #ifdef FILESYS
 	/* Initialize file system. */
@@ -165,6 +172,7 @@ paging_init (uint64_t mem_end) {
 
 	// reload cr3
 	pml4_activate(0);
+	pcid_init ();
 }
 
 /* Breaks the kernel command line into words and returns them as
@@ -216,16 +224,28 @@ parse_options (char **argv) {
 #ifdef FILESYS
 		else if (!strcmp (name, "-f"))
 			format_filesys = true;
+		else if (!strcmp (name, "-fs-disks"))
+			filesys_set_disks (value);
 #endif
 		else if (!strcmp (name, "-rs"))
 			random_init (atoi (value));
 		else if (!strcmp (name, "-mlfqs"))
 			thread_mlfqs = true;
+		else if (!strcmp (name, "-icanon"))
+			input_set_line_mode (true);
+		else if (!strcmp (name, "-memstat"))
+			memstat_configure (value);
 #ifdef USERPROG
 		else if (!strcmp (name, "-ul"))
 			user_page_limit = atoi (value);
 		else if (!strcmp (name, "-threads-tests"))
 			thread_tests = true;
+#endif
+#ifdef VM
+		else if (!strcmp (name, "-zswap"))
+			zswap_pool_limit = atoi (value);
+		else if (!strcmp (name, "-ksm"))
+			ksm_configure (value);
 #endif
 		else
 			PANIC ("unknown option `%s' (use -h for help)", name);
@@ -324,10 +344,23 @@ usage (void) {
 			"  -h                 Print this help message and power off.\n"
 			"  -q                 Power off VM after actions or on panic.\n"
 			"  -f                 Format file system disk during startup.\n"
+#ifdef FILESYS
+			"  -fs-disks=LIST     With -f, stripe file system over disks in LIST,\n"
+			"                     e.g. 0:1,1:0 (default: 0:1).\n"
+#endif
 			"  -rs=SEED           Set random number seed to SEED.\n"
 			"  -mlfqs             Use multi-level feedback queue scheduler.\n"
+			"  -icanon            Read console input a line at a time.\n"
+			"  -memstat[=leaks]   Account for memory by allocation site; with\n"
+			"                     leaks, report live allocations at thread exit.\n"
 #ifdef USERPROG
 			"  -ul=COUNT          Limit user memory to COUNT pages.\n"
+#endif
+#ifdef VM
+			"  -zswap=COUNT       Keep up to COUNT pages of compressed swap in\n"
+			"                     memory (default: 128; 0 to turn off).\n"
+			"  -ksm[=PAGES[,MS]]  Merge identical anonymous pages, scanning PAGES\n"
+			"                     frames every MS ms (default: 100,20).\n"
 #endif
 			);
 	power_off ();
@@ -354,12 +387,19 @@ static void
 print_stats (void) {
 	timer_print_stats ();
 	thread_print_stats ();
+	kmem_print_stats ();
+	memstat_print (true);
 #ifdef FILESYS
 	disk_print_stats ();
 #endif
 	console_print_stats ();
+	klog_print_stats ();
 	kbd_print_stats ();
 #ifdef USERPROG
 	exception_print_stats ();
 #endif
+#ifdef VM
+	zswap_print_stats ();
+	ksm_print_stats ();
+#endif
 }
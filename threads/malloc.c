@@ -5,8 +5,11 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include "threads/memstat.h"
 #include "threads/palloc.h"
+#include "threads/slab.h"
 #include "threads/synch.h"
+#include "threads/thread.h"
 #include "threads/vaddr.h"
 
 /* A simple implementation of malloc().
@@ -32,7 +35,30 @@
    because they're too big to fit in a single page with a
    descriptor.  We handle those by allocating contiguous pages
    with the page allocator and sticking the allocation size at
-   the beginning of the allocated block's arena header. */
+   the beginning of the allocated block's arena header.
+
+   To keep threads from contending for a descriptor's lock, each
+   thread also caches free blocks of each size in a "magazine", a
+   small stack of blocks that only it touches.  malloc() pops a
+   block from the thread's magazine and free() pushes one onto it,
+   without locking.  Only when the magazine is empty (or full) do
+   they take the lock, to swap the magazine for a full (or empty)
+   one kept in the descriptor's "depot", or to fall back on the
+   free list.  Blocks in magazines count as in use as far as their
+   arenas are concerned. */
+
+/* Blocks a magazine holds. */
+#define MAG_ROUNDS 13
+
+/* Empty magazines a depot keeps. */
+#define DEPOT_EMPTY_MAX 4
+
+/* A magazine of free blocks of one size. */
+struct magazine {
+	struct list_elem elem;      /* Element in a depot list. */
+	size_t cnt;                 /* Number of blocks in ROUNDS. */
+	void *rounds[MAG_ROUNDS];   /* Free blocks. */
+};
 
 /* Descriptor. */
 struct desc {
@@ -40,6 +66,11 @@ struct desc {
 	size_t blocks_per_arena;    /* Number of blocks in an arena. */
 	struct list free_list;      /* List of free blocks. */
 	struct lock lock;           /* Lock. */
+
+	/* Depot. */
+	struct list full_mags;      /* Full magazines. */
+	struct list empty_mags;     /* Empty magazines. */
+	size_t empty_mag_cnt;       /* Number of magazines in EMPTY_MAGS. */
 };
 
 /* Magic number for detecting arena corruption. */
@@ -58,11 +89,23 @@ struct block {
 };
 
 /* Our set of descriptors. */
-static struct desc descs[10];   /* Descriptors. */
+static struct desc descs[MALLOC_CLASS_CNT];   /* Descriptors. */
 static size_t desc_cnt;         /* Number of descriptors. */
 
+/* Cache of magazines. */
+static struct kmem_cache *mag_cache;
+
+/* Whether malloc() and free() use magazines. */
+static bool use_magazines = true;
+
 static struct arena *block_to_arena (struct block *);
 static struct block *arena_to_block (struct arena *, size_t idx);
+static void *do_malloc (size_t);
+static void *alloc_locked (struct desc *);
+static void free_locked (struct desc *, struct block *);
+static struct magazine *get_empty_mag (struct desc *);
+static void put_empty_mag (struct desc *, struct magazine *);
+static void empty_mag (struct desc *, struct magazine *);
 
 /* Initializes the malloc() descriptors. */
 void
@@ -76,14 +119,35 @@ malloc_init (void) {
 		d->blocks_per_arena = (PGSIZE - sizeof (struct arena)) / block_size;
 		list_init (&d->free_list);
 		lock_init (&d->lock);
+		list_init (&d->full_mags);
+		list_init (&d->empty_mags);
+		d->empty_mag_cnt = 0;
 	}
+	ASSERT (desc_cnt == MALLOC_CLASS_CNT);
+
+	/* The object caches are built on malloc(), and magazines on
+	   them. */
+	kmem_init ();
+	mag_cache = kmem_cache_create ("magazine", sizeof (struct magazine),
+			NULL);
 }
 
 /* Obtains and returns a new block of at least SIZE bytes.
    Returns a null pointer if memory is not available. */
 void *
 malloc (size_t size) {
+	void *p = do_malloc (size);
+
+	memstat_alloc (MEMSTAT_MALLOC, p, size, __builtin_return_address (0));
+	return p;
+}
+
+/* Does the work of malloc(), which accounts for the block under
+   its own caller. */
+static void *
+do_malloc (size_t size) {
 	struct desc *d;
+	struct magazine **m;
 	struct block *b;
 	struct arena *a;
 
@@ -112,18 +176,43 @@ malloc (size_t size) {
 		return a + 1;
 	}
 
+	/* Take a block from our magazine, if it has one. */
+	m = &thread_current ()->mags[d - descs];
+	if (*m != NULL && (*m)->cnt > 0 && use_magazines)
+		return (*m)->rounds[--(*m)->cnt];
+
 	lock_acquire (&d->lock);
 
+	/* Trade in our magazine for a full one from the depot, if
+	   there is one, or else take a block from the free list. */
+	if (!list_empty (&d->full_mags) && use_magazines) {
+		if (*m != NULL)
+			put_empty_mag (d, *m);
+		*m = list_entry (list_pop_front (&d->full_mags),
+				struct magazine, elem);
+		b = (*m)->rounds[--(*m)->cnt];
+	} else
+		b = alloc_locked (d);
+	lock_release (&d->lock);
+	return b;
+}
+
+/* Obtains a block from D's free list, creating a new arena if
+   it is empty, and returns it.  Returns a null pointer if memory
+   is not available.  D's lock must be held. */
+static void *
+alloc_locked (struct desc *d) {
+	struct block *b;
+	struct arena *a;
+
 	/* If the free list is empty, create a new arena. */
 	if (list_empty (&d->free_list)) {
 		size_t i;
 
 		/* Allocate a page. */
 		a = palloc_get_page (0);
-		if (a == NULL) {
-			lock_release (&d->lock);
+		if (a == NULL)
 			return NULL;
-		}
 
 		/* Initialize arena and add its blocks to the free list. */
 		a->magic = ARENA_MAGIC;
@@ -139,7 +228,6 @@ malloc (size_t size) {
 	b = list_entry (list_pop_front (&d->free_list), struct block, free_elem);
 	a = block_to_arena (b);
 	a->free_cnt--;
-	lock_release (&d->lock);
 	return b;
 }
 
@@ -156,9 +244,10 @@ calloc (size_t a, size_t b) {
 		return NULL;
 
 	/* Allocate and zero memory. */
-	p = malloc (size);
+	p = do_malloc (size);
 	if (p != NULL)
 		memset (p, 0, size);
+	memstat_alloc (MEMSTAT_MALLOC, p, size, __builtin_return_address (0));
 
 	return p;
 }
@@ -185,7 +274,9 @@ realloc (void *old_block, size_t new_size) {
 		free (old_block);
 		return NULL;
 	} else {
-		void *new_block = malloc (new_size);
+		void *new_block = do_malloc (new_size);
+		memstat_alloc (MEMSTAT_MALLOC, new_block, new_size,
+				__builtin_return_address (0));
 		if (old_block != NULL && new_block != NULL) {
 			size_t old_size = block_size (old_block);
 			size_t min_size = new_size < old_size ? new_size : old_size;
@@ -200,6 +291,7 @@ realloc (void *old_block, size_t new_size) {
    malloc(), calloc(), or realloc(). */
 void
 free (void *p) {
+	memstat_free (p);
 	if (p != NULL) {
 		struct block *b = p;
 		struct arena *a = block_to_arena (b);
@@ -208,27 +300,33 @@ free (void *p) {
 		if (d != NULL) {
 			/* It's a normal block.  We handle it here. */
 
+			struct magazine **m = &thread_current ()->mags[d - descs];
+			struct magazine *empty;
+
 #ifndef NDEBUG
 			/* Clear the block to help detect use-after-free bugs. */
 			memset (b, 0xcc, d->block_size);
 #endif
 
-			lock_acquire (&d->lock);
+			/* Put the block in our magazine, if it has room. */
+			if (*m != NULL && (*m)->cnt < MAG_ROUNDS && use_magazines) {
+				(*m)->rounds[(*m)->cnt++] = b;
+				return;
+			}
 
-			/* Add block to free list. */
-			list_push_front (&d->free_list, &b->free_elem);
+			lock_acquire (&d->lock);
 
-			/* If the arena is now entirely unused, free it. */
-			if (++a->free_cnt >= d->blocks_per_arena) {
-				size_t i;
-
-				ASSERT (a->free_cnt == d->blocks_per_arena);
-				for (i = 0; i < d->blocks_per_arena; i++) {
-					struct block *b = arena_to_block (a, i);
-					list_remove (&b->free_elem);
-				}
-				palloc_free_page (a);
-			}
+			/* Trade in our full magazine, if any, for an empty one
+			   and put the block there, or else put the block back
+			   on the free list. */
+			empty = use_magazines ? get_empty_mag (d) : NULL;
+			if (empty != NULL) {
+				if (*m != NULL)
+					list_push_back (&d->full_mags, &(*m)->elem);
+				*m = empty;
+				empty->rounds[empty->cnt++] = b;
+			} else
+				free_locked (d, b);
 
 			lock_release (&d->lock);
 		} else {
@@ -239,6 +337,132 @@ free (void *p) {
 	}
 }
 
+/* Returns block B, which belongs to D, to D's free list, and
+   frees its arena if no block in it remains in use.  D's lock
+   must be held. */
+static void
+free_locked (struct desc *d, struct block *b) {
+	struct arena *a = block_to_arena (b);
+
+	/* Add block to free list. */
+	list_push_front (&d->free_list, &b->free_elem);
+
+	/* If the arena is now entirely unused, free it. */
+	if (++a->free_cnt >= d->blocks_per_arena) {
+		size_t i;
+
+		ASSERT (a->free_cnt == d->blocks_per_arena);
+		for (i = 0; i < d->blocks_per_arena; i++) {
+			struct block *b = arena_to_block (a, i);
+			list_remove (&b->free_elem);
+		}
+		palloc_free_page (a);
+	}
+}
+
+/* Returns an empty magazine from D's depot, or a new one if the
+   depot has none, or a null pointer if memory is not available.
+   D's lock must be held. */
+static struct magazine *
+get_empty_mag (struct desc *d) {
+	struct magazine *m;
+
+	if (!list_empty (&d->empty_mags)) {
+		d->empty_mag_cnt--;
+		return list_entry (list_pop_front (&d->empty_mags),
+				struct magazine, elem);
+	}
+	if (mag_cache == NULL)
+		return NULL;
+	m = kmem_cache_alloc (mag_cache);
+	if (m != NULL)
+		m->cnt = 0;
+	return m;
+}
+
+/* Puts M, which must be empty, in D's depot, or frees it if the
+   depot has enough empty magazines.  D's lock must be held. */
+static void
+put_empty_mag (struct desc *d, struct magazine *m) {
+	ASSERT (m->cnt == 0);
+	if (d->empty_mag_cnt < DEPOT_EMPTY_MAX) {
+		list_push_front (&d->empty_mags, &m->elem);
+		d->empty_mag_cnt++;
+	} else
+		kmem_cache_free (mag_cache, m);
+}
+
+/* Returns the blocks in magazine M, which belongs to D, to D's
+   free list, leaving M empty.  D's lock must be held. */
+static void
+empty_mag (struct desc *d, struct magazine *m) {
+	while (m->cnt > 0)
+		free_locked (d, m->rounds[--m->cnt]);
+}
+
+/* Returns the current thread's magazines to the depots.  Called
+   when the thread exits, since the magazines would otherwise be
+   lost along with it.  Partly filled magazines are emptied into
+   the free lists. */
+void
+malloc_thread_exit (void) {
+	struct thread *t = thread_current ();
+	size_t i;
+
+	for (i = 0; i < desc_cnt; i++) {
+		struct desc *d = &descs[i];
+		struct magazine *m = t->mags[i];
+
+		if (m == NULL)
+			continue;
+		t->mags[i] = NULL;
+		lock_acquire (&d->lock);
+		if (m->cnt == MAG_ROUNDS)
+			list_push_back (&d->full_mags, &m->elem);
+		else {
+			empty_mag (d, m);
+			put_empty_mag (d, m);
+		}
+		lock_release (&d->lock);
+	}
+}
+
+/* Returns the blocks in the depots' full magazines to the free
+   lists, so that arenas left with no block in use go back to the
+   page allocator.  For use when it runs short.  Skips descriptors
+   that are busy, including any whose lock the caller holds.
+   Returns the number of blocks returned. */
+size_t
+malloc_reap (void) {
+	size_t i, cnt = 0;
+
+	for (i = 0; i < desc_cnt; i++) {
+		struct desc *d = &descs[i];
+
+		if (lock_held_by_current_thread (&d->lock)
+				|| !lock_try_acquire (&d->lock))
+			continue;
+		while (!list_empty (&d->full_mags)) {
+			struct magazine *m = list_entry (list_pop_front (&d->full_mags),
+					struct magazine, elem);
+
+			cnt += m->cnt;
+			empty_mag (d, m);
+			put_empty_mag (d, m);
+		}
+		lock_release (&d->lock);
+	}
+	return cnt;
+}
+
+/* Turns magazines on or off, for comparing performance.  While
+   they are off, every malloc() and free() goes through the
+   descriptors' locked free lists. */
+void
+malloc_set_magazines (bool on) {
+	use_magazines = on;
+}
+
 /* Returns the arena that block B is inside. */
 static struct arena *
 block_to_arena (struct block *b) {
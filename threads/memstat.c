@@ -0,0 +1,445 @@
+#include "threads/memstat.h"
+#include <debug.h>
+#include <inttypes.h>
+#include <round.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/interrupt.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* Memory accounting by allocation site.
+
+   When enabled with the -memstat kernel option, malloc() and the
+   page allocator report each allocation and free here.  An
+   allocation is charged to its "site", the return address of the
+   call to malloc(), calloc(), realloc(), palloc_get_page(), or
+   palloc_get_multiple(), which the `backtrace' program can turn
+   into a function and line.  For each site we keep the bytes now
+   allocated, the most ever allocated at once, and the number of
+   allocations and frees.
+
+   To charge a free to the right site, we keep a table of live
+   allocations, keyed by address, that records each one's site,
+   size, and allocating thread.  The table is a fixed-size hash
+   table with linear probing, so that accounting never itself
+   allocates memory.  Allocations that do not fit in it, and those
+   made before memstat_init(), are not accounted for.
+
+   With -memstat=leaks, each exiting thread also reports the
+   allocations it made that are still live, which are likely but
+   not certain to be leaks, since some objects outlive the thread
+   that creates them.
+
+   Pages that malloc() and the object caches carve up are charged
+   to the sites in those allocators that obtain them, so that
+   kernel page totals include the memory behind malloc() blocks.
+
+   A run of pages need not be freed all at once: the pages of a
+   huge page, for one, may be freed one by one once it is split.
+   Freeing part of a run uncharges just that part, and the rest
+   stays live, as one or two smaller runs, until it is freed too.
+   A free is counted each time the last page of such a run goes.
+
+   The tables are protected by disabling interrupts, since the page
+   allocator does the same. */
+
+/* Number of allocation sites tracked.  Site 0 is not a real site:
+   allocations from sites that do not fit are charged to it. */
+#define SITE_CNT 256
+
+/* Log2 of the number of slots in the live allocation table, which
+   is filled to at most 3/4 of its slots. */
+#define LIVE_BITS 14
+#define LIVE_CNT ((size_t) 1 << LIVE_BITS)
+#define LIVE_MAX (LIVE_CNT / 4 * 3)
+
+/* Most allocations listed by a thread's leak report. */
+#define LEAK_LIST_MAX 8
+
+/* An allocation site. */
+struct site {
+	const void *caller;         /* Return address of the call. */
+	enum memstat_kind kind;     /* Kind of memory allocated. */
+	size_t live;                /* Bytes now allocated. */
+	size_t peak;                /* Most bytes allocated at once. */
+	unsigned long long alloc_cnt;   /* Allocations made. */
+	unsigned long long free_cnt;    /* Allocations freed. */
+};
+
+/* A live allocation. */
+struct live {
+	const void *ptr;            /* Address, or null if slot is free. */
+	uint32_t bytes;             /* Size. */
+	uint16_t site;              /* Index in sites[]. */
+	uint8_t kind;               /* Kind of memory. */
+	tid_t tid;                  /* Allocating thread. */
+};
+
+static const char *kind_names[MEMSTAT_KIND_CNT] = {
+	"malloc", "kernel", "user",
+};
+
+/* Set by memstat_configure(). */
+static bool enabled;            /* Accounting requested. */
+static bool report_exits;       /* Leak reports on thread exit. */
+
+/* Sites, and totals for each kind of memory. */
+static struct site sites[SITE_CNT];
+static struct site totals[MEMSTAT_KIND_CNT];
+
+/* Live allocations, or null if accounting is off. */
+static struct live *live;
+static size_t live_cnt;
+
+/* Allocations not accounted for because LIVE was full. */
+static unsigned long long untracked_cnt;
+
+/* Bytes in the largest run of pages ever accounted for, which
+   bounds the search for the run that contains a page. */
+static size_t max_page_run;
+
+/* Serializes memstat_print(), which uses a static buffer. */
+static struct lock print_lock;
+
+/* Configures accounting from the -memstat kernel command-line
+   option's VALUE: null to account for memory, or "leaks" to also
+   report each exiting thread's live allocations. */
+void
+memstat_configure (const char *value) {
+	enabled = true;
+	if (value != NULL) {
+		if (!strcmp (value, "leaks"))
+			report_exits = true;
+		else
+			PANIC ("unknown -memstat value `%s'", value);
+	}
+}
+
+/* Sets up the live allocation table and starts accounting, if
+   memstat_configure() requested it.  Must be called after the page
+   allocator is initialized. */
+void
+memstat_init (void) {
+	size_t page_cnt = DIV_ROUND_UP (LIVE_CNT * sizeof *live, PGSIZE);
+
+	lock_init (&print_lock);
+	if (!enabled)
+		return;
+
+	live = palloc_get_multiple (PAL_ZERO, page_cnt);
+	if (live == NULL)
+		printf ("memstat: no memory for accounting, so it is off\n");
+}
+
+/* Returns a hash of pointer P within a table of 2**BITS slots. */
+static inline size_t
+hash_ptr (const void *p, int bits) {
+	return ((uintptr_t) p >> 3) * 0x9e3779b97f4a7c15ULL >> (64 - bits);
+}
+
+/* Returns the index of the site for CALLER allocating KIND,
+   adding it if it is new. */
+static size_t
+find_site (enum memstat_kind kind, const void *caller) {
+	size_t i = hash_ptr (caller, 8) % SITE_CNT;
+	size_t probes;
+
+	for (probes = 0; probes < SITE_CNT; probes++) {
+		struct site *s = &sites[i];
+
+		if (i != 0) {
+			if (s->caller == NULL) {
+				s->caller = caller;
+				s->kind = kind;
+				return i;
+			} else if (s->caller == caller && s->kind == kind)
+				return i;
+		}
+		i = (i + 1) % SITE_CNT;
+	}
+	return 0;
+}
+
+/* Adds BYTES to the live bytes of S, updating its peak. */
+static void
+charge (struct site *s, size_t bytes) {
+	s->live += bytes;
+	if (s->live > s->peak)
+		s->peak = s->live;
+	s->alloc_cnt++;
+}
+
+/* Subtracts BYTES from the live bytes of S, counting a free if
+   FREED. */
+static void
+uncharge (struct site *s, size_t bytes, bool freed) {
+	s->live -= bytes;
+	if (freed)
+		s->free_cnt++;
+}
+
+/* Adds ENTRY to the live table.  Returns false, without adding
+   it, if the table is full. */
+static bool
+add_live (const struct live *entry) {
+	size_t i;
+
+	if (live_cnt >= LIVE_MAX)
+		return false;
+	for (i = hash_ptr (entry->ptr, LIVE_BITS); live[i].ptr != NULL;
+			i = (i + 1) & (LIVE_CNT - 1))
+		ASSERT (live[i].ptr != entry->ptr);
+	live[i] = *entry;
+	live_cnt++;
+	return true;
+}
+
+/* Returns the slot of the allocation at P in the live table, or
+   LIVE_CNT if there is none. */
+static size_t
+find_live (const void *p) {
+	size_t i;
+
+	for (i = hash_ptr (p, LIVE_BITS); live[i].ptr != NULL;
+			i = (i + 1) & (LIVE_CNT - 1))
+		if (live[i].ptr == p)
+			return i;
+	return LIVE_CNT;
+}
+
+/* Accounts for the allocation of BYTES bytes of KIND memory at P
+   by the call that returns to CALLER.  Does nothing if P is null
+   or accounting is off. */
+void
+memstat_alloc (enum memstat_kind kind, const void *p, size_t bytes,
+		const void *caller) {
+	enum intr_level old_level;
+	struct live entry;
+
+	if (live == NULL || p == NULL)
+		return;
+
+	old_level = intr_disable ();
+	if (live_cnt < LIVE_MAX) {
+		entry.ptr = p;
+		entry.bytes = bytes;
+		entry.site = find_site (kind, caller);
+		entry.kind = kind;
+		entry.tid = thread_current ()->tid;
+		add_live (&entry);
+		charge (&sites[entry.site], bytes);
+		charge (&totals[kind], bytes);
+		if (kind != MEMSTAT_MALLOC && bytes > max_page_run)
+			max_page_run = bytes;
+	} else
+		untracked_cnt++;
+	intr_set_level (old_level);
+}
+
+/* Removes the allocation in slot I from the live table, moving
+   later entries in its probe sequence back into the hole. */
+static void
+remove_live (size_t i) {
+	size_t j = i;
+
+	for (;;) {
+		size_t home;
+
+		j = (j + 1) & (LIVE_CNT - 1);
+		if (live[j].ptr == NULL)
+			break;
+
+		/* Move J into the hole at I if I lies on J's probe
+		   sequence, that is, between J's home slot and J. */
+		home = hash_ptr (live[j].ptr, LIVE_BITS);
+		if (((j - home) & (LIVE_CNT - 1)) >= ((j - i) & (LIVE_CNT - 1))) {
+			live[i] = live[j];
+			i = j;
+		}
+	}
+	live[i].ptr = NULL;
+	live_cnt--;
+}
+
+/* Accounts for freeing the allocation at P.  Does nothing if P
+   was not accounted for when it was allocated. */
+void
+memstat_free (const void *p) {
+	enum intr_level old_level;
+	size_t i;
+
+	if (live == NULL || p == NULL)
+		return;
+
+	old_level = intr_disable ();
+	i = find_live (p);
+	if (i != LIVE_CNT) {
+		uncharge (&sites[live[i].site], live[i].bytes, true);
+		uncharge (&totals[live[i].kind], live[i].bytes, true);
+		remove_live (i);
+	}
+	intr_set_level (old_level);
+}
+
+/* Accounts for freeing the BYTES bytes of pages at PAGES, which
+   may be all of a run of pages allocated together or only part of
+   one.  Does nothing if the run was not accounted for when it was
+   allocated. */
+void
+memstat_free_pages (const void *pages, size_t bytes) {
+	const uint8_t *p = pages;
+	enum intr_level old_level;
+	size_t back, i = LIVE_CNT;
+
+	if (live == NULL || p == NULL)
+		return;
+
+	old_level = intr_disable ();
+
+	/* Find the run that contains P by looking for its start, one
+	   page further back at a time. */
+	for (back = 0; back < max_page_run; back += PGSIZE) {
+		i = find_live (p - back);
+		if (i != LIVE_CNT && live[i].kind != MEMSTAT_MALLOC)
+			break;
+		i = LIVE_CNT;
+	}
+
+	if (i != LIVE_CNT && back < live[i].bytes) {
+		struct live run = live[i], head = run, tail = run;
+		size_t freed;
+
+		/* Free the run, then put back whatever lies before and
+		   after the pages freed. */
+		head.bytes = back;
+		tail.ptr = p + bytes;
+		tail.bytes = back + bytes < run.bytes ? run.bytes - back - bytes : 0;
+		remove_live (i);
+		if (head.bytes > 0)
+			add_live (&head);
+		if (tail.bytes > 0 && !add_live (&tail)) {
+			untracked_cnt++;
+			tail.bytes = 0;
+		}
+		freed = run.bytes - head.bytes - tail.bytes;
+		uncharge (&sites[run.site], freed, head.bytes + tail.bytes == 0);
+		uncharge (&totals[run.kind], freed, head.bytes + tail.bytes == 0);
+	}
+	intr_set_level (old_level);
+}
+
+/* Returns the number of bytes of KIND memory now allocated, as far
+   as accounting knows, or 0 if accounting is off. */
+size_t
+memstat_live (enum memstat_kind kind) {
+	ASSERT (kind < MEMSTAT_KIND_CNT);
+	return totals[kind].live;
+}
+
+/* Reports the running thread's live allocations, if leak reports
+   were requested.  Called by thread_exit(). */
+void
+memstat_thread_exit (void) {
+	struct thread *t = thread_current ();
+	struct live leaks[LEAK_LIST_MAX];
+	size_t cnt = 0, bytes = 0;
+	enum intr_level old_level;
+	size_t i;
+
+	if (live == NULL || !report_exits)
+		return;
+
+	old_level = intr_disable ();
+	for (i = 0; i < LIVE_CNT; i++)
+		if (live[i].ptr != NULL && live[i].tid == t->tid) {
+			if (cnt < LEAK_LIST_MAX)
+				leaks[cnt] = live[i];
+			cnt++;
+			bytes += live[i].bytes;
+		}
+	intr_set_level (old_level);
+
+	if (cnt == 0)
+		return;
+	printf ("memstat: %s (tid %d) exits with %zu allocations "
+			"(%zu bytes) live:\n", t->name, t->tid, cnt, bytes);
+	for (i = 0; i < cnt && i < LEAK_LIST_MAX; i++) {
+		printf ("  %p: %"PRIu32" bytes of %s from %p\n", leaks[i].ptr,
+				leaks[i].bytes, kind_names[leaks[i].kind],
+				sites[leaks[i].site].caller);
+	}
+	if (cnt > LEAK_LIST_MAX)
+		printf ("  ...\n");
+}
+
+/* Prints the allocation sites with memory allocated, or, unless
+   LIVE_ONLY, every site used, with the most memory first.  May be
+   called with interrupts off, as when shutting down after a
+   panic. */
+void
+memstat_print (bool live_only) {
+	static struct site snapshot[SITE_CNT];
+	static size_t order[SITE_CNT];
+	bool locking = intr_get_level () == INTR_ON;
+	enum intr_level old_level;
+	size_t i, j, cnt = 0;
+
+	if (live == NULL) {
+		if (!live_only)
+			printf ("Memory accounting is off; boot with -memstat to "
+					"turn it on.\n");
+		return;
+	}
+
+	if (locking)
+		lock_acquire (&print_lock);
+	old_level = intr_disable ();
+	memcpy (snapshot, sites, sizeof sites);
+	intr_set_level (old_level);
+
+	/* Sort the sites by live bytes, then peak bytes. */
+	for (i = 0; i < SITE_CNT; i++) {
+		const struct site *s = &snapshot[i];
+
+		if (s->alloc_cnt == 0 || (live_only && s->live == 0))
+			continue;
+		for (j = cnt; j > 0; j--) {
+			const struct site *t = &snapshot[order[j - 1]];
+
+			if (t->live > s->live
+					|| (t->live == s->live && t->peak >= s->peak))
+				break;
+			order[j] = order[j - 1];
+		}
+		order[j] = i;
+		cnt++;
+	}
+
+	printf ("Memory %s by allocation site:\n",
+			live_only ? "still allocated" : "allocated");
+	printf ("  kind   caller               live bytes  peak bytes"
+			"     allocs      frees\n");
+	for (i = 0; i < cnt; i++) {
+		const struct site *s = &snapshot[order[i]];
+
+		if (order[i] == 0)
+			printf ("  %-6s %-18s", "*", "(other sites)");
+		else
+			printf ("  %-6s %-18p", kind_names[s->kind], s->caller);
+		printf (" %11zu %11zu %10llu %10llu\n",
+				s->live, s->peak, s->alloc_cnt, s->free_cnt);
+	}
+	for (i = 0; i < MEMSTAT_KIND_CNT; i++)
+		printf ("Total %s: %zu bytes live, %zu peak, %llu allocs, "
+				"%llu frees\n", kind_names[i], totals[i].live,
+				totals[i].peak, totals[i].alloc_cnt, totals[i].free_cnt);
+	if (untracked_cnt > 0)
+		printf ("%llu allocations not tracked: live table full\n",
+				untracked_cnt);
+	if (locking)
+		lock_release (&print_lock);
+}
@@ -2,12 +2,216 @@
 #include <stddef.h>
 #include <string.h>
 #include "threads/init.h"
+#include "threads/interrupt.h"
 #include "threads/pte.h"
 #include "threads/palloc.h"
 #include "threads/thread.h"
 #include "threads/mmu.h"
 #include "intrinsic.h"
 
+/* Huge pages.
+
+   pml4_set_huge_page() maps 2 MB of user memory with a single page
+   directory entry that has PTE_PS set, instead of a page table of
+   512 entries, so that the mapping takes one TLB entry instead of
+   512.  Everything else here works on 4 kB pages, so whatever
+   changes one page of a huge mapping first "splits" it into a page
+   table that maps the same memory with the same flags.  Lookups
+   that change nothing, such as pml4_get_page(), read the huge
+   entry directly.
+
+   Splitting must not fail, because its callers, such as
+   pml4_clear_page(), cannot.  So each huge mapping sets aside a
+   page for its page table when it is made, in a pool of spare page
+   tables that holds one page for each huge mapping. */
+static void *spare_pts;         /* Stack of spare page tables. */
+
+/* Adds page table PT to the spare page tables. */
+static void
+push_spare_pt (uint64_t *pt) {
+	enum intr_level old_level = intr_disable ();
+	*(void **) pt = spare_pts;
+	spare_pts = pt;
+	intr_set_level (old_level);
+}
+
+/* Removes and returns a spare page table.  There must be one. */
+static uint64_t *
+pop_spare_pt (void) {
+	enum intr_level old_level = intr_disable ();
+	uint64_t *pt = spare_pts;
+
+	ASSERT (pt != NULL);
+	spare_pts = *(void **) pt;
+	intr_set_level (old_level);
+	return pt;
+}
+
+/* Replaces the huge page mapping in page directory entry *PDE,
+   which maps virtual address VA, by a page table of 4 kB mappings
+   of the same memory with the same flags. */
+static void
+split_huge (uint64_t *pde, uint64_t va) {
+	uint64_t *pt = pop_spare_pt ();
+	uint64_t pa = PTE_ADDR (*pde) & ~HUGE_PGMASK;
+	uint64_t flags = *pde & PTE_FLAGS & ~PTE_PS;
+	size_t i;
+
+	for (i = 0; i < HUGE_PGCNT; i++)
+		pt[i] = (pa + i * PGSIZE) | flags;
+	*pde = vtop (pt) | PTE_U | PTE_W | PTE_P;
+	invlpg (va & ~HUGE_PGMASK);
+}
+
+/* Returns the page directory entry for VA in PML4, or a null
+   pointer if there is no page directory for VA. */
+static uint64_t *
+pde_lookup (uint64_t *pml4, uint64_t va) {
+	uint64_t *pdpe, *pd;
+
+	if (pml4 == NULL || !(pml4[PML4 (va)] & PTE_P))
+		return NULL;
+	pdpe = ptov (PTE_ADDR (pml4[PML4 (va)]));
+	if (!(pdpe[PDPE (va)] & PTE_P))
+		return NULL;
+	pd = ptov (PTE_ADDR (pdpe[PDPE (va)]));
+	return &pd[PDX (va)];
+}
+
+/* Returns the page directory entry that maps VA in PML4 as part
+   of a huge page, or a null pointer if VA is not in a huge page. */
+static uint64_t *
+huge_pde (uint64_t *pml4, uint64_t va) {
+	uint64_t *pde = pde_lookup (pml4, va);
+
+	if (pde != NULL && (*pde & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))
+		return pde;
+	return NULL;
+}
+
+/* Process-context identifiers (PCIDs).
+
+   Without PCIDs, every load of CR3 flushes the whole TLB, so each
+   switch between user processes starts the next one with a cold
+   TLB.  With CR4.PCIDE set, each TLB entry is tagged with the
+   PCID in the low 12 bits of CR3 when it was loaded, and a load
+   of CR3 with bit 63 set keeps the entries of every PCID.
+
+   We give up to ASID_CNT page map level 4s a PCID each, from a
+   small table that hands out free slots first and then recycles
+   them round-robin.  PCID 0 is base_pml4's.  A pml4 keeps its
+   PCID, and so its TLB entries, until it is destroyed or its slot
+   is recycled.
+
+   Invalidating a TLB entry only works on the running PCID, so
+   when a mapping changes in a pml4 that is not loaded, we mark
+   its slot stale instead, and the next pml4_activate() of it
+   flushes its PCID's entries.  A new or recycled slot starts out
+   stale, so entries left behind by a previous owner never
+   survive.
+
+   QEMU's default CPU lacks PCIDs; run it with "-cpu qemu64,+pcid"
+   or "-cpu host" to use them.  Without them, everything here
+   works as before, with a full flush on every CR3 load. */
+
+/* Number of PCIDs handed out to user page map level 4s. */
+#define ASID_CNT 32
+
+#define CPUID_1_ECX_PCID (1 << 17)  /* CPUID.01H:ECX PCID support. */
+#define CR4_PCIDE (1 << 17)         /* CR4 PCID enable. */
+#define CR3_PCID_MASK 0xfff         /* PCID bits in CR3. */
+#define CR3_NOFLUSH (1ULL << 63)    /* Keep TLB entries on CR3 load. */
+
+/* A PCID slot. */
+struct asid {
+	uint64_t *pml4;             /* Owner, or null if free. */
+	bool stale;                 /* Flush before next use? */
+};
+
+static bool pcid_enabled;       /* CR4.PCIDE is set. */
+static struct asid asids[ASID_CNT];     /* PCIDs 1...ASID_CNT. */
+static size_t next_victim;      /* Next slot to recycle. */
+
+/* Turns on PCIDs if the CPU supports them.  Must be called with
+   base_pml4 loaded, since CR3's PCID must be 0 when turning them
+   on. */
+void
+pcid_init (void) {
+	uint32_t eax, ebx, ecx, edx;
+
+	cpuid (1, &eax, &ebx, &ecx, &edx);
+	if (!(ecx & CPUID_1_ECX_PCID))
+		return;
+
+	ASSERT ((rcr3 () & CR3_PCID_MASK) == 0);
+	lcr4 (rcr4 () | CR4_PCIDE);
+	pcid_enabled = true;
+}
+
+/* Returns true if PML4 is loaded in CR3. */
+static bool
+is_active (uint64_t *pml4) {
+	return (rcr3 () & ~(uint64_t) CR3_PCID_MASK) == vtop (pml4);
+}
+
+/* Returns PML4's slot in asids[], or a null pointer if it has
+   none.  Interrupts must be off. */
+static struct asid *
+asid_lookup (uint64_t *pml4) {
+	size_t i;
+
+	ASSERT (intr_get_level () == INTR_OFF);
+	for (i = 0; i < ASID_CNT; i++)
+		if (asids[i].pml4 == pml4)
+			return &asids[i];
+	return NULL;
+}
+
+/* Returns a slot for PML4, taking a free one or else recycling
+   the next victim.  The slot is stale.  Interrupts must be off. */
+static struct asid *
+asid_alloc (uint64_t *pml4) {
+	struct asid *a = asid_lookup (NULL);
+
+	if (a == NULL) {
+		a = &asids[next_victim];
+		next_victim = (next_victim + 1) % ASID_CNT;
+	}
+	a->pml4 = pml4;
+	a->stale = true;
+	return a;
+}
+
+/* Makes sure that no TLB entry for PML4 survives its next
+   activation. */
+static void
+mark_stale (uint64_t *pml4) {
+	enum intr_level old_level = intr_disable ();
+	struct asid *a = asid_lookup (pml4);
+
+	if (a != NULL)
+		a->stale = true;
+	intr_set_level (old_level);
+}
+
+/* Invalidates the TLB entry for virtual page VA in PML4. */
+static void
+flush_page (uint64_t *pml4, uint64_t va) {
+	if (is_active (pml4))
+		invlpg (va);
+	else
+		mark_stale (pml4);
+}
+
+/* Invalidates every TLB entry for PML4. */
+static void
+flush_all (uint64_t *pml4) {
+	if (is_active (pml4))
+		lcr3 (rcr3 () & ~CR3_NOFLUSH);
+	else
+		mark_stale (pml4);
+}
+
 static uint64_t *
 pgdir_walk (uint64_t *pdp, const uint64_t va, int create) {
 	int idx = PDX (va);
@@ -22,7 +226,8 @@ pgdir_walk (uint64_t *pdp, const uint64_t va, int create) {
 					return NULL;
 			} else
 				return NULL;
-		}
+		} else if (pdp[idx] & PTE_PS)
+			split_huge (&pdp[idx], va);
 		return (uint64_t *) ptov (PTE_ADDR (pdp[idx]) + 8 * PTX (va));
 	}
 	return NULL;
@@ -121,6 +326,10 @@ static bool
 pgdir_for_each (uint64_t *pdp, pte_for_each_func *func, void *aux,
 		unsigned pml4_index, unsigned pdp_index) {
 	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++) {
+		if (pdp[i] & PTE_PS)
+			split_huge (&pdp[i], ((uint64_t) pml4_index << PML4SHIFT) |
+					((uint64_t) pdp_index << PDPESHIFT) |
+					((uint64_t) i << PDXSHIFT));
 		uint64_t *pte = ptov((uint64_t *) pdp[i]);
 		if (((uint64_t) pte) & PTE_P)
 			if (!pt_for_each ((uint64_t *) PTE_ADDR (pte), func, aux,
@@ -169,7 +378,11 @@ static void
 pgdir_destroy (uint64_t *pdp) {
 	for (unsigned i = 0; i < PGSIZE / sizeof(uint64_t *); i++) {
 		uint64_t *pte = ptov((uint64_t *) pdp[i]);
-		if (((uint64_t) pte) & PTE_P)
+		if ((pdp[i] & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS)) {
+			palloc_free_multiple (ptov (PTE_ADDR (pdp[i]) & ~HUGE_PGMASK),
+					HUGE_PGCNT);
+			palloc_free_page (pop_spare_pt ());
+		} else if (((uint64_t) pte) & PTE_P)
 			pt_destroy (PTE_ADDR (pte));
 	}
 	palloc_free_page ((void *) pdp);
@@ -191,6 +404,15 @@ pml4_destroy (uint64_t *pml4) {
 	if (pml4 == NULL)
 		return;
 	ASSERT (pml4 != base_pml4);
+	ASSERT (!is_active (pml4));
+
+	/* Give up PML4's PCID.  Its TLB entries go when the PCID's next
+	   owner first loads it. */
+	enum intr_level old_level = intr_disable ();
+	struct asid *a = asid_lookup (pml4);
+	if (a != NULL)
+		a->pml4 = NULL;
+	intr_set_level (old_level);
 
 	/* if PML4 (vaddr) >= 1, it's kernel space by define. */
 	uint64_t *pdpe = ptov ((uint64_t *) pml4[0]);
@@ -200,10 +422,34 @@ pml4_destroy (uint64_t *pml4) {
 }
 
 /* Loads page directory PD into the CPU's page directory base
- * register. */
+ * register.  With PCIDs, keeps the TLB entries of PD from the
+ * last time it was loaded, unless they may be out of date. */
 void
 pml4_activate (uint64_t *pml4) {
-	lcr3 (vtop (pml4 ? pml4 : base_pml4));
+	enum intr_level old_level;
+	struct asid *a;
+
+	if (pml4 == NULL)
+		pml4 = base_pml4;
+	if (!pcid_enabled) {
+		lcr3 (vtop (pml4));
+		return;
+	}
+	if (pml4 == base_pml4) {
+		lcr3 (vtop (pml4) | CR3_NOFLUSH);
+		return;
+	}
+
+	old_level = intr_disable ();
+	a = asid_lookup (pml4);
+	if (a == NULL)
+		a = asid_alloc (pml4);
+	if (a->stale) {
+		a->stale = false;
+		lcr3 (vtop (pml4) | (a - asids + 1));
+	} else
+		lcr3 (vtop (pml4) | (a - asids + 1) | CR3_NOFLUSH);
+	intr_set_level (old_level);
 }
 
 /* Looks up the physical address that corresponds to user virtual
@@ -214,6 +460,11 @@ void *
 pml4_get_page (uint64_t *pml4, const void *uaddr) {
 	ASSERT (is_user_vaddr (uaddr));
 
+	uint64_t *pde = huge_pde (pml4, (uint64_t) uaddr);
+	if (pde != NULL)
+		return ptov (PTE_ADDR (*pde) & ~HUGE_PGMASK)
+			+ ((uint64_t) uaddr & HUGE_PGMASK);
+
 	uint64_t *pte = pml4e_walk (pml4, (uint64_t) uaddr, 0);
 
 	if (pte && (*pte & PTE_P))
@@ -223,8 +474,8 @@ pml4_get_page (uint64_t *pml4, const void *uaddr) {
 
 /* Adds a mapping in page map level 4 PML4 from user virtual page
  * UPAGE to the physical frame identified by kernel virtual address KPAGE.
- * UPAGE must not already be mapped. KPAGE should probably be a page obtained
- * from the user pool with palloc_get_page().
+ * Replaces UPAGE's mapping, if it has one. KPAGE should probably be a
+ * page obtained from the user pool with palloc_get_page().
  * If WRITABLE is true, the new page is read/write;
  * otherwise it is read-only.
  * Returns true if successful, false if memory allocation
@@ -238,11 +489,51 @@ pml4_set_page (uint64_t *pml4, void *upage, void *kpage, bool rw) {
 
 	uint64_t *pte = pml4e_walk (pml4, (uint64_t) upage, 1);
 
-	if (pte)
+	if (pte) {
+		uint64_t old = *pte;
+
 		*pte = vtop (kpage) | PTE_P | (rw ? PTE_W : 0) | PTE_U;
+		if (old & PTE_P)
+			flush_page (pml4, (uint64_t) upage);
+	}
 	return pte != NULL;
 }
 
+/* Adds a mapping in PML4 from the 2 MB of user virtual memory at
+ * UPAGE to the 2 MB of physical memory at kernel virtual address
+ * KPAGE, as a single huge page.  Both must be aligned to 2 MB, and
+ * no page of UPAGE may already be mapped.  If RW is true, the new
+ * pages are read/write; otherwise they are read-only.
+ * Returns true if successful, false if memory allocation failed,
+ * in which case the caller may map the pages one at a time with
+ * pml4_set_page() instead. */
+bool
+pml4_set_huge_page (uint64_t *pml4, void *upage, void *kpage, bool rw) {
+	uint64_t va = (uint64_t) upage;
+	uint64_t *pt, *pde;
+	size_t i;
+
+	ASSERT ((va & HUGE_PGMASK) == 0);
+	ASSERT ((vtop (kpage) & HUGE_PGMASK) == 0);
+	ASSERT (is_user_vaddr (upage));
+	ASSERT (is_user_vaddr (upage + HUGE_PGSIZE - 1));
+	ASSERT (pml4 != base_pml4);
+
+	/* Get the page table that would map UPAGE, creating it if
+	   needed, and set it aside for splitting the huge page. */
+	pt = pml4e_walk (pml4, va, 1);
+	if (pt == NULL)
+		return false;
+	for (i = 0; i < HUGE_PGCNT; i++)
+		ASSERT (!(pt[i] & PTE_P));
+	push_spare_pt (pt);
+
+	pde = pde_lookup (pml4, va);
+	*pde = vtop (kpage) | PTE_PS | PTE_P | (rw ? PTE_W : 0) | PTE_U;
+	flush_page (pml4, va);
+	return true;
+}
+
 /* Marks user virtual page UPAGE "not present" in page
  * directory PD.  Later accesses to the page will fault.  Other
  * bits in the page table entry are preserved.
@@ -257,17 +548,131 @@ pml4_clear_page (uint64_t *pml4, void *upage) {
 
 	if (pte != NULL && (*pte & PTE_P) != 0) {
 		*pte &= ~PTE_P;
-		if (rcr3 () == vtop (pml4))
-			invlpg ((uint64_t) upage);
+		flush_page (pml4, (uint64_t) upage);
+	}
+}
+
+/* Most pages pml4_clear_range() invalidates in the TLB one at a
+ * time.  For larger ranges it flushes the whole TLB instead. */
+#define INVLPG_MAX 32
+
+/* Returns the first address past VA aligned to 1 << SHIFT. */
+static inline uint64_t
+next_boundary (uint64_t va, unsigned shift) {
+	return ((va >> shift) + 1) << shift;
+}
+
+/* Returns true if page table PT maps no page. */
+static bool
+pt_is_empty (const uint64_t *pt) {
+	size_t i;
+
+	for (i = 0; i < PGSIZE / sizeof *pt; i++)
+		if (pt[i] & PTE_P)
+			return false;
+	return true;
+}
+
+/* Marks the PAGE_CNT user virtual pages starting at UPAGE "not
+ * present" in PML4, like calling pml4_clear_page() on each, but in
+ * one pass over the page tables and with a single TLB flush at
+ * the end.  Page tables left with no page mapped are freed, along
+ * with the bits in their entries, so callers that need a page's
+ * dirty bit must read it first.  Unmapped parts of the range,
+ * down to whole page directories, are skipped without cost.
+ * The memory that was mapped is not freed. */
+void
+pml4_clear_range (uint64_t *pml4, void *upage, size_t page_cnt) {
+	uint64_t start = (uint64_t) upage;
+	uint64_t end = start + page_cnt * PGSIZE;
+	uint64_t va = start;
+	void *free_pts = NULL;
+	size_t cleared = 0;
+
+	ASSERT (pg_ofs (upage) == 0);
+	ASSERT (end >= start);
+	ASSERT (end <= KERN_BASE);
+	ASSERT (pml4 != base_pml4);
+
+	while (va < end) {
+		uint64_t *pdp, *pd, *pde, *pt;
+		uint64_t pd_end;
+
+		if (!(pml4[PML4 (va)] & PTE_P)) {
+			va = next_boundary (va, PML4SHIFT);
+			continue;
+		}
+		pdp = ptov (PTE_ADDR (pml4[PML4 (va)]));
+		if (!(pdp[PDPE (va)] & PTE_P)) {
+			va = next_boundary (va, PDPESHIFT);
+			continue;
+		}
+		pd = ptov (PTE_ADDR (pdp[PDPE (va)]));
+		pde = &pd[PDX (va)];
+		pd_end = next_boundary (va, PDXSHIFT);
+		if (pd_end > end)
+			pd_end = end;
+		if (!(*pde & PTE_P)) {
+			va = pd_end;
+			continue;
+		}
+
+		if (*pde & PTE_PS) {
+			if ((va & HUGE_PGMASK) == 0 && pd_end - va == HUGE_PGSIZE) {
+				/* Unmap the whole huge page and free its spare page
+				   table. */
+				pt = pop_spare_pt ();
+				*(void **) pt = free_pts;
+				free_pts = pt;
+				*pde = 0;
+				cleared += HUGE_PGCNT;
+				va = pd_end;
+				continue;
+			}
+			split_huge (pde, va);
+		}
+
+		pt = ptov (PTE_ADDR (*pde));
+		for (; va < pd_end; va += PGSIZE)
+			if (pt[PTX (va)] & PTE_P) {
+				pt[PTX (va)] &= ~PTE_P;
+				cleared++;
+			}
+		if (pt_is_empty (pt)) {
+			*pde = 0;
+			*(void **) pt = free_pts;
+			free_pts = pt;
+		}
+	}
+
+	/* Flush the TLB before freeing page tables it might still
+	   refer to. */
+	if (cleared > 0 || free_pts != NULL) {
+		if (page_cnt <= INVLPG_MAX && is_active (pml4))
+			for (va = start; va < end; va += PGSIZE)
+				invlpg (va);
+		else
+			flush_all (pml4);
+	}
+	while (free_pts != NULL) {
+		void *pt = free_pts;
+
+		free_pts = *(void **) pt;
+		palloc_free_page (pt);
 	}
 }
 
 /* Returns true if the PTE for virtual page VPAGE in PML4 is dirty,
  * that is, if the page has been modified since the PTE was
- * installed.
+ * installed.  For a page in a huge page, reports whether any
+ * part of the huge page has been modified.
  * Returns false if PML4 contains no PTE for VPAGE. */
 bool
 pml4_is_dirty (uint64_t *pml4, const void *vpage) {
+	uint64_t *pde = huge_pde (pml4, (uint64_t) vpage);
+	if (pde != NULL)
+		return (*pde & PTE_D) != 0;
+
 	uint64_t *pte = pml4e_walk (pml4, (uint64_t) vpage, false);
 	return pte != NULL && (*pte & PTE_D) != 0;
 }
@@ -283,8 +688,7 @@ pml4_set_dirty (uint64_t *pml4, const void *vpage, bool dirty) {
 		else
 			*pte &= ~(uint32_t) PTE_D;
 
-		if (rcr3 () == vtop (pml4))
-			invlpg ((uint64_t) vpage);
+		flush_page (pml4, (uint64_t) vpage);
 	}
 }
 
@@ -294,6 +698,10 @@ pml4_set_dirty (uint64_t *pml4, const void *vpage, bool dirty) {
  * PML4 contains no PTE for VPAGE. */
 bool
 pml4_is_accessed (uint64_t *pml4, const void *vpage) {
+	uint64_t *pde = huge_pde (pml4, (uint64_t) vpage);
+	if (pde != NULL)
+		return (*pde & PTE_A) != 0;
+
 	uint64_t *pte = pml4e_walk (pml4, (uint64_t) vpage, false);
 	return pte != NULL && (*pte & PTE_A) != 0;
 }
@@ -309,7 +717,9 @@ pml4_set_accessed (uint64_t *pml4, const void *vpage, bool accessed) {
 		else
 			*pte &= ~(uint32_t) PTE_A;
 
-		if (rcr3 () == vtop (pml4))
+		/* A stale entry in an inactive PML4 only keeps the CPU from
+		   setting the bit again, so it is not worth a flush. */
+		if (is_active (pml4))
 			invlpg ((uint64_t) vpage);
 	}
 }
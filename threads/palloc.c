@@ -1,5 +1,6 @@
 #include "threads/palloc.h"
 #include <bitmap.h>
+#include <buddy.h>
 #include <debug.h>
 #include <inttypes.h>
 #include <round.h>
@@ -8,8 +9,11 @@
 #include <stdio.h>
 #include <string.h>
 #include "threads/init.h"
+#include "threads/interrupt.h"
 #include "threads/loader.h"
-#include "threads/synch.h"
+#include "threads/malloc.h"
+#include "threads/memstat.h"
+#include "threads/slab.h"
 #include "threads/vaddr.h"
 
 /* Page allocator.  Hands out memory in page-size (or
@@ -24,15 +28,35 @@
 
    By default, half of system RAM is given to the kernel pool and
    half to the user pool.  That should be huge overkill for the
-   kernel pool, but that's just fine for demonstration purposes. */
+   kernel pool, but that's just fine for demonstration purposes.
+
+   Within a pool, free pages are managed by a buddy allocator (see
+   lib/kernel/buddy.h), which finds a run of pages and merges freed
+   runs in time logarithmic in the run length instead of scanning
+   the pool.  Its blocks are aligned to physical addresses.  A
+   bitmap of used pages is kept alongside to catch double frees.
+
+   The pools are protected by disabling interrupts rather than by
+   a lock, because the scheduler frees the pages of dying threads
+   with interrupts off.  Every operation is short.
+
+   Each pool also keeps a stack of up to ZEROED_MAX free pages that
+   the idle thread has already zeroed, so that single-page PAL_ZERO
+   requests, such as those made to handle page faults, need not
+   clear a page while the requester waits. */
 
 /* A memory pool. */
 struct pool {
-	struct lock lock;               /* Mutual exclusion. */
 	struct bitmap *used_map;        /* Bitmap of free pages. */
+	struct buddy *buddy;            /* Allocator for free pages. */
 	uint8_t *base;                  /* Base of pool. */
+	void *zeroed;                   /* Stack of zeroed pages. */
+	size_t zeroed_cnt;              /* Number of pages in ZEROED. */
 };
 
+/* Most zeroed pages to keep in each pool. */
+#define ZEROED_MAX 128
+
 /* Two pools: one for kernel data, one for user pages. */
 static struct pool kernel_pool, user_pool;
 
@@ -224,11 +248,13 @@ split:
 			if ((uint64_t) pool_end < end) {
 				page_cnt = ((uint64_t) pool_end - start) / PGSIZE;
 				bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+				buddy_free (pool->buddy, page_idx, page_cnt);
 				start = (uint64_t) pool_end;
 				goto split;
 			} else {
 				page_cnt = ((uint64_t) end - start) / PGSIZE;
 				bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+				buddy_free (pool->buddy, page_idx, page_cnt);
 			}
 		}
 	}
@@ -253,28 +279,98 @@ palloc_init (void) {
 	return ext_mem.end;
 }
 
-/* Obtains and returns a group of PAGE_CNT contiguous free pages.
-   If PAL_USER is set, the pages are obtained from the user pool,
-   otherwise from the kernel pool.  If PAL_ZERO is set in FLAGS,
-   then the pages are filled with zeros.  If too few pages are
-   available, returns a null pointer, unless PAL_ASSERT is set in
-   FLAGS, in which case the kernel panics. */
-void *
-palloc_get_multiple (enum palloc_flags flags, size_t page_cnt) {
+/* Allocates PAGE_CNT contiguous pages from POOL's buddy allocator
+   and returns the first, or a null pointer if there is no such
+   run.  Interrupts must be off. */
+static void *
+take_pages (struct pool *pool, size_t page_cnt) {
+	size_t page_idx = buddy_alloc (pool->buddy, page_cnt);
+
+	if (page_idx == BUDDY_ERROR)
+		return NULL;
+	bitmap_set_multiple (pool->used_map, page_idx, page_cnt, true);
+	return pool->base + PGSIZE * page_idx;
+}
+
+/* Returns PAGE_CNT pages starting at PAGES to POOL's buddy
+   allocator.  Interrupts must be off. */
+static void
+put_pages (struct pool *pool, void *pages, size_t page_cnt) {
+	size_t page_idx = pg_no (pages) - pg_no (pool->base);
+
+	ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
+	bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+	buddy_free (pool->buddy, page_idx, page_cnt);
+}
+
+/* Removes a page from POOL's zeroed pages and returns it, or
+   returns a null pointer if there is none.  The stack is linked
+   through the first word of each page, which is cleared here.
+   Interrupts must be off. */
+static void *
+pop_zeroed (struct pool *pool) {
+	void **page = pool->zeroed;
+
+	if (page != NULL) {
+		pool->zeroed = *page;
+		pool->zeroed_cnt--;
+		*page = NULL;
+	}
+	return page;
+}
+
+/* Returns all of POOL's zeroed pages to its buddy allocator.
+   Interrupts must be off. */
+static void
+drain_zeroed (struct pool *pool) {
+	void *page;
+
+	while ((page = pop_zeroed (pool)) != NULL)
+		put_pages (pool, page, 1);
+}
+
+/* Does the work of palloc_get_multiple(), which accounts for the
+   pages under its own caller. */
+static void *
+get_pages (enum palloc_flags flags, size_t page_cnt) {
 	struct pool *pool = flags & PAL_USER ? &user_pool : &kernel_pool;
+	enum intr_level old_level;
+	void *pages = NULL;
+	bool zeroed = false;
 
-	lock_acquire (&pool->lock);
-	size_t page_idx = bitmap_scan_and_flip (pool->used_map, 0, page_cnt, false);
-	lock_release (&pool->lock);
-	void *pages;
+	if (page_cnt == 0)
+		return NULL;
 
-	if (page_idx != BITMAP_ERROR)
-		pages = pool->base + PGSIZE * page_idx;
-	else
-		pages = NULL;
+	old_level = intr_disable ();
+	if (page_cnt == 1 && (flags & PAL_ZERO)) {
+		pages = pop_zeroed (pool);
+		zeroed = pages != NULL;
+	}
+	if (pages == NULL) {
+		pages = take_pages (pool, page_cnt);
+		if (pages == NULL && pool->zeroed_cnt > 0) {
+			/* Short of memory: use up the zeroed pages too. */
+			if (page_cnt == 1) {
+				pages = pop_zeroed (pool);
+				zeroed = true;
+			} else {
+				drain_zeroed (pool);
+				pages = take_pages (pool, page_cnt);
+			}
+		}
+	}
+	intr_set_level (old_level);
+
+	/* malloc() and the object caches may hold free memory in the
+	   kernel pool.  Have them give it back and try again, if we are
+	   allowed to sleep. */
+	if (pages == NULL && pool == &kernel_pool && !intr_context ()
+			&& intr_get_level () == INTR_ON
+			&& malloc_reap () + kmem_reap () > 0)
+		return get_pages (flags, page_cnt);
 
 	if (pages) {
-		if (flags & PAL_ZERO)
+		if ((flags & PAL_ZERO) && !zeroed)
 			memset (pages, 0, PGSIZE * page_cnt);
 	} else {
 		if (flags & PAL_ASSERT)
@@ -284,6 +380,21 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt) {
 	return pages;
 }
 
+/* Obtains and returns a group of PAGE_CNT contiguous free pages.
+   If PAL_USER is set, the pages are obtained from the user pool,
+   otherwise from the kernel pool.  If PAL_ZERO is set in FLAGS,
+   then the pages are filled with zeros.  If too few pages are
+   available, returns a null pointer, unless PAL_ASSERT is set in
+   FLAGS, in which case the kernel panics. */
+void *
+palloc_get_multiple (enum palloc_flags flags, size_t page_cnt) {
+	void *pages = get_pages (flags, page_cnt);
+
+	memstat_alloc (flags & PAL_USER ? MEMSTAT_USER : MEMSTAT_KERNEL, pages,
+			PGSIZE * page_cnt, __builtin_return_address (0));
+	return pages;
+}
+
 /* Obtains a single free page and returns its kernel virtual
    address.
    If PAL_USER is set, the page is obtained from the user pool,
@@ -293,18 +404,23 @@ palloc_get_multiple (enum palloc_flags flags, size_t page_cnt) {
    FLAGS, in which case the kernel panics. */
 void *
 palloc_get_page (enum palloc_flags flags) {
-	return palloc_get_multiple (flags, 1);
+	void *page = get_pages (flags, 1);
+
+	memstat_alloc (flags & PAL_USER ? MEMSTAT_USER : MEMSTAT_KERNEL, page,
+			PGSIZE, __builtin_return_address (0));
+	return page;
 }
 
 /* Frees the PAGE_CNT pages starting at PAGES. */
 void
 palloc_free_multiple (void *pages, size_t page_cnt) {
 	struct pool *pool;
-	size_t page_idx;
+	enum intr_level old_level;
 
 	ASSERT (pg_ofs (pages) == 0);
 	if (pages == NULL || page_cnt == 0)
 		return;
+	memstat_free_pages (pages, page_cnt * PGSIZE);
 
 	if (page_from_pool (&kernel_pool, pages))
 		pool = &kernel_pool;
@@ -313,13 +429,12 @@ palloc_free_multiple (void *pages, size_t page_cnt) {
 	else
 		NOT_REACHED ();
 
-	page_idx = pg_no (pages) - pg_no (pool->base);
-
 #ifndef NDEBUG
 	memset (pages, 0xcc, PGSIZE * page_cnt);
 #endif
-	ASSERT (bitmap_all (pool->used_map, page_idx, page_cnt));
-	bitmap_set_multiple (pool->used_map, page_idx, page_cnt, false);
+	old_level = intr_disable ();
+	put_pages (pool, pages, page_cnt);
+	intr_set_level (old_level);
 }
 
 /* Frees the page at PAGE. */
@@ -328,23 +443,60 @@ palloc_free_page (void *page) {
 	palloc_free_multiple (page, 1);
 }
 
+/* Zeroes one free page and sets it aside for a later PAL_ZERO
+   request, if a pool has fewer than ZEROED_MAX zeroed pages and
+   any free page.  Returns true if it did, false if there was
+   nothing to do.  Called by the idle thread, with interrupts on,
+   so that the zeroing itself does not delay interrupts. */
+bool
+palloc_prezero (void) {
+	struct pool *pools[] = { &user_pool, &kernel_pool };
+	enum intr_level old_level;
+	void **page = NULL;
+	struct pool *pool;
+	size_t i;
+
+	ASSERT (intr_get_level () == INTR_ON);
+
+	old_level = intr_disable ();
+	for (i = 0; i < sizeof pools / sizeof *pools && page == NULL; i++) {
+		pool = pools[i];
+		if (pool->zeroed_cnt < ZEROED_MAX)
+			page = take_pages (pool, 1);
+	}
+	intr_set_level (old_level);
+	if (page == NULL)
+		return false;
+
+	memset (page, 0, PGSIZE);
+
+	old_level = intr_disable ();
+	*page = pool->zeroed;
+	pool->zeroed = page;
+	pool->zeroed_cnt++;
+	intr_set_level (old_level);
+	return true;
+}
+
 /* Initializes pool P as starting at START and ending at END */
 static void
 init_pool (struct pool *p, void **bm_base, uint64_t start, uint64_t end) {
-  /* We'll put the pool's used_map at its base.
-     Calculate the space needed for the bitmap
+  /* We'll put the pool's used_map and buddy allocator at its base.
+     Calculate the space needed for them
      and subtract it from the pool's size. */
 	uint64_t pgcnt = (end - start) / PGSIZE;
 	size_t bm_pages = DIV_ROUND_UP (bitmap_buf_size (pgcnt), PGSIZE) * PGSIZE;
+	size_t buddy_pages = DIV_ROUND_UP (buddy_buf_size (pgcnt), PGSIZE) * PGSIZE;
 
-	lock_init(&p->lock);
 	p->used_map = bitmap_create_in_buf (pgcnt, *bm_base, bm_pages);
+	p->buddy = buddy_create_in_buf (pgcnt, pg_no (start), *bm_base + bm_pages,
+			buddy_pages);
 	p->base = (void *) start;
 
 	// Mark all to unusable.
 	bitmap_set_all(p->used_map, true);
 
-	*bm_base += bm_pages;
+	*bm_base += bm_pages + buddy_pages;
 }
 
 /* Returns true if PAGE was allocated from POOL,
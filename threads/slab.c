@@ -0,0 +1,350 @@
+#include "threads/slab.h"
+#include <debug.h>
+#include <list.h>
+#include <round.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* Object caches ("slab" allocation).
+
+   A cache hands out objects of a single size, usually one kernel
+   structure, such as struct page.  It carves them out of "slabs",
+   pages obtained from the page allocator, packed as tightly as
+   their alignment allows rather than rounded up to a power of 2
+   as malloc() does.  Each slab starts with a header that records
+   its free objects as a list of indexes, so that free objects are
+   never written to.
+
+   A cache may have a constructor, which is run on each object when
+   its slab is created.  Objects are expected to be back in their
+   constructed state when they are freed, so that allocating one
+   need not construct it again.
+
+   A cache keeps its slabs on three lists: full, partial, and
+   empty.  Allocation takes from a partial slab if there is one, so
+   that objects stay packed into as few slabs as possible.  When a
+   slab becomes empty, it is returned to the page allocator unless
+   it is the cache's only empty slab.  kmem_reap() returns even
+   those, when the page allocator runs short. */
+
+/* Alignment of objects within a slab. */
+#define KMEM_ALIGN sizeof (void *)
+
+/* Empty slabs a cache keeps for reuse. */
+#define EMPTY_MAX 1
+
+/* Ends a slab's free list. */
+#define FREE_END UINT16_MAX
+
+/* Magic number for detecting slab corruption. */
+#define SLAB_MAGIC 0x51ab51ab
+
+/* An object cache. */
+struct kmem_cache {
+	const char *name;           /* For statistics. */
+	size_t size;                /* Object size, rounded up for alignment. */
+	size_t obj_cnt;             /* Objects per slab. */
+	size_t obj_ofs;             /* Offset of the first object in a slab. */
+	kmem_ctor_func *ctor;       /* Constructor, or null. */
+	struct lock lock;           /* Protects the following. */
+	struct list full;           /* Slabs with no free object. */
+	struct list partial;        /* Slabs with some free objects. */
+	struct list empty;          /* Slabs with no object in use. */
+	size_t empty_cnt;           /* Number of slabs in EMPTY. */
+
+	/* Statistics. */
+	size_t slab_cnt;            /* Slabs now held. */
+	size_t in_use;              /* Objects now allocated. */
+	unsigned long long alloc_cnt;   /* Objects allocated. */
+	unsigned long long free_cnt;    /* Objects freed. */
+	unsigned long long grow_cnt;    /* Slabs created. */
+	unsigned long long reap_cnt;    /* Slabs returned to palloc. */
+
+	struct list_elem elem;      /* Element in all_caches. */
+};
+
+/* Slab header, at the start of each slab's page. */
+struct slab {
+	unsigned magic;             /* Always set to SLAB_MAGIC. */
+	struct kmem_cache *cache;   /* Owning cache. */
+	struct list_elem elem;      /* Element in one of the cache's lists. */
+	size_t in_use;              /* Objects allocated. */
+	uint16_t free;              /* First free object, or FREE_END. */
+	uint16_t next[];            /* Next free object after each free one. */
+};
+
+/* All caches, for statistics and kmem_reap(). */
+static struct list all_caches;
+static struct lock all_caches_lock;
+
+/* Initializes the list of caches. */
+void
+kmem_init (void) {
+	list_init (&all_caches);
+	lock_init (&all_caches_lock);
+}
+
+/* Returns the offset of the first object in a slab of OBJ_CNT
+   objects. */
+static size_t
+obj_ofs (size_t obj_cnt) {
+	return ROUND_UP (sizeof (struct slab) + obj_cnt * sizeof (uint16_t),
+			KMEM_ALIGN);
+}
+
+/* Creates and returns a cache of SIZE-byte objects named NAME,
+   which must stay valid as long as the cache.  If CTOR is not
+   null, it is run on each object when the object's slab is
+   created.  Panics if SIZE is too big to fit in a slab or memory
+   is not available. */
+struct kmem_cache *
+kmem_cache_create (const char *name, size_t size, kmem_ctor_func *ctor) {
+	struct kmem_cache *c = malloc (sizeof *c);
+	size_t obj_cnt;
+
+	if (c == NULL)
+		PANIC ("kmem_cache_create: out of memory");
+
+	size = ROUND_UP (size > 0 ? size : 1, KMEM_ALIGN);
+	obj_cnt = (PGSIZE - sizeof (struct slab)) / (size + sizeof (uint16_t));
+	while (obj_cnt > 0 && obj_ofs (obj_cnt) + obj_cnt * size > PGSIZE)
+		obj_cnt--;
+	if (obj_cnt == 0)
+		PANIC ("kmem_cache_create: %zu-byte objects are too big", size);
+	ASSERT (obj_cnt < FREE_END);
+
+	c->name = name;
+	c->size = size;
+	c->obj_cnt = obj_cnt;
+	c->obj_ofs = obj_ofs (obj_cnt);
+	c->ctor = ctor;
+	lock_init (&c->lock);
+	list_init (&c->full);
+	list_init (&c->partial);
+	list_init (&c->empty);
+	c->empty_cnt = 0;
+	c->slab_cnt = c->in_use = 0;
+	c->alloc_cnt = c->free_cnt = c->grow_cnt = c->reap_cnt = 0;
+
+	lock_acquire (&all_caches_lock);
+	list_push_back (&all_caches, &c->elem);
+	lock_release (&all_caches_lock);
+	return c;
+}
+
+/* Returns object IDX of slab S in cache C. */
+static void *
+slab_obj (const struct kmem_cache *c, struct slab *s, size_t idx) {
+	return (uint8_t *) s + c->obj_ofs + idx * c->size;
+}
+
+/* Returns the slab that holds OBJ, which belongs to cache C. */
+static struct slab *
+obj_slab (const struct kmem_cache *c, void *obj) {
+	struct slab *s = pg_round_down (obj);
+
+	ASSERT (s->magic == SLAB_MAGIC);
+	ASSERT (s->cache == c);
+	ASSERT ((pg_ofs (obj) - c->obj_ofs) % c->size == 0);
+	return s;
+}
+
+/* Creates a slab for cache C, with all of its objects free and
+   constructed, and adds it to C's empty list.  Returns false if
+   memory is not available. */
+static bool
+grow (struct kmem_cache *c) {
+	struct slab *s = palloc_get_page (0);
+	size_t i;
+
+	if (s == NULL)
+		return false;
+
+	s->magic = SLAB_MAGIC;
+	s->cache = c;
+	s->in_use = 0;
+	s->free = 0;
+	for (i = 0; i < c->obj_cnt; i++) {
+		s->next[i] = i + 1 < c->obj_cnt ? i + 1 : FREE_END;
+		if (c->ctor != NULL)
+			c->ctor (slab_obj (c, s, i));
+	}
+	list_push_front (&c->empty, &s->elem);
+	c->empty_cnt++;
+	c->slab_cnt++;
+	c->grow_cnt++;
+	return true;
+}
+
+/* Obtains and returns an object from cache C.  Returns a null
+   pointer if memory is not available. */
+void *
+kmem_cache_alloc (struct kmem_cache *c) {
+	struct slab *s;
+	size_t idx;
+
+	lock_acquire (&c->lock);
+	if (list_empty (&c->partial)) {
+		if (list_empty (&c->empty) && !grow (c)) {
+			lock_release (&c->lock);
+			return NULL;
+		}
+		s = list_entry (list_pop_front (&c->empty), struct slab, elem);
+		c->empty_cnt--;
+		list_push_front (&c->partial, &s->elem);
+	} else
+		s = list_entry (list_front (&c->partial), struct slab, elem);
+
+	idx = s->free;
+	ASSERT (idx != FREE_END);
+	s->free = s->next[idx];
+	if (++s->in_use == c->obj_cnt) {
+		list_remove (&s->elem);
+		list_push_front (&c->full, &s->elem);
+	}
+	c->in_use++;
+	c->alloc_cnt++;
+	lock_release (&c->lock);
+
+	return slab_obj (c, s, idx);
+}
+
+/* Obtains an object from cache C, fills it with zeros, and
+   returns it.  Returns a null pointer if memory is not
+   available. */
+void *
+kmem_cache_zalloc (struct kmem_cache *c) {
+	void *obj = kmem_cache_alloc (c);
+
+	if (obj != NULL)
+		memset (obj, 0, c->size);
+	return obj;
+}
+
+/* Returns slab S of cache C to the page allocator.  S must be
+   empty and on no list. */
+static void
+release (struct kmem_cache *c, struct slab *s) {
+	ASSERT (s->in_use == 0);
+	c->slab_cnt--;
+	c->reap_cnt++;
+	palloc_free_page (s);
+}
+
+/* Returns OBJ, which must have been obtained from cache C, to C.
+   Does nothing if OBJ is null. */
+void
+kmem_cache_free (struct kmem_cache *c, void *obj) {
+	struct slab *s;
+	size_t idx;
+
+	if (obj == NULL)
+		return;
+
+	s = obj_slab (c, obj);
+	idx = (pg_ofs (obj) - c->obj_ofs) / c->size;
+
+#ifndef NDEBUG
+	/* Clear the object to help detect use-after-free bugs, unless
+	   it must keep its constructed state. */
+	if (c->ctor == NULL)
+		memset (obj, 0xcc, c->size);
+#endif
+
+	lock_acquire (&c->lock);
+	ASSERT (s->in_use > 0);
+	if (s->in_use-- == c->obj_cnt) {
+		list_remove (&s->elem);
+		list_push_front (&c->partial, &s->elem);
+	}
+	s->next[idx] = s->free;
+	s->free = idx;
+	if (s->in_use == 0) {
+		list_remove (&s->elem);
+		if (c->empty_cnt < EMPTY_MAX) {
+			list_push_front (&c->empty, &s->elem);
+			c->empty_cnt++;
+		} else
+			release (c, s);
+	}
+	c->in_use--;
+	c->free_cnt++;
+	lock_release (&c->lock);
+}
+
+/* Returns cache C's empty slabs to the page allocator.  C's lock
+   must be held.  Returns the number of pages freed. */
+static size_t
+shrink (struct kmem_cache *c) {
+	size_t cnt = 0;
+
+	while (!list_empty (&c->empty)) {
+		struct slab *s = list_entry (list_pop_front (&c->empty),
+				struct slab, elem);
+		release (c, s);
+		cnt++;
+	}
+	c->empty_cnt = 0;
+	return cnt;
+}
+
+/* Returns cache C's empty slabs to the page allocator, and returns
+   the number of pages freed. */
+size_t
+kmem_cache_shrink (struct kmem_cache *c) {
+	size_t cnt;
+
+	lock_acquire (&c->lock);
+	cnt = shrink (c);
+	lock_release (&c->lock);
+	return cnt;
+}
+
+/* Returns the empty slabs of every cache to the page allocator,
+   for use when it runs short, and returns the number of pages
+   freed.  Skips caches that are busy, including any whose lock
+   the caller holds, such as a cache whose grow() ran the page
+   allocator short, so it is safe to call from within the
+   allocator. */
+size_t
+kmem_reap (void) {
+	struct list_elem *e;
+	size_t cnt = 0;
+
+	if (lock_held_by_current_thread (&all_caches_lock)
+			|| !lock_try_acquire (&all_caches_lock))
+		return 0;
+	for (e = list_begin (&all_caches); e != list_end (&all_caches);
+			e = list_next (e)) {
+		struct kmem_cache *c = list_entry (e, struct kmem_cache, elem);
+
+		if (!lock_held_by_current_thread (&c->lock)
+				&& lock_try_acquire (&c->lock)) {
+			cnt += shrink (c);
+			lock_release (&c->lock);
+		}
+	}
+	lock_release (&all_caches_lock);
+	return cnt;
+}
+
+/* Prints statistics for every cache. */
+void
+kmem_print_stats (void) {
+	struct list_elem *e;
+
+	for (e = list_begin (&all_caches); e != list_end (&all_caches);
+			e = list_next (e)) {
+		struct kmem_cache *c = list_entry (e, struct kmem_cache, elem);
+
+		printf ("Slab %s: %zu-byte objects, %zu per slab, %zu slabs, "
+				"%zu in use, %llu allocs, %llu frees, %llu grows, %llu reaps\n",
+				c->name, c->size, c->obj_cnt, c->slab_cnt, c->in_use,
+				c->alloc_cnt, c->free_cnt, c->grow_cnt, c->reap_cnt);
+	}
+}
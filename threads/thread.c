@@ -7,6 +7,8 @@
 #include "threads/flags.h"
 #include "threads/interrupt.h"
 #include "threads/intr-stubs.h"
+#include "threads/malloc.h"
+#include "threads/memstat.h"
 #include "threads/palloc.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
@@ -323,6 +325,8 @@ thread_exit (void) {
 #ifdef USERPROG
 	process_exit ();
 #endif
+	malloc_thread_exit ();
+	memstat_thread_exit ();
 	if (thread_mlfqs)
         list_remove(&thread_current()->all_elem);
 
@@ -435,6 +439,11 @@ idle (void *idle_started_ UNUSED) {
 	sema_up (idle_started);
 
 	for (;;) {
+		/* Zero free pages for later PAL_ZERO requests, until
+		   another thread is ready or there is no more to zero. */
+		while (list_empty (&ready_list) && palloc_prezero ())
+			continue;
+
 		/* Let someone else run. */
 		intr_disable ();
 		thread_block ();
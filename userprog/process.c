@@ -23,6 +23,7 @@
 #include "userprog/syscall.h"
 
 #ifdef VM
+#include "threads/slab.h"
 #include "vm/vm.h"
 #endif
 
@@ -722,8 +723,8 @@ lazy_load_segment (struct page *page, void *aux) {
 
 	file_seek(file, offsetof);
 	// 여기서 file을 page_read_bytes만큼 읽어옴
+	/* The frame belongs to the caller, which frees it on failure. */
 	if(file_read(file, page->frame->kva, page_read_bytes) != (int)page_read_bytes){
-		palloc_free_page(page->frame->kva);
 		// /**/printf("------- lazy_load_segment end false -------\n");
 		return false;
 	}
@@ -760,7 +761,7 @@ load_segment (struct file *file, off_t ofs, uint8_t *upage,
 		size_t page_zero_bytes = PGSIZE - page_read_bytes;
 
 		/* TODO: Set up aux to pass information to the lazy_load_segment. */
-		struct container *container = (struct container *)malloc(sizeof(struct container));
+		struct container *container = kmem_cache_alloc (container_cache);
 		container->file = file;
 		container->page_read_bytes = page_read_bytes;
 		container->offset = ofs;
@@ -11,6 +11,9 @@
 #include "userprog/process.h"
 #include "filesys/filesys.h"
 #include "filesys/file.h"
+#include "devices/input.h"
+#include "devices/timer.h"
+#include "threads/memstat.h"
 #include "threads/palloc.h"
 
 #include "threads/synch.h"
@@ -161,6 +164,12 @@ syscall_handler (struct intr_frame *f UNUSED) {
 			// /**/printf("SYS_MUNMAP\n");
 			munmap((void *)arg1);
 			break;
+		case SYS_CLOCK_NS:
+			f->R.rax = timer_now_ns ();
+			break;
+		case SYS_MEMSTAT:
+			memstat_print (false);
+			break;
 		default:
 			// /**/printf("default\n");
 			break;
@@ -253,19 +262,8 @@ int read (int fd, void *buffer, unsigned size){
 #else
 	user_memory_valid((void *)buffer);
 #endif
-	if (fd == STD_IN) {                // keyboard로 직접 입력
-		int i;  // 쓰레기 값 return 방지
-		char c;
-		unsigned char *buf = buffer;
-
-		for (i = 0; i < size; i++) {
-			c = input_getc();
-			*buf++ = c;
-			if (c == '\0')
-				break;
-		}
-		return i;
-	}
+	if (fd == STD_IN)                  // keyboard로 직접 입력
+		return input_read (buffer, size);
 
 	// buffer가 spt에 존재하는지 검사
 	
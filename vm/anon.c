@@ -5,7 +5,11 @@
 
 #include "string.h"
 #include "bitmap.h"
+#include "threads/malloc.h"
+#include "threads/slab.h"
 #include "threads/mmu.h"
+#include "threads/synch.h"
+#include "vm/zswap.h"
 
 /* DO NOT MODIFY BELOW LINE */
 static struct disk *swap_disk;
@@ -24,6 +28,106 @@ static const struct page_operations anon_ops = {
 struct bitmap *swap_table;
 size_t swap_max;
 
+/* A transfer of one page between memory and a swap slot.  All of
+   its sectors are queued at once, so that the disk driver can
+   merge them into a single transfer on the swap disk's channel,
+   which proceeds independently of file system I/O on the other
+   channel. */
+struct swap_io {
+	struct disk_request reqs[SWAP_SIZE];
+	int pending;                    /* Requests not yet completed. */
+	struct semaphore done;          /* Up'd when PENDING reaches 0. */
+	struct page *page;              /* Page swapped out, while its
+	                                   anon.writeback points here. */
+};
+
+/* Completion callback for one sector of a swap_io.  Runs in
+   interrupt context. */
+static void
+swap_io_complete (struct disk_request *r) {
+	struct swap_io *io = r->aux;
+
+	if (--io->pending == 0)
+		sema_up (&io->done);
+}
+
+/* Starts transferring swap slot SLOT into the page at KVA or, if
+   WRITE, the page at KVA into SLOT.  Returns the transfer, to be
+   passed to swap_io_wait().  If memory is short, does the transfer
+   synchronously and returns a null pointer. */
+static struct swap_io *
+swap_io_start (size_t slot, void *kva, bool write) {
+	struct swap_io *io = malloc (sizeof *io);
+	int i;
+
+	if (io == NULL) {
+		for (i = 0; i < SWAP_SIZE; i++) {
+			disk_sector_t sec_no = slot * SWAP_SIZE + i;
+			if (write)
+				disk_write (swap_disk, sec_no, kva + DISK_SECTOR_SIZE * i);
+			else
+				disk_read (swap_disk, sec_no, kva + DISK_SECTOR_SIZE * i);
+		}
+		return NULL;
+	}
+
+	io->pending = SWAP_SIZE;
+	sema_init (&io->done, 0);
+	io->page = NULL;
+	for (i = 0; i < SWAP_SIZE; i++) {
+		struct disk_request *r = &io->reqs[i];
+
+		disk_request_init (r, swap_disk, slot * SWAP_SIZE + i,
+				kva + DISK_SECTOR_SIZE * i, write);
+		r->done = swap_io_complete;
+		r->aux = io;
+	}
+	for (i = 0; i < SWAP_SIZE; i++)
+		disk_submit (&io->reqs[i]);
+	return io;
+}
+
+/* Waits for IO, if non-null, to complete and frees it. */
+static void
+swap_io_wait (struct swap_io *io) {
+	if (io != NULL) {
+		sema_down (&io->done);
+		free (io);
+	}
+}
+
+/* Waits for the swap-out of FRAME's previous contents, if one is
+   in flight, so that FRAME may be reused.  Until then, a fault on
+   the page swapped out copies it from FRAME instead of reading the
+   slot, whose write may not have reached the disk. */
+void
+anon_wait_frame (struct frame *frame) {
+	struct swap_io *io = frame->swap_io;
+	enum intr_level old_level;
+
+	if (io == NULL)
+		return;
+	sema_down (&io->done);
+	old_level = intr_disable ();
+	if (io->page != NULL)
+		io->page->anon.writeback = NULL;
+	frame->swap_io = NULL;
+	intr_set_level (old_level);
+	free (io);
+}
+
+/* Writes the page at KVA to a free swap slot and waits for the
+   write to complete.  Returns the slot, or BITMAP_ERROR if swap is
+   full. */
+size_t
+anon_write_slot (const void *kva) {
+	size_t slot = bitmap_scan_and_flip (swap_table, 0, 1, false);
+
+	if (slot != BITMAP_ERROR)
+		swap_io_wait (swap_io_start (slot, (void *) kva, true));
+	return slot;
+}
+
 /* Initialize the data for anonymous pages */
 void
 vm_anon_init (void) {
@@ -32,6 +136,7 @@ vm_anon_init (void) {
 	swap_disk = disk_get(1, 1);
 	swap_max = disk_size(swap_disk) / SWAP_SIZE;
 	swap_table = bitmap_create(swap_max);
+	zswap_init ();
 	// /**/printf("------- vm_anon_init end -------\n");
 }
 
@@ -46,20 +151,37 @@ anon_initializer (struct page *page, enum vm_type type, void *kva) {
 	struct anon_page *anon_page = &page->anon;
 
 	anon_page->slot = BITMAP_ERROR;
+	anon_page->zobj = NULL;
+	anon_page->writeback = NULL;
 	// /**/printf("------- anon_initializer end -------\n");
 	return true;
 }
 
-/* Swap in the page by read contents from the swap disk. */
+/* Swap in the page from the compressed cache or, if it is not
+   there, by reading its contents from the swap disk. */
 static bool
 anon_swap_in (struct page *page, void *kva) {
 	// /**/printf("------- anon_swap_in -------\n");
 	struct anon_page *anon_page = &page->anon;
+	enum intr_level old_level;
+
+	if (zswap_load (page, kva))
+		return true;
 	if (anon_page->slot == BITMAP_ERROR) {
 		return false;
 	}
-	for (int i=0; i<SWAP_SIZE; i++) {
-		disk_read(swap_disk, (anon_page->slot)*SWAP_SIZE+i, kva+DISK_SECTOR_SIZE*i);
+
+	/* If the swap-out is still in flight, the evicted frame has not
+	   been reused yet and still holds the page. */
+	old_level = intr_disable ();
+	if (anon_page->writeback != NULL) {
+		memcpy (kva, anon_page->writeback->kva, PGSIZE);
+		anon_page->writeback->swap_io->page = NULL;
+		anon_page->writeback = NULL;
+		intr_set_level (old_level);
+	} else {
+		intr_set_level (old_level);
+		swap_io_wait (swap_io_start (anon_page->slot, kva, false));
 	}
 	bitmap_set(swap_table, anon_page->slot, false);
 	anon_page->slot = BITMAP_ERROR;
@@ -67,46 +189,76 @@ anon_swap_in (struct page *page, void *kva) {
 	// /**/printf("------- anon_swap_in end -------\n");
 }
 
-/* Swap out the page by writing contents to the swap disk. */
+/* Swap out the page by compressing it into the compressed cache
+   or, if that fails, by writing its contents to the swap disk.
+   Fails, leaving the page mapped, if swap is full. */
 static bool
 anon_swap_out (struct page *page) {
 	// /**/printf("------- anon_swap_out -------\n");
 	struct anon_page *anon_page = &page->anon;
+
+	/* Take a slot before touching the mapping, so that nothing needs
+	   undoing if there is none. */
 	size_t swap_idx = bitmap_scan_and_flip (swap_table, 0, 1, false);
 	if (swap_idx == BITMAP_ERROR) {
 		return false;
 	}
-	for (int i=0; i<SWAP_SIZE; i++) {
-		disk_write(swap_disk, swap_idx*SWAP_SIZE+i, (page->va)+DISK_SECTOR_SIZE*i);
+
+	/* Unmap first, from the page's own process, which need not be
+	   the one evicting it, so that the page cannot change while it
+	   is being compressed or written. */
+	pml4_clear_page(page->owner->pml4, page->va);
+	if (zswap_store (page, page->frame->kva)) {
+		bitmap_reset (swap_table, swap_idx);
+		page->frame->page = NULL;
+		page->frame = NULL;
+		return true;
+	}
+	/* Write from the frame's kernel address.  The write completes
+	   asynchronously; whoever reuses the frame waits for it with
+	   anon_wait_frame(). */
+	ASSERT (page->frame->swap_io == NULL);
+	page->frame->swap_io = swap_io_start (swap_idx, page->frame->kva, true);
+	if (page->frame->swap_io != NULL) {
+		enum intr_level old_level = intr_disable ();
+		page->frame->swap_io->page = page;
+		anon_page->writeback = page->frame;
+		intr_set_level (old_level);
 	}
+
 	anon_page->slot = swap_idx;
 	page->frame->page = NULL;
 	page->frame = NULL;
 
-	pml4_clear_page(thread_current()->pml4, page->va);
-
 	return true;
 	// /**/printf("------- anon_swap_out end -------\n");
 }
 
-/* Destroy the anonymous page. PAGE will be freed by the caller. */
+/* Destroy the anonymous page. PAGE will be freed by the caller,
+ * which also unmaps it, usually together with its neighbors by
+ * pml4_clear_range(). */
 static void
 anon_destroy (struct page *page) {
 	// /**/printf("------- anon_destroy -------\n");
 	struct anon_page *anon_page = &page->anon;
 	
 	// mytodo : destroy코드 필요? (있든 없든 결과는 같음. <24.10.11 anonymous 작성중>)
+    zswap_invalidate (page);
+    enum intr_level old_level = intr_disable ();
+    if (anon_page->writeback != NULL) {
+        anon_page->writeback->swap_io->page = NULL;
+        anon_page->writeback = NULL;
+    }
+    intr_set_level (old_level);
     if (anon_page->slot != BITMAP_ERROR)
         bitmap_reset(swap_table, anon_page->slot);
 
 	if (page->frame) {
-		list_remove(&page->frame->elem);
+		frame_table_remove (page->frame);
 		page->frame->page = NULL;
-		free(page->frame);
+		kmem_cache_free (frame_cache, page->frame);
 		page->frame = NULL;
 		// palloc_free_page(page);		리팩토링 실패. 왜 해제하려 하면 터지는거임?
 	}
-
-	pml4_clear_page(thread_current()->pml4, page->va);
 	// /**/printf("------- anon_destroy end -------\n");
 }
@@ -6,6 +6,7 @@
 #include "userprog/syscall.h"
 
 #include "threads/mmu.h"
+#include "threads/slab.h"
 
 static bool file_backed_swap_in (struct page *page, void *kva);
 static bool file_backed_swap_out (struct page *page);
@@ -58,40 +59,43 @@ static bool
 file_backed_swap_out (struct page *page) {
 	// /**/printf("------- file_backed_swap_out -------\n");
 	struct file_page *file_page UNUSED = &page->file;
-	if (pml4_is_dirty(thread_current()->pml4, page->va)) {
-		file_write_at(file_page->file, page->va, file_page->page_read_bytes, file_page->offset);
-		pml4_set_dirty(thread_current()->pml4, page->va, false);
-	}
+	uint64_t *pml4 = page->owner->pml4;
+	bool dirty = pml4_is_dirty(pml4, page->va);
+
+	/* Unmap first, from the page's own process, which need not be
+	 * the one evicting it, so that the page cannot change while it
+	 * is written back.  Write from the frame, since PAGE->VA is
+	 * only meaningful in the owner's address space. */
+	pml4_clear_page(pml4, page->va);
+	if (dirty)
+		file_write_at(file_page->file, page->frame->kva, file_page->page_read_bytes, file_page->offset);
 
 	page->frame->page = NULL;
 	page->frame = NULL;
-    pml4_clear_page(thread_current()->pml4, page->va);
 	
 	return true;
 	// /**/printf("------- file_backed_swap_out end -------\n");
 }
 
-/* Destory the file backed page. PAGE will be freed by the caller. */
+/* Destory the file backed page. PAGE will be freed by the caller,
+ * which also unmaps it, usually together with its neighbors by
+ * pml4_clear_range(). */
 static void
 file_backed_destroy (struct page *page) {
 	// /**/printf("------- file_backed_destroy -------\n");
 	struct file_page *file_page UNUSED = &page->file;
 
-	if (pml4_is_dirty(thread_current()->pml4, page->va)) {
+	if (pml4_is_dirty(thread_current()->pml4, page->va))
 		file_write_at(file_page->file, page->va, file_page->page_read_bytes, file_page->offset);
-		pml4_set_dirty(thread_current()->pml4, page->va, false);
-	}
 
 	if (page->frame) {
-		list_remove(&page->frame->elem);
+		frame_table_remove (page->frame);
 		page->frame->page = NULL;
 		page->frame = NULL;
 		// palloc_free_page(page->frame->kva);
-		free(page->frame);
+		kmem_cache_free (frame_cache, page->frame);
 		// palloc_free_page(page);		리팩토링 실패. 왜 해제하려 하면 터지는거임?
 	}
-
-	pml4_clear_page(thread_current()->pml4, page->va);
 	// free(page);
 	// /**/printf("------- file_backed_destroy end -------\n");
 }
@@ -128,7 +132,7 @@ do_mmap (void *addr, size_t length, int writable,
 		size_t page_zero_bytes = PGSIZE - page_read_bytes;
 
 		/* TODO: Set up aux to pass information to the lazy_load_segment. */
-		struct container *container = (struct container *)malloc(sizeof(struct container));
+		struct container *container = kmem_cache_alloc (container_cache);
 		container->file = mfile;
 		container->page_read_bytes = page_read_bytes;
 		container->offset = offset;
@@ -137,7 +141,7 @@ do_mmap (void *addr, size_t length, int writable,
 		if (!vm_alloc_page_with_initializer (VM_FILE, addr,
 					writable, lazy_load_segment, container)){
 			// /**/printf("------- do_mmap end false -------\n");
-			free(container);
+			kmem_cache_free (container_cache, container);
 			return NULL;
 		}
 
@@ -156,6 +160,7 @@ void do_munmap(void *addr) {
 	// /**/printf("------- do_munmap -------\n");
     struct thread *curr = thread_current();
     struct page *page;
+    void *start = addr;
     while ((page = spt_find_page(&curr->spt, addr))) {
 		// printf("\npage va : %p", page->va);
 		if(page){
@@ -166,5 +171,8 @@ void do_munmap(void *addr) {
 		}
 		addr += PGSIZE;
 	}
+
+	/* Unmap the whole mapping at once, with one TLB flush. */
+	pml4_clear_range (curr->pml4, start, (addr - start) / PGSIZE);
 	// /**/printf("------- do_munmap end -------\n");
 }
\ No newline at end of file
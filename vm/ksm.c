@@ -0,0 +1,351 @@
+/* ksm.c: Merging of identical anonymous pages. */
+
+#include "vm/ksm.h"
+#include <debug.h>
+#include <list.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "threads/interrupt.h"
+#include "threads/malloc.h"
+#include "threads/mmu.h"
+#include "threads/palloc.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#include "vm/vm.h"
+
+/* Processes forked from one parent often end up with many
+   anonymous pages that hold the same bytes, such as zeroed buffers
+   and tables computed the same way in each.  When turned on with
+   the -ksm kernel option, a kernel thread, "ksmd", walks the frame
+   table looking for them, examining ksm_batch frames and then
+   sleeping for ksm_sleep_ms milliseconds.  It maps each page that
+   it finds to be identical to another read-only to a single
+   "merged" frame, and frees the frame the page had.  A write to a
+   merged page faults, and vm_handle_wp() gives the writer a
+   private copy again, as it does for pages shared by fork().
+
+   Merged frames are found through a table of "stable" nodes,
+   hashed by checksum.  A page that matches none becomes a
+   candidate for the rest of the pass, in a table that holds the
+   latest candidate with each checksum, so that a later page with
+   the same contents can be merged with it.  Only pages whose
+   checksum has not changed since the previous pass become
+   candidates, so that pages being written are not merged only to
+   be copied again at once.  Pages whose frame is already shared,
+   by fork(), are left alone.
+
+   Merged frames are never evicted.  At the end of each pass, ksmd
+   counts the pages that share each merged frame and frees those
+   that no page uses any more.
+
+   ksmd examines each frame with interrupts off, so that nothing
+   changes under it.  Code that changes the frame table does so
+   with interrupts off too.  ksmd skips pages whose mapping does
+   not match their frame, because they are being loaded, and frames
+   marked busy, because a write fault is copying their page.
+   ksmd keeps its place in the frame table with a marker frame that
+   holds no page. */
+
+/* Number of buckets in the tables of merged frames and of
+   candidates. */
+#define STABLE_BUCKETS 64
+#define CAND_CNT 256
+
+/* Defaults for the tunables. */
+#define BATCH_DEFAULT 100
+#define SLEEP_MS_DEFAULT 20
+
+/* A merged frame. */
+struct ksm_node {
+	struct list_elem elem;      /* In stable[]. */
+	void *kva;                  /* The frame. */
+	uint32_t sum;               /* Checksum of its contents. */
+	size_t refs;                /* Pages mapping it. */
+};
+
+/* A page that may be merged with a later one. */
+struct cand {
+	struct frame *frame;        /* Frame, or null if none. */
+	void *kva;                  /* FRAME's kva when it became a candidate. */
+};
+
+/* Tunables, set by ksm_configure(). */
+static size_t ksm_batch;        /* Frames per batch, 0 if ksmd is off. */
+static unsigned ksm_sleep_ms = SLEEP_MS_DEFAULT;  /* Sleep between batches. */
+
+static struct list stable[STABLE_BUCKETS];
+static struct cand cands[CAND_CNT];
+static struct frame cursor;     /* ksmd's place in the frame table. */
+
+/* Statistics. */
+static size_t shared_cnt;       /* Merged frames in use. */
+static size_t sharing_cnt;      /* Pages mapping them, beyond one each. */
+static unsigned long long merge_cnt;    /* Pages merged. */
+static unsigned long long pass_cnt;     /* Passes over the frame table. */
+
+static thread_func ksmd;
+
+/* Configures ksmd from the -ksm kernel command-line option's VALUE,
+   "PAGES[,MS]", to examine PAGES frames every MS milliseconds.  A
+   null VALUE selects the defaults. */
+void
+ksm_configure (const char *value) {
+	ksm_batch = BATCH_DEFAULT;
+	if (value != NULL) {
+		const char *ms = strchr (value, ',');
+
+		ksm_batch = atoi (value);
+		if (ms != NULL)
+			ksm_sleep_ms = atoi (ms + 1);
+	}
+}
+
+/* Starts ksmd, if ksm_configure() asked for it.  Must be called
+   after the frame table is initialized. */
+void
+ksm_init (void) {
+	size_t i;
+
+	if (ksm_batch == 0)
+		return;
+
+	for (i = 0; i < STABLE_BUCKETS; i++)
+		list_init (&stable[i]);
+	frame_table_insert (&cursor);
+	thread_create ("ksmd", PRI_DEFAULT, ksmd, NULL);
+}
+
+/* Forgets FRAME as a candidate, since it is leaving the frame
+   table.  Called by frame_table_remove() with interrupts off. */
+void
+ksm_forget (struct frame *frame) {
+	struct cand *c = &cands[frame->ksm_sum % CAND_CNT];
+
+	ASSERT (intr_get_level () == INTR_OFF);
+	if (c->frame == frame)
+		c->frame = NULL;
+}
+
+/* Returns a checksum of the page at KVA. */
+static uint32_t
+checksum (const void *kva) {
+	const uint64_t *p = kva;
+	uint64_t h = 0;
+	size_t i;
+
+	for (i = 0; i < PGSIZE / sizeof *p; i++)
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	return h ^ (h >> 32);
+}
+
+/* Returns true if a frame other than FRAME holds the page at KVA,
+   including a frame that vm_handle_wp() is copying it out of,
+   which keeps its kva until the copy is done. */
+static bool
+kva_shared (void *kva, struct frame *frame) {
+	struct list_elem *e;
+
+	for (e = list_begin (&frame_table); e != list_end (&frame_table);
+			e = list_next (e)) {
+		struct frame *f = list_entry (e, struct frame, elem);
+
+		if (f != frame && f->kva == kva)
+			return true;
+	}
+	return false;
+}
+
+/* Returns true if FRAME holds an anonymous page that is mapped to
+   it and not being copied, so that it may be merged unless
+   kva_shared(). */
+static bool
+mergeable (struct frame *frame) {
+	struct page *page = frame->page;
+
+	return (page != NULL && page->frame == frame
+			&& page->operations->type == VM_ANON
+			&& frame->swap_io == NULL && frame->ksm == NULL && !frame->busy
+			&& page->owner->pml4 != NULL
+			&& pml4_get_page (page->owner->pml4, page->va) == frame->kva);
+}
+
+/* Maps FRAME's page read-only to merged frame NODE and frees the
+   page FRAME had.  Returns true if successful. */
+static bool
+merge (struct frame *frame, struct ksm_node *node) {
+	struct page *page = frame->page;
+	void *kva = frame->kva;
+
+	if (!pml4_set_page (page->owner->pml4, page->va, node->kva, false))
+		return false;
+	page->ori_writable = page->writable;
+	frame->kva = node->kva;
+	frame->ksm = node;
+	node->refs++;
+	palloc_free_page (kva);
+	merge_cnt++;
+	return true;
+}
+
+/* Makes candidate C's frame, whose contents have checksum SUM,
+   into a merged frame described by NODE.  Returns true if
+   successful. */
+static bool
+make_stable (struct cand *c, uint32_t sum, struct ksm_node *node) {
+	struct page *page = c->frame->page;
+
+	if (!pml4_set_page (page->owner->pml4, page->va, c->kva, false))
+		return false;
+	page->ori_writable = page->writable;
+	c->frame->ksm = node;
+	node->kva = c->kva;
+	node->sum = sum;
+	node->refs = 1;
+	list_push_back (&stable[sum % STABLE_BUCKETS], &node->elem);
+	c->frame = NULL;
+	return true;
+}
+
+/* Examines FRAME, merging it with a merged frame or candidate with
+   the same contents if there is one.  *SPARE must be a node for a
+   new merged frame, and is set to null if it is used.  Interrupts
+   must be off. */
+static void
+scan_frame (struct frame *frame, struct ksm_node **spare) {
+	struct list *bucket;
+	struct list_elem *e;
+	struct cand *c;
+	uint32_t sum;
+	bool stable_sum;
+
+	if (!mergeable (frame))
+		return;
+	sum = checksum (frame->kva);
+	stable_sum = sum == frame->ksm_sum;
+	frame->ksm_sum = sum;
+
+	bucket = &stable[sum % STABLE_BUCKETS];
+	for (e = list_begin (bucket); e != list_end (bucket); e = list_next (e)) {
+		struct ksm_node *node = list_entry (e, struct ksm_node, elem);
+
+		if (node->sum == sum && !memcmp (node->kva, frame->kva, PGSIZE)) {
+			if (!kva_shared (frame->kva, frame))
+				merge (frame, node);
+			return;
+		}
+	}
+	if (!stable_sum)
+		return;
+
+	c = &cands[sum % CAND_CNT];
+	if (c->frame != NULL && c->frame != frame && c->frame->ksm_sum == sum
+			&& c->frame->kva == c->kva && mergeable (c->frame)
+			&& !memcmp (c->kva, frame->kva, PGSIZE)) {
+		struct ksm_node *node = *spare;
+
+		if (!kva_shared (c->kva, c->frame) && !kva_shared (frame->kva, frame)
+				&& make_stable (c, sum, node)) {
+			*spare = NULL;
+			merge (frame, node);
+		}
+	} else {
+		c->frame = frame;
+		c->kva = frame->kva;
+	}
+}
+
+/* Finishes a pass over the frame table: counts the pages mapping
+   each merged frame, frees those that are no longer used, and
+   forgets the pass's candidates.  Interrupts must be off.  Moves
+   the nodes of merged frames to free to DEAD. */
+static void
+end_pass (struct list *dead) {
+	struct list_elem *e;
+	size_t i;
+
+	ASSERT (intr_get_level () == INTR_OFF);
+	for (i = 0; i < STABLE_BUCKETS; i++)
+		for (e = list_begin (&stable[i]); e != list_end (&stable[i]);
+				e = list_next (e))
+			list_entry (e, struct ksm_node, elem)->refs = 0;
+	for (e = list_begin (&frame_table); e != list_end (&frame_table);
+			e = list_next (e)) {
+		struct frame *f = list_entry (e, struct frame, elem);
+
+		if (f->ksm != NULL)
+			f->ksm->refs++;
+	}
+
+	shared_cnt = sharing_cnt = 0;
+	for (i = 0; i < STABLE_BUCKETS; i++)
+		for (e = list_begin (&stable[i]); e != list_end (&stable[i]); ) {
+			struct ksm_node *node = list_entry (e, struct ksm_node, elem);
+
+			e = list_next (e);
+			if (node->refs == 0) {
+				list_remove (&node->elem);
+				list_push_back (dead, &node->elem);
+			} else {
+				shared_cnt++;
+				sharing_cnt += node->refs - 1;
+			}
+		}
+
+	memset (cands, 0, sizeof cands);
+	pass_cnt++;
+}
+
+/* The ksmd thread. */
+static void
+ksmd (void *aux UNUSED) {
+	struct ksm_node *spare = NULL;
+	int64_t ticks = ksm_sleep_ms * TIMER_FREQ / 1000;
+
+	for (;;) {
+		struct list dead;
+		size_t i;
+
+		list_init (&dead);
+		for (i = 0; i < ksm_batch; i++) {
+			enum intr_level old_level;
+			struct list_elem *e;
+
+			if (spare == NULL && (spare = malloc (sizeof *spare)) == NULL)
+				break;
+
+			/* Step the cursor over the next frame and examine it. */
+			old_level = intr_disable ();
+			e = list_next (&cursor.elem);
+			list_remove (&cursor.elem);
+			if (e == list_end (&frame_table)) {
+				list_push_front (&frame_table, &cursor.elem);
+				end_pass (&dead);
+			} else {
+				list_insert (list_next (e), &cursor.elem);
+				scan_frame (list_entry (e, struct frame, elem), &spare);
+			}
+			intr_set_level (old_level);
+		}
+
+		while (!list_empty (&dead)) {
+			struct ksm_node *node = list_entry (list_pop_front (&dead),
+					struct ksm_node, elem);
+
+			palloc_free_page (node->kva);
+			free (node);
+		}
+		timer_sleep (ticks > 0 ? ticks : 1);
+	}
+}
+
+/* Prints merging statistics. */
+void
+ksm_print_stats (void) {
+	if (ksm_batch == 0)
+		return;
+	printf ("KSM: %zu merged pages shared by %zu more, %llu merges "
+			"in %llu passes\n", shared_cnt, sharing_cnt, merge_cnt, pass_cnt);
+}
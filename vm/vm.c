@@ -1,13 +1,27 @@
 /* vm.c: Generic interface for virtual memory objects. */
 
 #include "threads/malloc.h"
+#include "threads/slab.h"
+#include "userprog/process.h"
 #include "vm/vm.h"
 #include "vm/inspect.h"
+#include "vm/ksm.h"
 
 #include "include/threads/mmu.h"
 
 struct list frame_table;
 
+/* Victims whose swap-out is in flight, oldest first.  Up to
+ * EVICT_AHEAD are kept, so that each eviction starts one write and
+ * reuses the frame whose write has had the longest to finish. */
+#define EVICT_AHEAD 4
+static struct list evicting;
+static size_t evicting_cnt;
+
+struct kmem_cache *page_cache;
+struct kmem_cache *frame_cache;
+struct kmem_cache *container_cache;
+
 /* Initializes the virtual memory subsystem by invoking each subsystem's
  * intialize codes. */
 void
@@ -23,6 +37,12 @@ vm_init (void) {
 	/* TODO: Your code goes here. */
 	
 	list_init(&frame_table);
+	list_init (&evicting);
+	page_cache = kmem_cache_create ("page", sizeof (struct page), NULL);
+	frame_cache = kmem_cache_create ("frame", sizeof (struct frame), NULL);
+	container_cache = kmem_cache_create ("container",
+			sizeof (struct container), NULL);
+	ksm_init ();
 	// /**/printf("------- vm_init end -------\n");
 }
 
@@ -45,8 +65,15 @@ page_get_type (struct page *page) {
 /* Helpers */
 static struct frame *vm_get_victim (void);
 static bool vm_do_claim_page (struct page *page);
+static bool vm_claim_huge (struct page *page, bool *success);
 static struct frame *vm_evict_frame (void);
 
+/* How to undo the initialization of a page, for vm_claim_huge(). */
+struct huge_undo {
+	const struct page_operations *operations;
+	struct uninit_page uninit;
+};
+
 /* Create the pending page object with initializer. If you want to create a
  * page, do not create it directly and make it through this function or
  * `vm_alloc_page`. */
@@ -65,7 +92,7 @@ vm_alloc_page_with_initializer (enum vm_type type, void *upage, bool writable,
 		/* TODO: Create the page, fetch the initialier according to the VM type,
 		 * TODO: and then create "uninit" page struct by calling uninit_new. You
 		 * TODO: should modify the field after calling the uninit_new. */
-		struct page *page = (struct page *)malloc(sizeof(struct page));
+		struct page *page = kmem_cache_alloc (page_cache);
 	
 		typedef bool (*initializerFunc)(struct page *, enum vm_type, void *);
 		initializerFunc initializer = NULL;
@@ -82,6 +109,7 @@ vm_alloc_page_with_initializer (enum vm_type type, void *upage, bool writable,
 
 		// page member 초기화
 		page->writable = writable;
+		page->owner = thread_current ();
 		/* TODO: Insert the page into the spt. */
 		// /**/printf("------- vm_alloc_page_with_initializer end -------\n");
 		return spt_insert_page(spt, page);
@@ -129,19 +157,55 @@ spt_insert_page (struct supplemental_page_table *spt UNUSED,
 void
 spt_remove_page (struct supplemental_page_table *spt, struct page *page) {
 	// /**/printf("------- spt_remove_page -------\n");
+	void *va = page->va;
+
 	hash_delete(&spt->spt_hash, &page->elem);
 	vm_dealloc_page (page);
+	pml4_clear_page (thread_current ()->pml4, va);
 	// /**/printf("------- spt_remove_page end -------\n");
 	return true;
 }
 
+/* Adds FRAME to the frame table. */
+void
+frame_table_insert (struct frame *frame) {
+	enum intr_level old_level = intr_disable ();
+	list_push_back (&frame_table, &frame->elem);
+	intr_set_level (old_level);
+}
+
+/* Removes FRAME from the frame table. */
+void
+frame_table_remove (struct frame *frame) {
+	enum intr_level old_level = intr_disable ();
+	list_remove (&frame->elem);
+	ksm_forget (frame);
+	intr_set_level (old_level);
+}
+
 /* Get the struct frame, that will be evicted. */
 static struct frame *
 vm_get_victim (void) {
 	/* TODO: The policy for eviction is up to you. */
 	// /**/printf("------- vm_get_victim -------\n");
-	struct list_elem *e = list_pop_front(&frame_table);
-	struct frame *victim = list_entry(e, struct frame, elem);
+	struct frame *victim = NULL;
+	struct list_elem *e;
+	enum intr_level old_level = intr_disable ();
+
+	/* Skip frames not holding a page yet, which include ksmd's
+	 * place marker, merged frames, which other pages share, and
+	 * frames being copied by vm_handle_wp(). */
+	for (e = list_begin (&frame_table); e != list_end (&frame_table);
+			e = list_next (e)) {
+		struct frame *f = list_entry (e, struct frame, elem);
+
+		if (f->page != NULL && f->ksm == NULL && !f->busy) {
+			victim = f;
+			frame_table_remove (victim);
+			break;
+		}
+	}
+	intr_set_level (old_level);
 	// /**/printf("------- vm_get_victim end -------\n");
 	return victim;
 }
@@ -151,12 +215,38 @@ vm_get_victim (void) {
 static struct frame *
 vm_evict_frame (void) {
 	// /**/printf("------- vm_evict_frame -------\n");
-	struct frame *victim UNUSED = vm_get_victim ();
+	struct frame *victim;
+	enum intr_level old_level;
+
 	/* TODO: swap out the victim and return the evicted frame. */
-	bool success = swap_out(victim->page);
-	if (!success) {
+	while (evicting_cnt < EVICT_AHEAD) {
+		victim = vm_get_victim ();
+		if (victim == NULL)
+			break;
+		if (!swap_out (victim->page)) {
+			/* vm_get_victim() took it out of the frame table. */
+			frame_table_insert (victim);
+			break;
+		}
+		old_level = intr_disable ();
+		list_push_back (&evicting, &victim->elem);
+		evicting_cnt++;
+		intr_set_level (old_level);
+	}
+
+	old_level = intr_disable ();
+	if (list_empty (&evicting)) {
+		intr_set_level (old_level);
 		return NULL;
 	}
+	victim = list_entry (list_pop_front (&evicting), struct frame, elem);
+	evicting_cnt--;
+	intr_set_level (old_level);
+
+	/* Only this frame's write-back needs to finish before the frame
+	   is reused; the later victims' writes stay queued on the swap
+	   disk's channel while file system I/O proceeds on the other. */
+	anon_wait_frame (victim);
 
 	// /**/printf("------- vm_evict_frame end -------\n");
 	return victim;
@@ -171,17 +261,23 @@ vm_get_frame (void) {
 	// /**/printf("------- vm_get_frame -------\n");
 	struct frame *frame = NULL;
 	/* TODO: Fill this function. */
-	frame = (struct frame *)malloc(sizeof (struct frame));
-	frame->kva = palloc_get_page(PAL_USER | PAL_ZERO);
-	
-	if (frame->kva == NULL) {
+	void *kva = palloc_get_page(PAL_USER | PAL_ZERO);
+
+	if (kva == NULL) {
 		frame = vm_evict_frame();
 		// /**/printf("------- vm_get_frame end kva NULL -------\n");
+	} else {
+		frame = kmem_cache_alloc (frame_cache);
+		frame->kva = kva;
+		frame->swap_io = NULL;
 	}
+	ASSERT (frame != NULL);
 	frame->page = NULL;
-	list_push_back (&frame_table, &frame->elem);
+	frame->ksm = NULL;
+	frame->ksm_sum = 0;
+	frame->busy = false;
+	frame_table_insert (frame);
 	
-	ASSERT (frame != NULL);
 	ASSERT (frame->page == NULL);
 	// /**/printf("------- vm_get_frame end -------\n");
 	return frame;
@@ -210,18 +306,43 @@ vm_handle_wp (struct page *page UNUSED) {
 	if (!page->ori_writable)
 		return false;
 
-	void *kva = page->frame->kva;
+	/* Mark the frame busy while its page is copied, so that ksmd
+	 * neither merges it nor, seeing its kva still in use, merges a
+	 * fork() sibling that shares the kva and frees it.  Eviction
+	 * skips it too. */
+	struct frame *frame = page->frame;
+	enum intr_level old_level = intr_disable ();
+	void *kva = frame->kva;
+	frame->busy = true;
+	intr_set_level (old_level);
 
-	page->frame->kva = palloc_get_page(PAL_USER | PAL_ZERO);
+	void *new_kva = palloc_get_page (PAL_USER);
 
-	if (page->frame->kva == NULL)
-		page->frame = vm_evict_frame();
+	if (new_kva == NULL) {
+		struct frame *victim = vm_evict_frame ();
 
-	memcpy(page->frame->kva, kva, PGSIZE);
+		if (victim == NULL) {
+			frame->busy = false;
+			return false;
+		}
+		new_kva = victim->kva;
+		kmem_cache_free (frame_cache, victim);
+	}
 
-	if (!pml4_set_page(thread_current()->pml4, page->va, page->frame->kva, page->ori_writable))
+	memcpy(new_kva, kva, PGSIZE);
+
+	if (!pml4_set_page(thread_current()->pml4, page->va, new_kva, page->ori_writable)) {
+		palloc_free_page (new_kva);
+		frame->busy = false;
 		return false;
+	}
 
+	/* If the page was merged by ksmd, it has its own copy now. */
+	old_level = intr_disable ();
+	frame->kva = new_kva;
+	frame->ksm = NULL;
+	frame->busy = false;
+	intr_set_level (old_level);
 	return true;
 	// /**/printf("------- vm_handle_wp end -------\n");
 }
@@ -263,7 +384,7 @@ void
 vm_dealloc_page (struct page *page) {
 	// /**/printf("------- vm_dealloc_page -------\n");
 	destroy (page);
-	free (page);
+	kmem_cache_free (page_cache, page);
 	// /**/printf("------- vm_dealloc_page end -------\n");
 }
 
@@ -294,6 +415,11 @@ vm_do_claim_page(struct page *page)
 	if (!page || !is_user_vaddr(page->va)) {
 		return false;
 	}
+
+	bool success;
+	if (vm_claim_huge (page, &success))
+		return success;
+
 	struct frame *frame = vm_get_frame();
 	
 	/* Set links */
@@ -309,6 +435,146 @@ vm_do_claim_page(struct page *page)
 	return swap_in(page, frame->kva);
 }
 
+/* Returns true if the pages of the 2 MB region that starts at
+ * START are all in SPT, not yet claimed, and of the same type and
+ * writability as PAGE, which is one of them. */
+static bool
+huge_region_unclaimed (struct supplemental_page_table *spt,
+		struct page *page, uint8_t *start) {
+	size_t i;
+
+	if (!is_user_vaddr (start + HUGE_PGSIZE - 1))
+		return false;
+	for (i = 0; i < HUGE_PGCNT; i++) {
+		struct page *p = spt_find_page (spt, start + i * PGSIZE);
+
+		if (p == NULL || p->frame != NULL
+				|| VM_TYPE (p->operations->type) != VM_UNINIT
+				|| VM_TYPE (p->uninit.type) != VM_TYPE (page->uninit.type)
+				|| p->writable != page->writable)
+			return false;
+	}
+	return true;
+}
+
+/* Claims PAGE along with the rest of its 2 MB region and maps the
+ * region with a single huge page, if the region is all anonymous
+ * or all file-backed pages that have never been claimed and 2 MB
+ * of aligned, contiguous memory is free in the user pool.  Large
+ * anonymous regions and mmaps then fault once per 2 MB and take a
+ * single TLB entry.
+ *
+ * Each page still gets a frame of its own, so that eviction,
+ * copy-on-write, munmap and exit handle it like any other page;
+ * whatever changes the mapping of one page splits the huge page
+ * into 4 kB mappings first (see threads/mmu.c).
+ *
+ * Returns false, having done nothing, if the region does not
+ * qualify or any of its pages fails to load.  Otherwise, returns
+ * true and sets *SUCCESS to whether the pages were mapped. */
+static bool
+vm_claim_huge (struct page *page, bool *success) {
+	struct supplemental_page_table *spt = &thread_current ()->spt;
+	uint8_t *start = (uint8_t *) ((uint64_t) page->va & ~HUGE_PGMASK);
+	struct huge_undo *undo;
+	struct list frames;
+	uint8_t *kva;
+	size_t i, loaded;
+
+	if (VM_TYPE (page->operations->type) != VM_UNINIT
+			|| !huge_region_unclaimed (spt, page, start))
+		return false;
+
+	/* Obtain 2 MB of physical memory, aligned so that one page
+	 * directory entry can map it, a frame for each page, and room
+	 * to remember how to turn the pages back into uninit pages. */
+	undo = malloc (HUGE_PGCNT * sizeof *undo);
+	if (undo == NULL)
+		return false;
+	kva = palloc_get_multiple (PAL_USER | PAL_ZERO, HUGE_PGCNT);
+	if (kva == NULL) {
+		free (undo);
+		return false;
+	}
+	if (vtop (kva) & HUGE_PGMASK) {
+		palloc_free_multiple (kva, HUGE_PGCNT);
+		free (undo);
+		return false;
+	}
+	list_init (&frames);
+	for (i = 0; i < HUGE_PGCNT; i++) {
+		struct frame *frame = kmem_cache_alloc (frame_cache);
+
+		if (frame == NULL) {
+			while (!list_empty (&frames))
+				kmem_cache_free (frame_cache, list_entry (
+							list_pop_front (&frames), struct frame, elem));
+			palloc_free_multiple (kva, HUGE_PGCNT);
+			free (undo);
+			return false;
+		}
+		list_push_back (&frames, &frame->elem);
+	}
+
+	/* Load every page into its frame.  The frames join the frame
+	 * table only once all of them are loaded, so that none is
+	 * evicted from under a failed claim. */
+	for (i = 0; i < HUGE_PGCNT; i++) {
+		struct page *p = spt_find_page (spt, start + i * PGSIZE);
+		struct frame *frame = list_entry (list_pop_front (&frames),
+				struct frame, elem);
+
+		frame->kva = kva + i * PGSIZE;
+		frame->swap_io = NULL;
+		frame->ksm = NULL;
+		frame->ksm_sum = 0;
+		frame->busy = false;
+		frame->page = p;
+		p->frame = frame;
+	}
+	for (loaded = 0; loaded < HUGE_PGCNT; loaded++) {
+		struct page *p = spt_find_page (spt, start + loaded * PGSIZE);
+
+		undo[loaded].operations = p->operations;
+		undo[loaded].uninit = p->uninit;
+		if (!swap_in (p, p->frame->kva))
+			break;
+	}
+
+	/* If any page failed to load, put every page back the way it
+	 * was, including the one that failed part way, and let the
+	 * fault be handled one page at a time. */
+	for (i = 0; i < HUGE_PGCNT; i++) {
+		struct page *p = spt_find_page (spt, start + i * PGSIZE);
+
+		if (loaded == HUGE_PGCNT)
+			frame_table_insert (p->frame);
+		else {
+			if (i <= loaded) {
+				p->operations = undo[i].operations;
+				p->uninit = undo[i].uninit;
+			}
+			kmem_cache_free (frame_cache, p->frame);
+			p->frame = NULL;
+		}
+	}
+	free (undo);
+	if (loaded < HUGE_PGCNT) {
+		palloc_free_multiple (kva, HUGE_PGCNT);
+		return false;
+	}
+
+	/* Map the region, one page at a time if there is no memory
+	 * for a huge page's spare page table. */
+	*success = true;
+	if (!pml4_set_huge_page (thread_current ()->pml4, start, kva,
+				page->writable))
+		for (i = 0; i < HUGE_PGCNT && *success; i++)
+			*success = pml4_set_page (thread_current ()->pml4,
+					start + i * PGSIZE, kva + i * PGSIZE, page->writable);
+	return true;
+}
+
 /* Initialize new supplemental page table */
 void
 supplemental_page_table_init (struct supplemental_page_table *spt UNUSED) {
@@ -358,7 +624,7 @@ bool supplemental_page_table_copy(struct supplemental_page_table *dst UNUSED, st
 				if (page == NULL)
 					goto err;
 
-				struct frame *frame = (struct frame *)malloc(sizeof(struct frame));
+				struct frame *frame = kmem_cache_alloc (frame_cache);
 
 				if (!frame)
 					goto err;
@@ -366,14 +632,23 @@ bool supplemental_page_table_copy(struct supplemental_page_table *dst UNUSED, st
 				page->ori_writable = writable;
 				frame->page = page;
 				page->frame = frame;
+				frame->swap_io = NULL;
+				frame->ksm_sum = 0;
+				frame->busy = false;
+
+				/* Share the parent's frame where ksmd sees it at once,
+				 * so that it does not merge the parent's page and free
+				 * the frame in between. */
+				enum intr_level old_level = intr_disable ();
 				frame->kva = src_page->frame->kva;
-
+				frame->ksm = src_page->frame->ksm;
 				if (!pml4_set_page(thread_current()->pml4, page->va, frame->kva, false)) {
-					free(frame);
+					intr_set_level (old_level);
+					kmem_cache_free (frame_cache, frame);
 					goto err;
 				}
-
-				list_push_back(&frame_table, &frame->elem);
+				frame_table_insert (frame);
+				intr_set_level (old_level);
 
 				if(!swap_in(page, frame->kva)) {
 					goto err;
@@ -416,6 +691,13 @@ supplemental_page_table_kill (struct supplemental_page_table *spt UNUSED) {
 
 	// mytodo : dirty bit가 1이면 저장공간 내용 수정
 	hash_clear(&spt->spt_hash, action_func);
+
+	/* The pages' destructors leave them mapped.  Unmap them all in
+	 * one pass, which also frees the page tables, so that
+	 * pml4_destroy() has little left to walk. */
+	if (thread_current ()->pml4 != NULL)
+		pml4_clear_range (thread_current ()->pml4, NULL,
+				KERN_BASE / PGSIZE);
 	// /**/printf("------- supplemental_page_table_kill end -------\n");
 }
 
@@ -426,7 +708,7 @@ supplemental_page_table_kill (struct supplemental_page_table *spt UNUSED) {
 void action_func(struct hash_elem *e, void *aux) {
 	struct page *page = hash_entry(e, struct page, elem);
 	destroy(page);
-	free(page);
+	kmem_cache_free (page_cache, page);
 }
 
 uint64_t hs_hash_func(const struct hash_elem *e, void *aux UNUSED) {
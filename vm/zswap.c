@@ -0,0 +1,432 @@
+/* zswap.c: Compressed in-memory cache for anonymous pages on their
+ * way to the swap disk. */
+
+#include "vm/zswap.h"
+#include <bitmap.h>
+#include <debug.h>
+#include <list.h>
+#include <round.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+#include "vm/vm.h"
+
+/* Writing an evicted anonymous page to the swap disk, and reading
+   it back on the next fault, takes eight sector transfers each
+   way.  Instead, anon_swap_out() first offers the page to this
+   cache, which compresses it with a small LZ77 compressor and
+   keeps the result in a pool of kernel pages.  A fault on the page
+   then costs only its decompression.
+
+   The pool holds at most zswap_pool_limit pages, set with the
+   -zswap kernel option; -zswap=0 turns the cache off.  When it is
+   full, the pool page least recently stored into is written back:
+   each page compressed in it is decompressed and written to a swap
+   slot, just as anon_swap_out() would have done in the first
+   place, and the pool page is reused.  Pages that do not compress
+   to STORE_MAX bytes or less go straight to the swap disk.
+
+   Each pool page is divided into CHUNK_CNT chunks.  The first
+   holds a struct pool_page, and each compressed page takes a run
+   of the rest, starting with a struct zobj. */
+
+/* Pool page layout. */
+#define CHUNK_SIZE 64
+#define CHUNK_CNT (PGSIZE / CHUNK_SIZE)
+
+/* Largest compressed page worth keeping. */
+#define STORE_MAX (PGSIZE / 4 * 3)
+
+/* A page in the pool. */
+struct pool_page {
+	struct list_elem elem;      /* In pool_pages. */
+	uint64_t used;              /* Bit I set if chunk I is in use. */
+	uint64_t starts;            /* Bit I set if a zobj starts at chunk I. */
+	size_t free_chunks;         /* Number of chunks not in use. */
+};
+
+/* A compressed page, followed by its compressed bytes. */
+struct zobj {
+	struct page *owner;         /* Page compressed. */
+	uint16_t len;               /* Number of compressed bytes. */
+};
+
+/* Default for zswap_pool_limit. */
+#define POOL_LIMIT_DEFAULT 128
+
+size_t zswap_pool_limit = POOL_LIMIT_DEFAULT;
+
+static struct lock zswap_lock;
+static struct list pool_pages;  /* Least recently stored into first. */
+static size_t pool_page_cnt;    /* Number of pages in pool_pages. */
+static uint8_t *cbuf;           /* Compressor output. */
+static uint8_t *wbuf;           /* Writeback buffer. */
+
+/* Statistics. */
+static size_t zobj_cnt;         /* Pages now stored. */
+static size_t zobj_bytes;       /* Their compressed bytes. */
+static unsigned long long store_cnt;    /* Pages stored. */
+static unsigned long long load_cnt;     /* Pages loaded. */
+static unsigned long long reject_cnt;   /* Pages that did not compress. */
+static unsigned long long writeback_cnt;        /* Pages written back. */
+
+/* LZ77 compression.
+
+   The compressed form is a sequence of items, each starting with a
+   control byte C.  If C < 32, it is followed by C + 1 literal
+   bytes.  Otherwise, the item copies LEN bytes that start OFF
+   bytes back in the output, where LEN - 2 is C >> 5, or 7 plus the
+   next byte if that is 7, and OFF - 1 is (C & 31) << 8 plus the
+   item's last byte.  Matches are found through a hash table of the
+   last position where each 3-byte sequence was seen, which is
+   never cleared, since matches are checked byte by byte. */
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (2 + 7 + 255)
+#define LZ_MAX_LITERAL 32
+#define LZ_MAX_OFFSET 8192
+
+static uint16_t lz_table[1 << LZ_HASH_BITS];
+
+/* Returns the hash of the 3 bytes at P. */
+static inline size_t
+lz_hash (const uint8_t *p) {
+	uint32_t v = (uint32_t) p[0] << 16 | p[1] << 8 | p[2];
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Writes the CNT literal bytes at LIT to OP, which ends at OP_END.
+   Returns the new end of the output, or a null pointer if it does
+   not fit. */
+static uint8_t *
+lz_literals (uint8_t *op, uint8_t *op_end, const uint8_t *lit,
+		size_t cnt) {
+	while (cnt > 0) {
+		size_t n = cnt < LZ_MAX_LITERAL ? cnt : LZ_MAX_LITERAL;
+
+		if ((size_t) (op_end - op) < n + 1)
+			return NULL;
+		*op++ = n - 1;
+		memcpy (op, lit, n);
+		op += n;
+		lit += n;
+		cnt -= n;
+	}
+	return op;
+}
+
+/* Writes a match of LEN bytes at OFF bytes back to OP, which ends
+   at OP_END.  Returns the new end of the output, or a null pointer
+   if it does not fit. */
+static uint8_t *
+lz_match (uint8_t *op, uint8_t *op_end, size_t off, size_t len) {
+	size_t code = len - 2;
+
+	if (op_end - op < 3)
+		return NULL;
+	off--;
+	if (code < 7)
+		*op++ = code << 5 | off >> 8;
+	else {
+		*op++ = 7 << 5 | off >> 8;
+		*op++ = code - 7;
+	}
+	*op++ = off & 0xff;
+	return op;
+}
+
+/* Compresses the LEN bytes at IN into at most OUT_MAX bytes at
+   OUT.  Returns the compressed size, or 0 if it would exceed
+   OUT_MAX.  LEN must be less than 65536.  zswap_lock must be
+   held, since lz_table is shared. */
+static size_t
+lz_compress (const uint8_t *in, size_t len, uint8_t *out, size_t out_max) {
+	const uint8_t *ip = in, *anchor = in, *end = in + len;
+	uint8_t *op = out, *op_end = out + out_max;
+
+	while (end - ip >= LZ_MIN_MATCH) {
+		size_t h = lz_hash (ip);
+		const uint8_t *ref = in + lz_table[h];
+
+		lz_table[h] = ip - in;
+		if (ref < ip && ip - ref <= LZ_MAX_OFFSET
+				&& ref[0] == ip[0] && ref[1] == ip[1] && ref[2] == ip[2]) {
+			size_t max = end - ip < LZ_MAX_MATCH ? end - ip : LZ_MAX_MATCH;
+			size_t match = LZ_MIN_MATCH;
+
+			while (match < max && ref[match] == ip[match])
+				match++;
+			op = lz_literals (op, op_end, anchor, ip - anchor);
+			if (op == NULL)
+				return 0;
+			op = lz_match (op, op_end, ip - ref, match);
+			if (op == NULL)
+				return 0;
+			ip += match;
+			anchor = ip;
+		} else
+			ip++;
+	}
+	op = lz_literals (op, op_end, anchor, end - anchor);
+	return op != NULL ? (size_t) (op - out) : 0;
+}
+
+/* Decompresses the LEN bytes at IN into at most OUT_MAX bytes at
+   OUT.  Returns the decompressed size, or 0 if IN is corrupt. */
+static size_t
+lz_decompress (const uint8_t *in, size_t len, uint8_t *out, size_t out_max) {
+	const uint8_t *ip = in, *ip_end = in + len;
+	uint8_t *op = out, *op_end = out + out_max;
+
+	while (ip < ip_end) {
+		unsigned c = *ip++;
+
+		if (c < LZ_MAX_LITERAL) {
+			size_t n = c + 1;
+
+			if ((size_t) (ip_end - ip) < n || (size_t) (op_end - op) < n)
+				return 0;
+			memcpy (op, ip, n);
+			ip += n;
+			op += n;
+		} else {
+			size_t n = c >> 5, off;
+			const uint8_t *ref;
+
+			if (n == 7) {
+				if (ip >= ip_end)
+					return 0;
+				n += *ip++;
+			}
+			n += 2;
+			if (ip >= ip_end)
+				return 0;
+			off = ((c & 31) << 8 | *ip++) + 1;
+			if (off > (size_t) (op - out) || n > (size_t) (op_end - op))
+				return 0;
+			for (ref = op - off; n > 0; n--)
+				*op++ = *ref++;
+		}
+	}
+	return op - out;
+}
+
+/* Returns the number of chunks taken by a zobj of LEN bytes. */
+static inline size_t
+zobj_chunks (size_t len) {
+	return DIV_ROUND_UP (sizeof (struct zobj) + len, CHUNK_SIZE);
+}
+
+/* Initializes PP as an empty pool page. */
+static void
+pool_page_init (struct pool_page *pp) {
+	pp->used = 1;
+	pp->starts = 0;
+	pp->free_chunks = CHUNK_CNT - 1;
+}
+
+/* Allocates a run of CNT chunks in PP and returns a zobj in it,
+   or a null pointer if PP has no such run. */
+static struct zobj *
+chunk_alloc (struct pool_page *pp, size_t cnt) {
+	uint64_t mask = ((uint64_t) 1 << cnt) - 1;
+	size_t i;
+
+	ASSERT (cnt < CHUNK_CNT);
+	if (pp->free_chunks < cnt)
+		return NULL;
+	for (i = 1; i + cnt <= CHUNK_CNT; i++)
+		if (!(pp->used & (mask << i))) {
+			pp->used |= mask << i;
+			pp->starts |= (uint64_t) 1 << i;
+			pp->free_chunks -= cnt;
+			return (struct zobj *) ((uint8_t *) pp + i * CHUNK_SIZE);
+		}
+	return NULL;
+}
+
+/* Frees the chunks of O, leaving its pool page in the pool even if
+   it is now empty. */
+static void
+zobj_free (struct zobj *o) {
+	struct pool_page *pp = pg_round_down (o);
+	size_t i = ((uint8_t *) o - (uint8_t *) pp) / CHUNK_SIZE;
+	size_t cnt = zobj_chunks (o->len);
+	uint64_t mask = (((uint64_t) 1 << cnt) - 1) << i;
+
+	ASSERT (pp->starts & ((uint64_t) 1 << i));
+	ASSERT ((pp->used & mask) == mask);
+	pp->used &= ~mask;
+	pp->starts &= ~((uint64_t) 1 << i);
+	pp->free_chunks += cnt;
+	zobj_cnt--;
+	zobj_bytes -= o->len;
+}
+
+/* Frees the chunks of O, and its pool page if that is left empty. */
+static void
+zobj_release (struct zobj *o) {
+	struct pool_page *pp = pg_round_down (o);
+
+	zobj_free (o);
+	if (pp->free_chunks == CHUNK_CNT - 1) {
+		list_remove (&pp->elem);
+		palloc_free_page (pp);
+		pool_page_cnt--;
+	}
+}
+
+/* Writes each page stored in PP to the swap disk, leaving PP
+   empty, unless swap fills up first. */
+static void
+writeback (struct pool_page *pp) {
+	size_t i;
+
+	for (i = 1; i < CHUNK_CNT; i++)
+		if (pp->starts & ((uint64_t) 1 << i)) {
+			struct zobj *o = (struct zobj *) ((uint8_t *) pp + i * CHUNK_SIZE);
+			struct anon_page *anon = &o->owner->anon;
+			size_t slot;
+
+			if (lz_decompress ((uint8_t *) (o + 1), o->len, wbuf, PGSIZE)
+					!= PGSIZE)
+				PANIC ("zswap: page %p is corrupt", o->owner->va);
+			slot = anon_write_slot (wbuf);
+			if (slot == BITMAP_ERROR)
+				return;
+			anon->slot = slot;
+			anon->zobj = NULL;
+			zobj_free (o);
+			writeback_cnt++;
+		}
+}
+
+/* Returns a new zobj of CNT chunks, adding a page to the pool or
+   writing back the least recently stored pool page if all are
+   full, or a null pointer if neither is possible. */
+static struct zobj *
+zobj_alloc (size_t cnt) {
+	struct pool_page *pp;
+	struct zobj *o = NULL;
+	struct list_elem *e;
+
+	for (e = list_rbegin (&pool_pages); e != list_rend (&pool_pages);
+			e = list_prev (e)) {
+		pp = list_entry (e, struct pool_page, elem);
+		o = chunk_alloc (pp, cnt);
+		if (o != NULL)
+			break;
+	}
+
+	if (o == NULL && pool_page_cnt < zswap_pool_limit
+			&& (pp = palloc_get_page (0)) != NULL) {
+		pool_page_init (pp);
+		list_push_back (&pool_pages, &pp->elem);
+		pool_page_cnt++;
+		o = chunk_alloc (pp, cnt);
+	}
+
+	if (o == NULL && !list_empty (&pool_pages)) {
+		pp = list_entry (list_front (&pool_pages), struct pool_page, elem);
+		writeback (pp);
+		o = chunk_alloc (pp, cnt);
+	}
+
+	if (o != NULL) {
+		list_remove (&pp->elem);
+		list_push_back (&pool_pages, &pp->elem);
+		zobj_cnt++;
+	}
+	return o;
+}
+
+/* Sets up the cache.  Called by vm_anon_init(). */
+void
+zswap_init (void) {
+	lock_init (&zswap_lock);
+	list_init (&pool_pages);
+	if (zswap_pool_limit == 0)
+		return;
+
+	cbuf = palloc_get_page (PAL_ASSERT);
+	wbuf = palloc_get_page (PAL_ASSERT);
+}
+
+/* Compresses PAGE, whose contents are at KVA, into the cache.
+   Returns true if successful, false if the caller must write it
+   to the swap disk itself. */
+bool
+zswap_store (struct page *page, const void *kva) {
+	struct zobj *o = NULL;
+	size_t len;
+
+	ASSERT (page->anon.zobj == NULL);
+	if (cbuf == NULL)
+		return false;
+
+	lock_acquire (&zswap_lock);
+	len = lz_compress (kva, PGSIZE, cbuf, STORE_MAX);
+	if (len == 0)
+		reject_cnt++;
+	else if ((o = zobj_alloc (zobj_chunks (len))) != NULL) {
+		o->owner = page;
+		o->len = len;
+		memcpy (o + 1, cbuf, len);
+		page->anon.zobj = o;
+		zobj_bytes += len;
+		store_cnt++;
+	}
+	lock_release (&zswap_lock);
+	return o != NULL;
+}
+
+/* Decompresses PAGE from the cache into KVA and drops it from the
+   cache.  Returns false if PAGE is not in the cache. */
+bool
+zswap_load (struct page *page, void *kva) {
+	struct zobj *o;
+
+	if (cbuf == NULL)
+		return false;
+
+	lock_acquire (&zswap_lock);
+	o = page->anon.zobj;
+	if (o != NULL) {
+		if (lz_decompress ((uint8_t *) (o + 1), o->len, kva, PGSIZE)
+				!= PGSIZE)
+			PANIC ("zswap: page %p is corrupt", page->va);
+		page->anon.zobj = NULL;
+		zobj_release (o);
+		load_cnt++;
+	}
+	lock_release (&zswap_lock);
+	return o != NULL;
+}
+
+/* Drops PAGE from the cache, if it is there. */
+void
+zswap_invalidate (struct page *page) {
+	if (cbuf == NULL)
+		return;
+
+	lock_acquire (&zswap_lock);
+	if (page->anon.zobj != NULL) {
+		zobj_release (page->anon.zobj);
+		page->anon.zobj = NULL;
+	}
+	lock_release (&zswap_lock);
+}
+
+/* Prints cache statistics. */
+void
+zswap_print_stats (void) {
+	if (cbuf == NULL)
+		return;
+	printf ("Zswap: %zu pages in %zu pool pages (%zu bytes compressed), "
+			"%llu stores, %llu loads, %llu rejected, %llu written back\n",
+			zobj_cnt, pool_page_cnt, zobj_bytes, store_cnt, load_cnt,
+			reject_cnt, writeback_cnt);
+}